@@ -3,6 +3,7 @@
 #include "ImGuiExt.h"
 #include "Config.h"
 #include "utility/Filesystem.h"
+#include "vm/Grammar.h"
 #include <imgui.h>
 
 CVar CVar_UIScale("UI Scale", ConfigType::Float,
@@ -196,12 +197,13 @@ void Gui::DrawVariables()
     ImGuiTableFlags tableFlags = ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter |
         ImGuiTableFlags_BordersV | ImGuiTableFlags_Resizable | ImGuiTableFlags_Reorderable |
         ImGuiTableFlags_Hideable;
-    if (ImGui::BeginTable("VariablesTable", 2, tableFlags))
+    if (ImGui::BeginTable("VariablesTable", 3, tableFlags))
     {
         //Setup columns
         ImGui::TableSetupScrollFreeze(0, 1); //Make header row always visible when scrolling
         ImGui::TableSetupColumn("Address", ImGuiTableFlags_None);
         ImGui::TableSetupColumn("Value", ImGuiTableFlags_None);
+        ImGui::TableSetupColumn("Watch", ImGuiTableFlags_None);
         //Todo: Add variable names. Requires debug information stored in VmProgram
         ImGui::TableHeadersRow();
 
@@ -218,6 +220,20 @@ void Gui::DrawVariables()
             //Column 1
             ImGui::TableSetColumnIndex(1);
             ImGui::Text(std::to_string(variable));
+
+            //Column 2. Pauses the robot before the variable is written.
+            ImGui::TableSetColumnIndex(2);
+            const u16 address = (u16)((u8*)&variable - robot->Vm->Memory);
+            bool watched = robot->Vm->Watched(address);
+            ImGui::PushID(address);
+            if (ImGui::Checkbox("##Watch", &watched))
+            {
+                if (watched)
+                    robot->Vm->AddWatchpoint(address);
+                else
+                    robot->Vm->RemoveWatchpoint(address);
+            }
+            ImGui::PopID();
         }
 
         ImGui::EndTable();
@@ -261,7 +277,7 @@ void Gui::DrawStack()
         ImGui::TableHeadersRow();
 
         //Fill table
-        for (u32 i = VM::MEMORY_SIZE - sizeof(VmValue); i > robot->Vm->SP; i -= sizeof(VmValue))
+        for (u32 i = robot->Vm->MemorySize() - sizeof(VmValue); i > robot->Vm->SP; i -= sizeof(VmValue))
         {
             ImGui::TableNextRow();
 
@@ -269,9 +285,20 @@ void Gui::DrawStack()
             ImGui::TableSetColumnIndex(0);
             ImGui::Text(std::to_string(i));
 
-            //Column 1
+            //Column 1. Right click a return address to pause the robot when it returns there.
             ImGui::TableSetColumnIndex(1);
-            ImGui::Text(std::to_string(*(VmValue*)&robot->Vm->Memory[i]));
+            const VmValue value = *(VmValue*)&robot->Vm->Memory[i];
+            ImGui::Text(std::to_string(value));
+            const bool instructionAddress = value >= (VmValue)VM::RESERVED_BYTES && value < (VmValue)(VM::RESERVED_BYTES + robot->Vm->InstructionsSize()) && (value - VM::RESERVED_BYTES) % sizeof(Instruction) == 0;
+            ImGui::PushID(i);
+            if (instructionAddress && ImGui::BeginPopupContextItem("StackBreakpoint"))
+            {
+                if (ImGui::MenuItem(("Break at " + std::to_string(value)).c_str()))
+                    robot->Vm->SetBreakpoint(Breakpoint{ (u16)value });
+
+                ImGui::EndPopup();
+            }
+            ImGui::PopID();
         }
 
         ImGui::EndTable();
@@ -314,20 +341,109 @@ void Gui::DrawDisassembler()
         ImGui::HelpMarker("If checked, actual opcode names are used instead of assembly instruction names. "
                           "Some assembly instructions can be converted to multiple different opcodes depending on their arguments.", _app->Fonts.Medium.GetPtr());
 
+        bool profiling = robot->Vm->Profile() != nullptr;
+        if (ImGui::Checkbox("Profile", &profiling))
+            robot->Vm->EnableProfiler(profiling);
+        ImGui::SameLine();
+        ImGui::HelpMarker("If checked, the VM counts how many times each instruction runs and the cycles it uses. "
+                          "Instructions are shaded by how many cycles they use compared to the most expensive one. The VM runs slower while profiling.", _app->Fonts.Medium.GetPtr());
+        if (profiling)
+        {
+            ImGui::SameLine();
+            if (ImGui::Button("Reset"))
+                robot->Vm->ResetProfile();
+        }
+
+        bool tracing = robot->Vm->Trace() != nullptr;
+        if (ImGui::Checkbox("Trace", &tracing))
+            robot->Vm->EnableTrace(tracing ? 1 << 16 : 0); //Last 65536 instructions. 1MB per robot.
+        ImGui::SameLine();
+        ImGui::HelpMarker("If checked, the VM records the last 65536 instructions it ran along with the registers and ports they wrote. "
+                          "Save writes them next to the robot source file. Decode the file with the VmTraceDecode tool.", _app->Fonts.Medium.GetPtr());
+        if (tracing)
+        {
+            ImGui::SameLine();
+            if (ImGui::Button("Save"))
+                robot->Vm->Trace()->Write(robot->SourcePath() + ".trace");
+        }
+
         ImGui::Unindent(indent);
     }
 
-    //Draw disassembler output
+    //Debugger controls. Robots pause when they reach a breakpoint or write a watched variable.
+    if (robot->Paused)
+    {
+        ImGui::TextColored("Paused at " + std::to_string(robot->Vm->PC), { 1.0f, 0.6f, 0.0f, 1.0f });
+        ImGui::SameLine();
+        if (ImGui::Button(ICON_FA_PLAY " Continue"))
+            robot->Paused = false;
+        ImGui::SameLine();
+        if (ImGui::Button(ICON_FA_STEP_FORWARD " Step"))
+            robot->Step(1.0f / (f32)std::max(_app->Arena.CyclesPerSecond, 1u));
+        ImGui::SameLine();
+        ImGui::HelpMarker("Step runs a single cycle. Instructions that take more than one cycle need several steps.", _app->Fonts.Medium.GetPtr());
+    }
+    else if (ImGui::Button(ICON_FA_PAUSE " Pause"))
+    {
+        robot->Paused = true;
+    }
+
+    //Port accesses split by port
+    const VmProfile* profile = robot->Vm->Profile();
     ImGuiTableFlags tableFlags = ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter |
         ImGuiTableFlags_BordersV | ImGuiTableFlags_Resizable | ImGuiTableFlags_Reorderable |
         ImGuiTableFlags_Hideable;
-    if (ImGui::BeginTable("DisassemblerTable", 3, tableFlags))
+    if (profile && ImGui::CollapsingHeader("Ports"))
+    {
+        ImGui::LabelAndValue("Cycles:", std::to_string(profile->Cycles));
+        ImGui::LabelAndValue("Suspended cycles:", std::to_string(profile->SuspendedCycles));
+        if (ImGui::BeginTable("PortProfileTable", 4, tableFlags, { 0.0f, 200.0f }))
+        {
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableSetupColumn("Port", ImGuiTableFlags_None);
+            ImGui::TableSetupColumn("Reads", ImGuiTableFlags_None);
+            ImGui::TableSetupColumn("Writes", ImGuiTableFlags_None);
+            ImGui::TableSetupColumn("Cycles", ImGuiTableFlags_None);
+            ImGui::TableHeadersRow();
+
+            for (u32 i = 0; i < (u32)Port::NumPorts; i++)
+            {
+                const VmProfile::PortCounters& port = profile->Ports[i];
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0);
+                ImGui::Text(std::string(magic_enum::enum_name((Port)i)));
+                ImGui::TableSetColumnIndex(1);
+                ImGui::Text(std::to_string(port.Reads));
+                ImGui::TableSetColumnIndex(2);
+                ImGui::Text(std::to_string(port.Writes));
+                ImGui::TableSetColumnIndex(3);
+                ImGui::Text(std::to_string(port.Cycles));
+            }
+
+            ImGui::EndTable();
+        }
+    }
+
+    //Used to shade instructions by the cycles they use relative to the most expensive one
+    u64 maxCycles = 0;
+    if (profile)
+        for (const VmProfile::InstructionCounters& counters : profile->Instructions)
+            maxCycles = std::max(maxCycles, counters.Cycles);
+
+    //Draw disassembler output
+    if (ImGui::BeginTable("DisassemblerTable", profile ? 6 : 4, tableFlags))
     {
         //Setup columns
         ImGui::TableSetupScrollFreeze(0, 1); //Make header row always visible when scrolling
+        ImGui::TableSetupColumn(ICON_FA_CIRCLE, ImGuiTableFlags_None);
         ImGui::TableSetupColumn("Address", ImGuiTableFlags_None);
         ImGui::TableSetupColumn("Disassembly", ImGuiTableFlags_None);
         ImGui::TableSetupColumn("Cycles", ImGuiTableFlags_None);
+        if (profile)
+        {
+            ImGui::TableSetupColumn("Executions", ImGuiTableFlags_None);
+            ImGui::TableSetupColumn("Cycles used", ImGuiTableFlags_None);
+        }
         ImGui::TableHeadersRow();
 
         //Fill table
@@ -338,17 +454,72 @@ void Gui::DrawDisassembler()
             const Instruction& instruction = instructions[i];
             u32 address = (u8*)&instruction - robot->Vm->Memory; //Instruction address in VM memory
 
-            //Column 0
+            //Highlight the instruction a paused robot stopped at
+            if (robot->Paused && address == robot->Vm->PC)
+                ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, ImGui::GetColorU32({ 1.0f, 0.6f, 0.0f, 0.35f }));
+
+            //Column 0. Click to toggle a breakpoint. Right click to set the condition it stops on.
             ImGui::TableSetColumnIndex(0);
-            ImGui::Text(std::to_string(address).c_str());
+            ImGui::PushID(i);
+            if (ImGui::Selectable(robot->Vm->GetBreakpoint(address) ? ICON_FA_CIRCLE : " "))
+            {
+                if (robot->Vm->GetBreakpoint(address))
+                    robot->Vm->RemoveBreakpoint(address);
+                else
+                    robot->Vm->SetBreakpoint(Breakpoint{ (u16)address });
+            }
+            if (ImGui::BeginPopupContextItem("BreakpointCondition"))
+            {
+                static const char* conditions[] = { "Always", "Register == value", "Register != value", "Register < value", "Register > value" };
+                const Breakpoint* existing = robot->Vm->GetBreakpoint(address);
+                Breakpoint breakpoint = existing ? *existing : Breakpoint{ (u16)address };
+                i32 condition = (i32)breakpoint.Condition;
+                i32 reg = breakpoint.Register;
+                i32 value = breakpoint.Value;
+                bool changed = ImGui::Combo("Condition", &condition, conditions, (i32)std::size(conditions));
+                changed |= ImGui::SliderInt("Register", &reg, 0, VM::NUM_REGISTERS - 1);
+                changed |= ImGui::InputInt("Value", &value);
+                if (changed)
+                {
+                    breakpoint.Condition = (BreakCondition)condition;
+                    breakpoint.Register = (u8)reg;
+                    breakpoint.Value = (VmValue)value;
+                    robot->Vm->SetBreakpoint(breakpoint);
+                }
+                if (existing && ImGui::Button("Remove"))
+                {
+                    robot->Vm->RemoveBreakpoint(address);
+                    ImGui::CloseCurrentPopup();
+                }
+                ImGui::EndPopup();
+            }
+            ImGui::PopID();
 
             //Column 1
             ImGui::TableSetColumnIndex(1);
-            ImGui::Text(to_string(instruction, useRealOpcodeNames).c_str());
+            ImGui::Text(std::to_string(address).c_str());
 
             //Column 2
             ImGui::TableSetColumnIndex(2);
+            ImGui::Text(to_string(instruction, useRealOpcodeNames).c_str());
+
+            //Column 3
+            ImGui::TableSetColumnIndex(3);
             ImGui::Text(std::to_string(robot->Vm->GetInstructionDuration(instruction)).c_str());
+
+            //Profiler columns. Cycles used is shaded red by how hot the instruction is.
+            if (profile && i < profile->Instructions.size())
+            {
+                const VmProfile::InstructionCounters& counters = profile->Instructions[i];
+                ImGui::TableSetColumnIndex(4);
+                ImGui::Text(std::to_string(counters.Executions));
+
+                ImGui::TableSetColumnIndex(5);
+                const f32 heat = maxCycles ? (f32)counters.Cycles / (f32)maxCycles : 0.0f;
+                const f32 percent = profile->Cycles ? 100.0f * (f32)counters.Cycles / (f32)profile->Cycles : 0.0f;
+                ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, ImGui::GetColorU32({ 1.0f, 0.25f, 0.0f, 0.75f * heat }));
+                ImGui::Text(std::to_string(counters.Cycles) + " (" + std::to_string((u32)std::round(percent)) + "%)");
+            }
         }
 
         ImGui::EndTable();
@@ -382,7 +553,7 @@ void Gui::DrawVmState()
     const u32 min = 0;
     const u32 max = 1000;
     ImGui::SliderScalar("Cycles/second", ImGuiDataType_U32, &_app->Arena.CyclesPerSecond, &min, &max);
-    ImGui::LabelAndValue("Memory size:", std::to_string(robot->Vm->MEMORY_SIZE) + " bytes");
+    ImGui::LabelAndValue("Memory size:", std::to_string(robot->Vm->MemorySize()) + " bytes");
     ImGui::LabelAndValue("Program size:", std::to_string(robot->Vm->InstructionsSize()) + " bytes");
     ImGui::LabelAndValue("Variables size:", std::to_string(robot->Vm->VariablesSize()) + " bytes");
     ImGui::LabelAndValue("Stack size:", std::to_string(robot->Vm->StackSize()) + "/" + std::to_string(robot->Vm->MaxStackSize()) + " bytes");
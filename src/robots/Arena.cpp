@@ -185,12 +185,23 @@ void Arena::Reset(const std::vector<std::string>& botsToAdd)
 
     //Add bots to the arena
     Vec2<f32> arenaCenter = Position + (Size / 2.0f);
+    std::unordered_map<std::string, std::shared_ptr<const ProgramImage>> programs = {}; //Bots running the same program share one copy of it
     for (const std::string& name : botsToAddFinal)
     {
         //Create bot
         Robot* robot = Robots.emplace_back(new Robot());
         std::string path = BuildConfig::RobotFolderPath + name + ".sunyat";
-        robot->LoadProgramFromSource(path);
+        auto search = programs.find(path);
+        if (search != programs.end())
+        {
+            robot->LoadProgram(search->second, path);
+        }
+        else
+        {
+            robot->LoadProgramFromSource(path);
+            if (robot->Vm->Program())
+                programs[path] = robot->Vm->Program();
+        }
         
         //Random position
         robot->Position = Position;
@@ -3,6 +3,13 @@
 #include "render/Renderer.h"
 #include "utility/Sound.h"
 #include "Arena.h"
+#include <algorithm>
+
+//Convert hardware state to a port value. Saturates instead of overflowing when it doesn't fit in a VM word. E.g. distances in large arenas with 16 bit words.
+static VmValue ToPortValue(f32 value)
+{
+    return (VmValue)std::clamp((f64)value, (f64)std::numeric_limits<VmValue>::min(), (f64)std::numeric_limits<VmValue>::max());
+}
 
 Robot::Robot()
 {
@@ -16,6 +23,8 @@ void Robot::Update(Arena& arena, f32 deltaTime, u32 cyclesPerSecond)
 {
     if (Error || Armor <= 0)
         return; //Dead. Waiting for cleanup
+    if (Paused)
+        return; //Stopped by the debugger
 
     LastPosition = Position;
     _cycleAccumulator += deltaTime;
@@ -49,21 +58,29 @@ void Robot::Update(Arena& arena, f32 deltaTime, u32 cyclesPerSecond)
     }
     else
     {
-
-
-        //Cycle VM
-        for (u32 i = 0; i < cyclesToExecute; i++)
+        //Run VM. It stops early when a port is accessed so hardware is up to date with the cycle the access happens on.
+        //Cycles spent suspended by wait or hlt pass in a single Run() call, so idle robots update their hardware in one step.
+        u32 cyclesRemaining = cyclesToExecute;
+        while (cyclesRemaining > 0)
         {
-            Result<void, VMError> cycleResult = Vm->Cycle(cycleDelta);
-            if (cycleResult.Error())
+            const VMStatus status = Vm->Run(cyclesRemaining, cycleDelta);
+            if (!status.Ok)
             {
-                VMError& error = cycleResult.Error().value();
-                printf("Error in VM::Cycle()! Code: %s, Message: %s\n", to_string(error.Code).c_str(), error.Message.c_str());
+                printf("Error in VM::Run()! Code: %s, Message: %s\n", to_string(status.Code).c_str(), status.Message().c_str());
                 Error = true;
                 return;
             }
 
-            UpdateHardware(cycleDelta);
+            const u32 cyclesElapsed = status.CyclesElapsed;
+            cyclesRemaining -= cyclesElapsed;
+            UpdateHardware(cycleDelta * cyclesElapsed);
+            if (status.Breakpoint)
+            {
+                //Drop the rest of the cycles so it doesn't jump ahead when it's resumed
+                Paused = true;
+                _cycleAccumulator = 0.0f;
+                break;
+            }
         }
 
         //Update overheat status
@@ -73,6 +90,25 @@ void Robot::Update(Arena& arena, f32 deltaTime, u32 cyclesPerSecond)
 
 }
 
+void Robot::Step(f32 cycleDelta)
+{
+    if (Error || Armor <= 0 || !_arena)
+        return;
+
+    //Reaching a breakpoint stops before any cycles pass. Run again so each step moves one cycle.
+    VMStatus status = Vm->Run(1, cycleDelta, false);
+    if (status.Breakpoint)
+        status = Vm->Run(1, cycleDelta, false);
+    if (!status.Ok)
+    {
+        printf("Error in VM::Run()! Code: %s, Message: %s\n", to_string(status.Code).c_str(), status.Message().c_str());
+        Error = true;
+        return;
+    }
+
+    UpdateHardware(cycleDelta * status.CyclesElapsed);
+}
+
 void Robot::UpdateHardware(f32 deltaTime)
 {
     //Movement
@@ -84,26 +120,33 @@ void Robot::UpdateHardware(f32 deltaTime)
     Heat = std::max(0.0f, Heat);
     if (Heat >= HeatDamageThreshold)
         Armor -= OverHeatDamageFrequency * deltaTime;
+
+    //Interrupt once each time heat reaches the damage threshold
+    const bool aboveHeatThreshold = Heat >= HeatDamageThreshold;
+    if (aboveHeatThreshold && !_aboveHeatThreshold)
+        Vm->RaiseInterrupt(Interrupt::Heat);
+    _aboveHeatThreshold = aboveHeatThreshold;
 }
 
-void Robot::OnPortRead(Port port, f32 deltaTime)
+template<Port port>
+void Robot::OnPortRead(f32 deltaTime)
 {
-    //VM executed ipo. Write hardware state to port if applicable
+    //VM executed ipo. Write hardware state to port if applicable. port is constant so each instantiation only keeps its own case.
     //Ports that do nothing in this function are write only
     switch (port)
     {
         case Port::Spedometer:
-            Vm->GetPort(Port::Spedometer) = Speed;
+            Vm->GetPort(Port::Spedometer) = ToPortValue(Speed);
             break;
         case Port::Steering:
             break;
         case Port::TurretShoot:
             break;
         case Port::TurretRotateOffset:
-            Vm->GetPort(Port::TurretRotateOffset) = TurretAngle - Angle;
+            Vm->GetPort(Port::TurretRotateOffset) = ToPortValue(TurretAngle - Angle);
             break;
         case Port::TurretRotateAbsolute:
-            Vm->GetPort(Port::TurretRotateAbsolute) = TurretAngle;
+            Vm->GetPort(Port::TurretRotateAbsolute) = ToPortValue(TurretAngle);
             break;
         case Port::MineLayer:
             Vm->GetPort(Port::MineLayer) = NumMines;
@@ -123,7 +166,7 @@ void Robot::OnPortRead(Port port, f32 deltaTime)
                 {
                     //Write heading of nearest bot back to the port
                     const Vec2<f32> dir = (closestBot->Position - Position).Normalized();
-                    Vm->GetPort(Port::Sonar) = (VmValue)(dir.AngleUnitDegrees());
+                    Vm->GetPort(Port::Sonar) = ToPortValue(dir.AngleUnitDegrees());
                 }
             }
             break;
@@ -138,7 +181,7 @@ void Robot::OnPortRead(Port port, f32 deltaTime)
                 if (closestBot && closestBotDistance <= RadarSonarRange)
                 {
                     //Write distance of nearest bot back to the port
-                    Vm->GetPort(Port::Radar) = (closestBot->Position - Position).Length();
+                    Vm->GetPort(Port::Radar) = ToPortValue((closestBot->Position - Position).Length());
                 }
             }
             break;
@@ -152,27 +195,28 @@ void Robot::OnPortRead(Port port, f32 deltaTime)
                 if (closestBotArc)
                 {
                     //Write distance to robot back into the port
-                    Vm->GetPort(Port::Scanner) = (closestBotArc->Position - Position).Length();
+                    Vm->GetPort(Port::Scanner) = ToPortValue((closestBotArc->Position - Position).Length());
 
                     //Calculate accuracy
                     f32 angleToBot = (closestBotArc->Position - Position).AngleUnitDegrees();
                     Accuracy = angleToBot - TurretAngle;
+                    Vm->RaiseInterrupt(Interrupt::ScannerTarget);
                 }
             }
             break;
         case Port::ScannerArc:
-            Vm->GetPort(Port::ScannerArc) = _scannerArcWidth;
+            Vm->GetPort(Port::ScannerArc) = ToPortValue(_scannerArcWidth);
             break;
         case Port::Throttle:
             break;
         case Port::Heat:
-            Vm->GetPort(Port::Heat) = Heat;
+            Vm->GetPort(Port::Heat) = ToPortValue(Heat);
             break;
         case Port::Compass:
-            Vm->GetPort(Port::Compass) = Angle;
+            Vm->GetPort(Port::Compass) = ToPortValue(Angle);
             break;
         case Port::Armor:
-            Vm->GetPort(Port::Armor) = Armor;
+            Vm->GetPort(Port::Armor) = ToPortValue(Armor);
             break;
         case Port::Random:
         {
@@ -185,16 +229,17 @@ void Robot::OnPortRead(Port port, f32 deltaTime)
             Vm->GetPort(Port::Shield) = ShieldOn;
             break;
         case Port::Accuracy:
-            Vm->GetPort(Port::Accuracy) = Accuracy;
+            Vm->GetPort(Port::Accuracy) = ToPortValue(Accuracy);
             break;
         default:
             break;
     }
 }
 
-void Robot::OnPortWrite(Port port, VmValue value, f32 deltaTime)
+template<Port port>
+void Robot::OnPortWrite(VmValue value, f32 deltaTime)
 {
-    //VM executed opo. Update hardware connected to the port
+    //VM executed opo. Update hardware connected to the port. port is constant so each instantiation only keeps its own case.
     //Ports aren't required to be set to the provided value. It can be discarded after use.
     switch (port)
     {
@@ -228,6 +273,8 @@ void Robot::OnPortWrite(Port port, VmValue value, f32 deltaTime)
         {
             _arena->CreateMine(Position, ID(), MineDamage);
             NumMines--;
+            if (NumMines == 0)
+                Vm->RaiseInterrupt(Interrupt::MinesEmpty);
         }
         break;
     case Port::MineTrigger:
@@ -270,11 +317,22 @@ void Robot::OnPortWrite(Port port, VmValue value, f32 deltaTime)
     }
 }
 
+template<size_t... ports>
+PortHandlers Robot::MakePortHandlers(std::index_sequence<ports...>)
+{
+    return
+    {
+        { [](void* robot, f32 deltaTime) { ((Robot*)robot)->OnPortRead<(Port)ports>(deltaTime); }... },
+        { [](void* robot, VmValue value, f32 deltaTime) { ((Robot*)robot)->OnPortWrite<(Port)ports>(value, deltaTime); }... },
+    };
+}
+
+const PortHandlers Robot::VmPortHandlers = Robot::MakePortHandlers(std::make_index_sequence<(size_t)Port::NumPorts>());
+
 void Robot::Init()
 {
-    //Bind ports callbacks to VM
-    Vm->OnPortRead = std::bind(&Robot::OnPortRead, this, std::placeholders::_1, std::placeholders::_2);
-    Vm->OnPortWrite = std::bind(&Robot::OnPortWrite, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+    //Bind port handlers to VM
+    Vm->SetPortHandlers(&Robot::VmPortHandlers, this);
 
     //Read config values
     std::optional<VmValue> scanner = Vm->GetConfigOr("scanner");
@@ -653,6 +711,14 @@ void Robot::LoadProgramFromSource(std::string_view inFilePath)
     Init();
 }
 
+void Robot::LoadProgram(std::shared_ptr<const ProgramImage> program, std::string_view inFilePath)
+{
+    _sourceFileLastWriteTime = std::filesystem::last_write_time(inFilePath);
+    _sourceFilePath = inFilePath;
+    Vm->LoadProgram(program);
+    Init();
+}
+
 void Robot::TryReload()
 {
     //Recompile program if source file changed
@@ -706,6 +772,11 @@ void Robot::Damage(f32 damage)
 
     //Damage absorbed by shields gets turned into heat
     Heat += absorbedByShields;
+
+    //Programs suspended with hlt resume when the robot is hit. Ones with a damage interrupt handler run it first.
+    Vm->RaiseInterrupt(Interrupt::Damage);
+    if (Vm->Halted())
+        Vm->Wake();
 }
 
 bool Robot::PointInChassis(const Vec2<f32>& point) const
@@ -6,6 +6,7 @@
 #include <filesystem>
 #include <memory> //For std::unique_ptr<T>
 #include <array>
+#include <utility>
 
 class Renderer;
 class Arena;
@@ -22,6 +23,8 @@ public:
     void Draw(Renderer* renderer);
     //Load program from asm source file
     void LoadProgramFromSource(std::string_view inFilePath);
+    //Load a program already loaded by another robot. inFilePath is the source file it was compiled from.
+    void LoadProgram(std::shared_ptr<const ProgramImage> program, std::string_view inFilePath);
     //Recompile program if the source file was edited since last reload
     void TryReload();
     //Path of source file
@@ -37,6 +40,8 @@ public:
     bool PointInChassis(const Vec2<f32>& point) const;
     //Returns true if the robot chassis lies within the rectangle
     bool ChassisInRectangle(const Vec2<f32>& rectPos, const Vec2<f32>& rectSize) const;
+    //Run a single VM cycle and update hardware for it. Used by the debugger to step through a paused robot.
+    void Step(f32 cycleDelta);
 
     //Virtual machine that runs the robots logic program
     std::unique_ptr<VM> Vm = std::unique_ptr<VM>(new VM());
@@ -60,6 +65,8 @@ public:
 
     //Set to true when an error occurs. If true ::Update() is stopped until the error is resolved.
     bool Error = false;
+    //Set when the VM stops at a breakpoint or watchpoint. The robot is frozen until it's cleared.
+    bool Paused = false;
 
     static const inline f32 TurretLength = 12.0f; //Visual only
     static const inline VmValue TurretShootAngleControl = 4; //Num of degrees in either direction bullets can be shifted towards when shooting
@@ -82,8 +89,12 @@ private:
     void UpdateHardware(f32 deltaTime);
     //Called by the VM when ports are read (ipo) and written (opo)
     //This updates the ports with the latest hardware state on reads, and lets hardware respond to writes.
-    void OnPortRead(Port port, f32 deltaTime);
-    void OnPortWrite(Port port, VmValue value, f32 deltaTime);
+    //Instantiated for each port so the VM port handler table calls straight into the code for that port.
+    template<Port port> void OnPortRead(f32 deltaTime);
+    template<Port port> void OnPortWrite(VmValue value, f32 deltaTime);
+    //Build the port handler table passed to the VM
+    template<size_t... ports> static PortHandlers MakePortHandlers(std::index_sequence<ports...>);
+    static const PortHandlers VmPortHandlers;
     void Init();
 
     //Setup hardware based on values from #config directions in assembly
@@ -102,6 +113,7 @@ private:
     f32 _scannerRange = 250.0f;
     f32 _turretDamage = 1.0f;
     f32 _totalTime = 0.0f; //Sum of all delta times passed into ::Update()
+    bool _aboveHeatThreshold = false; //Heat was at or above HeatDamageThreshold last hardware update. Used to raise the heat interrupt once per crossing.
 
     //True if the hardware was used this frame. Used by renderer to draw circles/arcs/etc.
     bool _sonarOn = false;
@@ -1,5 +1,15 @@
 #include "File.h"
 #include <sstream>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace File
 {
@@ -38,6 +48,68 @@ namespace File
         return bytes;
     }
     
+    MappedFile::MappedFile(std::string_view inputFilePath)
+    {
+#ifdef _WIN32
+        //Open file
+        HANDLE file = CreateFileA(std::string(inputFilePath).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to open file \"" + std::string(inputFilePath) + "\"");
+
+        LARGE_INTEGER size = {};
+        GetFileSizeEx(file, &size);
+        _size = (size_t)size.QuadPart;
+
+        //Map it. The view keeps the file open, so the handles can be closed right away.
+        if (_size > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+            {
+                _data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        //Open file
+        int file = open(std::string(inputFilePath).c_str(), O_RDONLY);
+        if (file == -1)
+            throw std::runtime_error("Failed to open file \"" + std::string(inputFilePath) + "\"");
+
+        struct stat info = {};
+        fstat(file, &info);
+        _size = (size_t)info.st_size;
+
+        //Map it. The mapping keeps the file open, so it can be closed right away.
+        if (_size > 0)
+        {
+            void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, _size, MADV_SEQUENTIAL); //Files are read front to back
+                _data = (const char*)data;
+            }
+        }
+        close(file);
+#endif
+
+        if (_size > 0 && !_data)
+            throw std::runtime_error("Failed to map file \"" + std::string(inputFilePath) + "\"");
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (!_data)
+            return;
+
+#ifdef _WIN32
+        UnmapViewOfFile(_data);
+#else
+        munmap((void*)_data, _size);
+#endif
+    }
+
     void WriteAll(std::string_view inputFilePath, std::string_view data)
     {
         std::ofstream stream(std::string(inputFilePath), std::ofstream::out | std::ofstream::trunc);
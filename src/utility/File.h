@@ -11,6 +11,24 @@ namespace File
     std::string ReadAll(std::string_view inputFilePath);
     //Read file to a vector of bytes
     std::vector<u8> ReadAllBytes(std::string_view inputFilePath);
+
+    //Read only view of a file mapped into memory. The OS pages it in as it's read, so it's never copied into a string.
+    class MappedFile
+    {
+    public:
+        //Map a file. Throws std::runtime_error if it can't be opened.
+        MappedFile(std::string_view inputFilePath);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        //Contents of the file. Only valid while the MappedFile is alive.
+        std::string_view View() const { return std::string_view(_data, _size); }
+
+    private:
+        const char* _data = nullptr; //Null for empty files since they can't be mapped
+        size_t _size = 0;
+    };
     
     //Write string to a file. Overwrites existing contents of the file.
     void WriteAll(std::string_view inputFilePath, std::string_view data);
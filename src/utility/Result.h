@@ -3,12 +3,13 @@
 #include <type_traits>
 #include <optional>
 #include <variant>
+#include <utility>
 
 //Return this from functions using Result<T, U> when the function succeeds
 template<class T>
 struct Success
 {
-    Success(T data) : Data(data) {}
+    Success(T data) : Data(std::move(data)) {}
     T Data;
 };
 
@@ -16,7 +17,7 @@ struct Success
 template<class T>
 struct Error
 {
-    Error(T data) : Data(data) {}
+    Error(T data) : Data(std::move(data)) {}
     T Data;
 };
 
@@ -28,8 +29,8 @@ class Result
 {
 public:
     //Implicitly constructed by returning either a Success<ResultType> or Error<ErrorType> from the function
-    Result(Success<ResultType> success) : _data(success.Data) {}
-    Result(Error<ErrorType> error) : _data(error.Data) {}
+    Result(Success<ResultType> success) : _data(std::move(success.Data)) {}
+    Result(Error<ErrorType> error) : _data(std::move(error.Data)) {}
 
     //Get result state and data. Can check for error/success with `if (result.Success())` since std::optional<T> can be treated as a bool.
     std::optional<ResultType> Success() const { return std::holds_alternative<ResultType>(_data) ? std::get<ResultType>(_data) : std::optional<ResultType>{}; }
@@ -52,7 +53,7 @@ class Result<void, ErrorType>
 public:
     //Implicitly constructed by returning either a Success<void> or Error<ErrorType> from the function
     Result(Success<void> success) {}
-    Result(Error<ErrorType> error) : _data(error.Data) {}
+    Result(Error<ErrorType> error) : _data(std::move(error.Data)) {}
 
     //Get result state and data
     bool Success() const { return !_data.has_value(); }
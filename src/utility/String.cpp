@@ -61,6 +61,11 @@ namespace String
     }
 
     i16 ToShort(std::string_view str)
+    {
+        return (i16)ToInt(str);
+    }
+
+    i32 ToInt(std::string_view str)
     {
         //Determine number base
         int num = 0;
@@ -74,7 +79,7 @@ namespace String
         
         //Convert string
         auto res = std::from_chars(begin, end, num, base);
-        return (i16)num;
+        return (i32)num;
     }
 
     bool Contains(std::string_view str, std::string_view search)
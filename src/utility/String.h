@@ -23,6 +23,9 @@ namespace String
     //Converts string to a 16bit signed integer. Supports hex by prefixing with 0x
     i16 ToShort(std::string_view str);
 
+    //Converts string to a 32bit signed integer. Supports hex by prefixing with 0x
+    i32 ToInt(std::string_view str);
+
     //Returns true if string contains the search string
     bool Contains(std::string_view str, std::string_view search);
 
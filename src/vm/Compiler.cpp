@@ -1,64 +1,89 @@
 #include "Compiler.h"
 #include "utility/File.h"
 #include "utility/String.h"
-#include "Constants.h"
+#include "Keywords.h"
+#include "Grammar.h"
 #include "VM.h"
 #include <stdexcept>
 #include <string>
 #include <array>
-
-struct Label
-{
-    std::string_view Name;
-    size_t Address;
-};
-struct Variable
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <optional>
+
+/*
+    Compilation steps:
+        1) Parse tokens: parses all tokens and generates instructions from them when.
+        2) Patch addresses: replace variables and labels with their addresses.
+        3) Write program binary: generate the program binary that the VM can run.
+*/
+
+//Whether a value can be an instruction immediate without changing it
+static bool FitsImmediate(i32 value)
 {
-    std::string_view Name;
-    VmValue Address; //Address relative to the start of the variable block of the program
-    VmValue InitialValue; //Initial value set at compile time
-    bool Constant;
-};
-struct Patch //Info about an instruction that needs to be patched in compile step 2
-{
-    size_t Index; //Index of the instruction to patch
-    std::string_view Name; //Name of the label, variable, or constant that needs to be patched in
-    bool ConstantsOnly = false; //If true, variable patches will only work for constant variables. Doesn't do anything for label patches.
-    //Todo: Come up with a better way of handling this + OpoVal encoding. All the special cases it causes makes the code messy.
-    bool PatchPort = false; //Special variable used for OpoVal. If true the port set, if false the value is set
-};
+    return value >= INSTRUCTION_VALUE_MIN && value <= INSTRUCTION_VALUE_MAX;
+}
 
 Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>& tokens)
 {
-    /*
-        Compilation steps:
-            1) Parse tokens: parses all tokens and generates instructions from them when.
-            2) Patch addresses: replace variables and labels with their addresses.
-            3) Write program binary: generate the program binary that the VM can run.
-    */
-    _tokens = tokens;
-    _curTokenIndex = 0;
-    std::vector<Instruction> instructions = {};
-    std::vector<Label> labels = {}; //Used over std::map<> for insertion based ordering. Easier to debug.
-    std::vector<Variable> variables = {};
-    std::vector<VmConfig> config = {};
+    Reset();
+    Result<void, CompilerError> parseResult = Parse(tokens);
+    if (parseResult.Error())
+        return Error(parseResult.Error().value());
 
-    //Instructions that need to be patched in step 2
-    std::vector<Patch> labelPatches = {};
-    std::vector<Patch> variablePatches = {};
+    return Link();
+}
 
-    //Add built in constants
-    for (auto& kv : BuiltInConstants)
+Result<VmProgram, CompilerError> Compiler::Compile(std::string_view source)
+{
+    //Tokenize and parse one line at a time. Only the tokens of the current line are held in memory.
+    Reset();
+    Tokenizer tokenizer(source);
+    std::vector<TokenData> line = {};
+    while (true)
     {
-        std::string_view name = kv.first;
-        VmValue address = kv.second;
-        Variable& var = variables.emplace_back();
-        var.Name = name;
-        var.Address = 0;
-        var.InitialValue = address;
-        var.Constant = true;
+        line.clear();
+        Result<bool, TokenizerError> tokenizeResult = tokenizer.NextLine(line);
+        if (tokenizeResult.Error())
+            return Error(CompilerError{ CompilerErrorCode::TokenizationError, tokenizeResult.Error().value().Message });
+        if (!tokenizeResult.Success().value())
+            break; //End of source
+
+        Result<void, CompilerError> parseResult = Parse(line);
+        if (parseResult.Error())
+            return Error(parseResult.Error().value());
     }
 
+    return Link();
+}
+
+Result<VmProgram, CompilerError> Compiler::CompileFile(std::string_view inputFilePath)
+{
+    //Map the file instead of reading it to a string. Tokens and symbol names are views of the mapping, which stays open until the program is generated.
+    File::MappedFile file(inputFilePath);
+    return Compile(file.View());
+}
+
+void Compiler::Reset()
+{
+    _tokens = nullptr;
+    _curTokenIndex = 0;
+    _instructions.clear();
+    _labels.clear();
+    _variables.clear();
+    _variableValues.clear();
+    _config.clear();
+    _labelPatches.clear();
+    _variablePatches.clear();
+    _optimize = false;
+}
+
+Result<void, CompilerError> Compiler::Parse(const std::vector<TokenData>& tokens)
+{
+    _tokens = &tokens;
+    _curTokenIndex = 0;
+
     /*
         Step 1, Parse tokens:
         Tokens are parsed and instructions are generated from them. Labels and variables recorded for step 2.
@@ -68,220 +93,88 @@ Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>&
         const TokenData cur = tokens[_curTokenIndex]; //Current token
         Instruction instruction = { 0 }; //Next instruction to generate. If `continue` or `break` are encountered the instruction gets discarded
 
-        //Parse tokens and output instructions
-        switch (cur.Type)
+        //Instructions. The mnemonic and the types of its operands select a grammar rule with the opcode and encoding in one lookup.
+        if (IsMnemonic(cur.Type))
         {
-            //Instructions using 'op register (register|value|address)' syntax
-        case Token::Mov:
-        case Token::Add:
-        case Token::Sub:
-        case Token::Mul:
-        case Token::Div:
-        case Token::Cmp:
-        case Token::And:
-        case Token::Or:
-        case Token::Xor:
-        case Token::Mod:
-            //Expect<N> returns a std::optional<std::array<TokenData, N>>. If the pattern isn't matched it'll return an empty and the if statement will fail.
-            if (auto pattern = Expect<3>({ Token::Register, Token::Register, Token::Newline })) //op register register
+            //Operands are the tokens between the mnemonic and the end of the line
+            const TokenData* operands[2] = { nullptr, nullptr };
+            OperandType operandTypes[2] = { OperandType::None, OperandType::None };
+            size_t end = _curTokenIndex + 1;
+            size_t numOperands = 0;
+            for (; end < tokens.size() && tokens[end].Type != Token::Newline; end++, numOperands++)
             {
-                //pattern.value() is a std::array<TokenData, 3> here. Structured binding is used to extract all 3 tokens in one line.
-                auto [regA, regB, newline] = pattern.value();
-                instruction.OpRegisterRegister.Opcode = (u16)(cur.Type);
-                instruction.OpRegisterRegister.RegA = GetRegisterIndex(regA);
-                instruction.OpRegisterRegister.RegB = GetRegisterIndex(regB);
-            }
-            else if (auto pattern = Expect<3>({ Token::Register, Token::Value, Token::Newline })) //op register value
-            {
-                auto [reg, value, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)(cur.Type) + 1; //The Token enum is equivalent to the Opcode enum for easy conversion. Can convert from Mov -> MovVal by adding 1.
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = String::ToShort(value.String);
-            }
-            else if (auto pattern = Expect<3>({ Token::Register, Token::VarName, Token::Newline })) //op register variable
-            {
-                auto [reg, var, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)(cur.Type) + 1;
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = 0; //Patched in compile step 2
-                variablePatches.push_back({ instructions.size(), var.String, true /*Constants only*/ }); //Mark instruction for constant patching in step 2
-            }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid syntax. Expects '" + to_string(cur.Type) + " register (register|value)'" });
-
-            break;
-
-            //Load instruction
-        case Token::Load:
-            if (auto pattern = Expect<3>({ Token::Register, Token::Value, Token::Newline })) //Load from constant address
-            {
-                auto [reg, value, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Load;
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = String::ToShort(value.String);
-            }
-            else if (auto pattern = Expect<3>({ Token::Register, Token::VarName, Token::Newline })) //Load the value of a variable or from a constant address
-            {
-                auto [reg, var, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Load;
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = 0; //Patched in compile step 2
-                variablePatches.push_back({ instructions.size(), var.String });
-            }
-            else if (auto pattern = Expect<3>({ Token::Register, Token::Register, Token::Newline }))
-            {
-                auto [regA, regB, newline] = pattern.value();
-                instruction.OpRegisterRegister.Opcode = (u16)Opcode::LoadP;
-                instruction.OpRegisterRegister.RegA = GetRegisterIndex(regA);
-                instruction.OpRegisterRegister.RegB = GetRegisterIndex(regB);
-            }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid store syntax. Expects 'load register register' or 'load register address'" });
-
-            break;
-
-            //Store instruction
-        case Token::Store:
-            if (auto pattern = Expect<3>({ Token::Value, Token::Register, Token::Newline })) //Store register value in constant address
-            {
-                auto [value, reg, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Store;
-                instruction.OpRegisterValue.Value = String::ToShort(value.String);
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-            }
-            else if (auto pattern = Expect<3>({ Token::VarName, Token::Register, Token::Newline })) //Store register value in variable or from a constant address
-            {
-                auto [var, reg, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Store;
-                instruction.OpRegisterValue.Value = 0; //Patched in compile step 2
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                variablePatches.push_back({ instructions.size(), var.String });
-            }
-            else if (auto pattern = Expect<3>({ Token::Register, Token::Register, Token::Newline }))
-            {
-                auto [regA, regB, newline] = pattern.value();
-                instruction.OpRegisterRegister.Opcode = (u16)Opcode::StoreP;
-                instruction.OpRegisterRegister.RegA = GetRegisterIndex(regA);
-                instruction.OpRegisterRegister.RegB = GetRegisterIndex(regB);
-            }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid store syntax. Expects 'store register register' or 'store address register'" });
-
-            break;
-
-            //Instructions using 'op address' syntax
-        case Token::Jmp:
-        case Token::Jeq:
-        case Token::Jne:
-        case Token::Jgr:
-        case Token::Jls:
-        case Token::Call:
-            if (auto pattern = Expect<2>({ Token::Value, Token::Newline }))
-            {
-                auto [value, newline] = pattern.value();
-                instruction.OpAddress.Opcode = (u16)cur.Type;
-                instruction.OpAddress.Address = String::ToShort(value.String);
-            }
-            else if (auto pattern = Expect<2>({ Token::Label, Token::Newline }))
-            {
-                auto [label, newline] = pattern.value();
-                instruction.OpAddress.Opcode = (u16)cur.Type;
-                instruction.OpAddress.Address = 0; //Patched in compile step 2
-                labelPatches.push_back({ instructions.size(), label.String });
-            }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid syntax. Expects '" + to_string(cur.Type) + " address'" });
-
-            break;
-
-            //Return instruction
-        case Token::Ret:
-            if (auto pattern = Expect<1>({ Token::Newline }))
-            {
-                instruction.Op.Opcode = (u16)cur.Type;
+                if (numOperands < 2)
+                {
+                    operands[numOperands] = &tokens[end];
+                    operandTypes[numOperands] = GetOperandType(tokens[end].Type);
+                }
             }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid 'ret' syntax. Expects no arguments." });
 
-            break;
+            const GrammarRule* rule = (end < tokens.size() && numOperands <= 2) ? FindGrammarRule(cur.Type, operandTypes[0], operandTypes[1]) : nullptr;
+            if (!rule)
+                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid " + String::ToLower(cur.String) + " syntax. Expects " + GetMnemonicSyntax(cur.Type) });
 
-            //Instructions using 'op register' syntax
-        case Token::Neg:
-        case Token::Push:
-        case Token::Pop:
-            if (auto pattern = Expect<2>({ Token::Register, Token::Newline }))
+            //Values must fit in the immediate. Names and labels are checked when they're patched in step 2.
+            for (const TokenData* operand : operands)
             {
-                auto [reg, newline] = pattern.value();
-                instruction.OpRegister.Opcode = (u16)cur.Type;
-                instruction.OpRegister.Reg = GetRegisterIndex(reg);
+                if (operand && operand->Type == Token::Value && !FitsImmediate(String::ToInt(operand->String)))
+                    return Error(CompilerError{ CompilerErrorCode::ValueOutOfRange, "Value " + std::string(operand->String) + " doesn't fit in a 16 bit immediate. Range: [" + std::to_string(INSTRUCTION_VALUE_MIN) + ", " + std::to_string(INSTRUCTION_VALUE_MAX) + "]" });
             }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid syntax. Expects '" + to_string(cur.Type) + " register'" });
 
-            break;
-
-            //Read from port
-        case Token::Ipo:
-            if (auto pattern = Expect<3>({ Token::Register, Token::VarName, Token::Newline })) //ipo register constant
+            //Get the immediate for a value, variable, constant, or label operand. Names and labels are patched in step 2.
+            auto immediate = [&](const TokenData& operand, bool patchPort = false) -> i16
             {
-                auto [reg, var, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Ipo;
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = 0; //Patched in stage 2
-                variablePatches.push_back({ instructions.size(), var.String, true /*ConstantsOnly*/ });
-            }
-            else if (auto pattern = Expect<3>({ Token::Register, Token::Value, Token::Newline })) //ipo register value
+                if (operand.Type == Token::Value)
+                    return String::ToShort(operand.String);
+                else if (operand.Type == Token::Label)
+                    _labelPatches.push_back({ _instructions.size(), operand.String });
+                else
+                    _variablePatches.push_back({ _instructions.size(), operand.String, rule->ConstantsOnly, patchPort });
+
+                return 0;
+            };
+
+            instruction.Op.Opcode = (u16)rule->Op;
+            switch (rule->Encoding)
             {
-                auto [reg, value, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Ipo;
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = String::ToShort(value.String);
+            case InstructionEncoding::Register:
+                instruction.OpRegister.Reg = GetRegisterIndex(*operands[0]);
+                break;
+            case InstructionEncoding::RegisterRegister:
+                instruction.OpRegisterRegister.RegA = GetRegisterIndex(*operands[0]);
+                instruction.OpRegisterRegister.RegB = GetRegisterIndex(*operands[1]);
+                break;
+            case InstructionEncoding::RegisterValue:
+                instruction.OpRegisterValue.RegA = GetRegisterIndex(*operands[0]);
+                instruction.OpRegisterValue.Value = immediate(*operands[1]);
+                break;
+            case InstructionEncoding::ValueRegister:
+                instruction.OpRegisterValue.Value = immediate(*operands[0]);
+                instruction.OpRegisterValue.RegA = GetRegisterIndex(*operands[1]);
+                break;
+            case InstructionEncoding::Value:
+                instruction.OpRegisterValue.Value = immediate(*operands[0]);
+                break;
+            case InstructionEncoding::Address:
+                instruction.OpAddress.Address = immediate(*operands[0]);
+                break;
+            case InstructionEncoding::PortValue:
+                instruction.OpPortValue.Port = immediate(*operands[0], true);
+                instruction.OpPortValue.Value = immediate(*operands[1]);
+                break;
+            case InstructionEncoding::None:
+            default:
+                break;
             }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid ipo syntax. Expects `ipo register port`, where port is a port constant." });
-            
-            break;
 
-            //Write to port
-        case Token::Opo:
-            if (auto pattern = Expect<3>({ Token::VarName, Token::Register, Token::Newline })) //opo port register
-            {
-                auto [var, reg, newline] = pattern.value();
-                instruction.OpRegisterValue.Opcode = (u16)Opcode::Opo;
-                instruction.OpRegisterValue.RegA = GetRegisterIndex(reg);
-                instruction.OpRegisterValue.Value = 0; //Patched in stage 2
-                variablePatches.push_back({ instructions.size(), var.String });
-            }
-            else if (auto pattern = Expect<3>({ Token::VarName, Token::Value, Token::Newline })) //opo port value
-            {
-                auto [var, value, newline] = pattern.value();
-                instruction.OpPortValue.Opcode = (u16)Opcode::OpoVal;
-                instruction.OpPortValue.Port = 0; //Patched in stage 2
-                instruction.OpPortValue.Value = String::ToShort(value.String);
-                variablePatches.push_back({ instructions.size(), var.String, true /*ConstantsOnly*/, true /*PatchPort*/ });
-            }
-            else if (auto pattern = Expect<3>({ Token::VarName, Token::VarName, Token::Newline })) //opo port constant
-            {
-                auto [var, port, newline] = pattern.value();
-                instruction.OpPortValue.Opcode = (u16)Opcode::OpoVal;
-                instruction.OpPortValue.Port = 0; //Patched in stage 2
-                instruction.OpPortValue.Value = 0; //Patched in stage 2
-                variablePatches.push_back({ instructions.size(), var.String, true /*ConstantsOnly*/, true /*PatchPort*/ });
-                variablePatches.push_back({ instructions.size(), port.String, true /*ConstantsOnly*/, false /*PatchPort*/ });
-            }
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid opo syntax. Expects `opo port register|value|constant`, where port is a port constant." });
-
-            break;
-
-        case Token::Nop:
-            if (auto pattern = Expect<1>({ Token::Newline }))
-                instruction.Op.Opcode = (u32)Opcode::Nop;
-            else
-                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid nop syntax. Expects `nop` with no other arguments" });
-
-            break;
+            _curTokenIndex = end + 1; //Skip the newline
+            _instructions.push_back(instruction);
+            continue;
+        }
 
+        //Parse tokens and output instructions
+        switch (cur.Type)
+        {
             //Ignore blank lines
         case Token::Newline:
             _curTokenIndex++;
@@ -292,24 +185,19 @@ Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>&
             {
                 auto [var, value, newline] = pattern.value();
 
-                //Don't allow duplicate variables
-                for (Variable& variable : variables)
-                    if(variable.Name == var.String)
-                        return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Variable \"" + std::string(cur.String) + "\" duplicated!" });
-
-                //Count variables to determine new variables relative address
-                u32 variableCount = 0;
-                for (Variable& variable : variables)
-                    if (!variable.Constant)
-                        variableCount++;
+                //Don't allow duplicate variables or redefining built in constants
+                if (_variables.count(var.String))
+                    return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Variable \"" + std::string(var.String) + "\" duplicated!" });
+                if (const Keyword* keyword = FindKeyword(var.String); keyword && keyword->IsConstant())
+                    return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Variable \"" + std::string(var.String) + "\" duplicates a built in constant!" });
 
                 //Add to variables list
                 Variable variable;
-                variable.Name = var.String;
-                variable.Address = variableCount * sizeof(VmValue); //Address relative to start of variables block
-                variable.InitialValue = String::ToShort(value.String);
+                variable.Address = _variableValues.size() * sizeof(VmValue); //Address relative to start of variables block
+                variable.InitialValue = (VmValue)String::ToInt(value.String);
                 variable.Constant = false;
-                variables.push_back(variable);
+                _variables[var.String] = variable;
+                _variableValues.push_back(variable.InitialValue);
                 _curTokenIndex++;
                 continue; //Doesn't generate an instruction
             }
@@ -320,18 +208,23 @@ Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>&
             {
                 auto [var, value, newline] = pattern.value();
 
-                //Don't allow duplicate constants
-                for (Variable& variable : variables)
-                    if (variable.Name == var.String)
-                        return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Variable \"" + std::string(cur.String) + "\" duplicated!" });
+                //Don't allow duplicate constants or redefining built in constants
+                if (_variables.count(var.String))
+                    return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Variable \"" + std::string(var.String) + "\" duplicated!" });
+                if (const Keyword* keyword = FindKeyword(var.String); keyword && keyword->IsConstant())
+                    return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Constant \"" + std::string(var.String) + "\" duplicates a built in constant!" });
+
+                //Constants are only used as immediates so they must fit in one
+                const i32 constantValue = String::ToInt(value.String);
+                if (!FitsImmediate(constantValue))
+                    return Error(CompilerError{ CompilerErrorCode::ValueOutOfRange, "Constant \"" + std::string(var.String) + "\" value " + std::string(value.String) + " doesn't fit in a 16 bit immediate. Range: [" + std::to_string(INSTRUCTION_VALUE_MIN) + ", " + std::to_string(INSTRUCTION_VALUE_MAX) + "]" });
 
                 //Add to variables list
                 Variable variable;
-                variable.Name = var.String;
                 variable.Address = -1; //Constants are compile time only
-                variable.InitialValue = String::ToShort(value.String);
+                variable.InitialValue = (VmValue)constantValue;
                 variable.Constant = true;
-                variables.push_back(variable);
+                _variables[var.String] = variable;
                 _curTokenIndex++;
                 continue; //Doesn't generate an instruction
             }
@@ -341,24 +234,32 @@ Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>&
             if (auto pattern = Expect<3>({ Token::VarName, Token::Value, Token::Newline }))
             {
                 auto [var, value, newline] = pattern.value();
-                VmConfig& configVal = config.emplace_back();
+                VmConfig& configVal = _config.emplace_back();
                 configVal.Name = String::ToLower(var.String); //Names are case insensitive
-                configVal.Value = String::ToShort(value.String);
+                configVal.Value = (VmValue)String::ToInt(value.String);
                 _curTokenIndex++;
                 continue; //Doesn't generate an instruction
             }
             break;
 
-        case Token::Label:
+        case Token::Optimize:
             if (auto pattern = Expect<1>({ Token::Newline }))
             {
-                //Don't allow duplicate labels
-                for (Label& label : labels)
-                    if (label.Name == cur.String)
-                        return Error(CompilerError{ CompilerErrorCode::DuplicateVariable, "Variable \"" + std::string(cur.String) + "\" duplicated!" });
+                _optimize = true;
+                _curTokenIndex++;
+                continue; //Doesn't generate an instruction
+            }
+            else
+                return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Invalid #optimize syntax. Expects `#optimize` with no other arguments" });
+
+            break;
 
-                //Map label name to its address
-                labels.push_back(Label{ cur.String, VM::RESERVED_BYTES + instructions.size() * sizeof(Instruction) });
+        case Token::Label:
+            if (auto pattern = Expect<1>({ Token::Newline }))
+            {
+                //Map label name to its address. Don't allow duplicate labels.
+                if (!_labels.emplace(cur.String, VM::RESERVED_BYTES + _instructions.size() * sizeof(Instruction)).second)
+                    return Error(CompilerError{ CompilerErrorCode::DuplicateLabel, "Label \"" + std::string(cur.String) + "\" duplicated!" });
                 _curTokenIndex++;
                 continue; //Doesn't generate an instruction
             }
@@ -378,48 +279,101 @@ Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>&
         }
 
         _curTokenIndex++; //Next instruction
-        instructions.push_back(instruction);
+        _instructions.push_back(instruction);
     }
 
+    _tokens = nullptr;
+    return Success<void>();
+}
+
+Result<VmProgram, CompilerError> Compiler::Link()
+{
+    //Optional. Enabled by #optimize. Done before patching since it can remove instructions, which moves labels and variables.
+    if (_optimize)
+        Optimize();
 
     /*
         Step 2, Patch variables and labels:
         Labels and variables are replaced with their addresses. Done after parsing since their addresses aren't known until all tokens are parsed.
     */
+    //Addresses must fit in signed immediates since load, store, and mov use them too. Programs past this wouldn't load anyway.
+    auto addressOutOfRange = [&](const Patch& patch, size_t address)
+    {
+        return Error(CompilerError{ CompilerErrorCode::ValueOutOfRange, "Address " + std::to_string(address) + " of \"" + std::string(patch.Name) + "\" doesn't fit in a 16 bit immediate. The program is too large." });
+    };
+
     //Patch label addresses
-    for (Patch& patch : labelPatches)
-        for (Label& label : labels)
-            if (label.Name == patch.Name)
-                instructions[patch.Index].OpAddress.Address = label.Address;
+    for (Patch& patch : _labelPatches)
+    {
+        if (auto label = _labels.find(patch.Name); label != _labels.end())
+        {
+            if (label->second > VM::MAX_PROGRAM_END)
+                return addressOutOfRange(patch, label->second);
+
+            _instructions[patch.Index].OpAddress.Address = label->second;
+        }
+    }
 
     //Offset of variable block in VM memory
-    VmValue variableBlockOffset = VM::RESERVED_BYTES + (instructions.size() * sizeof(Instruction));
+    const size_t variableBlockOffset = VM::RESERVED_BYTES + (_instructions.size() * sizeof(Instruction));
+
+    //Patch a constant value into an instruction
+    auto patchConstant = [&](const Patch& patch, VmValue value) -> Result<void, CompilerError>
+    {
+        if (!FitsImmediate(value))
+            return Error(CompilerError{ CompilerErrorCode::ValueOutOfRange, "Constant \"" + std::string(patch.Name) + "\" value " + std::to_string(value) + " doesn't fit in a 16 bit immediate. Range: [" + std::to_string(INSTRUCTION_VALUE_MIN) + ", " + std::to_string(INSTRUCTION_VALUE_MAX) + "]" });
+
+        Opcode opcode = (Opcode)_instructions[patch.Index].Op.Opcode;
+        if (opcode == Opcode::OpoVal) //Special case since OpoVal uses different variable encoding than other instructions
+        {
+            if (patch.PatchPort)
+                _instructions[patch.Index].OpPortValue.Port = value;
+            else
+                _instructions[patch.Index].OpPortValue.Value = value;
+        }
+        else
+            _instructions[patch.Index].OpRegisterValue.Value = value;
+
+        return Success<void>();
+    };
 
     //Patch variables and constants
-    for (Patch& patch : variablePatches)
-        for (Variable& variable : variables)
-            if (variable.Name.compare(patch.Name) == 0) //Using ::compare to compare string_views by character
-            {
-                //Some opcodes only allow constant variables
-                if (patch.ConstantsOnly && !variable.Constant)
-                    return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Variable used as an argument in opcode that only accepts constants. Opcode: " + to_string((Opcode)instructions[patch.Index].Op.Opcode) });
+    for (Patch& patch : _variablePatches)
+    {
+        //Built in constants. Programs can't redefine them so there's no need to check the variables.
+        if (const Keyword* keyword = FindKeyword(patch.Name); keyword && keyword->IsConstant())
+        {
+            Result<void, CompilerError> patchResult = patchConstant(patch, keyword->Value);
+            if (patchResult.Error())
+                return Error(patchResult.Error().value());
 
-                Opcode opcode = (Opcode)instructions[patch.Index].Op.Opcode;
-                if (variable.Constant) //Patch constant value
-                {
-                    if (opcode == Opcode::OpoVal) //Special case since OpoVal uses different variable encoding than other instructions
-                    {
-                        if (patch.PatchPort)
-                            instructions[patch.Index].OpPortValue.Port = variable.InitialValue;
-                        else
-                            instructions[patch.Index].OpPortValue.Value = variable.InitialValue;
-                    }
-                    else
-                        instructions[patch.Index].OpRegisterValue.Value = variable.InitialValue;
-                }
-                else //Patch variable address
-                    instructions[patch.Index].OpRegisterValue.Value = variableBlockOffset + variable.Address;
-            }
+            continue;
+        }
+
+        auto search = _variables.find(patch.Name);
+        if (search == _variables.end())
+            continue;
+
+        //Some opcodes only allow constant variables
+        const Variable& variable = search->second;
+        if (patch.ConstantsOnly && !variable.Constant)
+            return Error(CompilerError{ CompilerErrorCode::InvalidSyntax, "Variable used as an argument in opcode that only accepts constants. Opcode: " + to_string((Opcode)_instructions[patch.Index].Op.Opcode) });
+
+        if (variable.Constant) //Patch constant value
+        {
+            Result<void, CompilerError> patchResult = patchConstant(patch, variable.InitialValue);
+            if (patchResult.Error())
+                return Error(patchResult.Error().value());
+        }
+        else //Patch variable address
+        {
+            const size_t address = variableBlockOffset + variable.Address;
+            if (address > VM::MAX_PROGRAM_END)
+                return addressOutOfRange(patch, address);
+
+            _instructions[patch.Index].OpRegisterValue.Value = (i32)address;
+        }
+    }
 
 
     /*
@@ -430,72 +384,236 @@ Result<VmProgram, CompilerError> Compiler::Compile(const std::vector<TokenData>&
             - Variables: Space for variables set to their default values. Done at compile time so the stack, which grows
                          from the end of VM memory down, is only constrained in size by the number of variables.
     */
-    //Write variables to vector set to their initial values
-    std::vector<VmValue> finalVariables = {};
-    for (Variable& variable : variables)
-    {
-        if (variable.Constant)
-            continue; //Constants are discarded after step 2
-
-        finalVariables.push_back(variable.InitialValue);
-    }
-
+    //Variable initial values were written to _variableValues in step 1. Constants are discarded after step 2.
     //Calculate size of each data block
-    u32 instructionsSizeBytes = instructions.size() * sizeof(Instruction);
-    u32 variablesSizeBytes = finalVariables.size() * sizeof(VmValue);
+    u32 instructionsSizeBytes = _instructions.size() * sizeof(Instruction);
+    u32 variablesSizeBytes = _variableValues.size() * sizeof(VmValue);
     u32 programSizeBytes = sizeof(ProgramHeader) + instructionsSizeBytes + variablesSizeBytes;
 
     //Write header
     ProgramHeader header;
-    header.Signature = VmProgram::EXPECTED_SIGNATURE; //ASCII string "ATRB"
+    header.Signature = VmProgram::EXPECTED_SIGNATURE; //ASCII string "ATR2"
     header.ProgramSize = programSizeBytes;
-    header.InstructionsSize = instructions.size() * sizeof(Instruction);
+    header.InstructionsSize = _instructions.size() * sizeof(Instruction);
     header.VariablesSize = variablesSizeBytes;
+    header.WordSize = sizeof(VmValue);
 
     //Construct and return vm program instance
-    VmProgram program(std::move(header), std::move(instructions), std::move(finalVariables), std::move(config));
-    _tokens.clear();
-    return Success(program);
+    VmProgram program(std::move(header), std::move(_instructions), std::move(_variableValues), std::move(_config));
+    Reset(); //Release the symbol tables. Their names are views of the source.
+    return Success(std::move(program));
 }
 
-Result<VmProgram, CompilerError> Compiler::Compile(std::string_view source)
+void Compiler::Optimize()
 {
-    //Tokenize source
-    Result<std::vector<TokenData>, TokenizerError> tokenizeResult = Tokenizer::Tokenize(source);
-    if (tokenizeResult.Error())
-        return Error(CompilerError{ CompilerErrorCode::TokenizationError, tokenizeResult.Error().value().Message });
-
-    _tokens = tokenizeResult.Success().value();
-    Result<VmProgram, CompilerError> compileResult = Compile(tokenizeResult.Success().value());
-    _tokens.clear();
-    return compileResult;
-}
+    /*
+        Peephole optimizer. Runs on the instructions from step 1, before labels and variables are patched in:
+            - Strength reduction: `mod register value` by a power of 2 becomes `and register value-1`. 1 cycle instead of 10.
+              Only done when the instruction right before it sets the register to a value that can't be negative, since the results differ for negative values.
+            - Removes nops and movs that do nothing. E.g. `mov r0 r0`, or `mov r0 5` right after the same instruction.
+            - Jump threading: jumps and calls to a `jmp` go straight to its destination.
+        Instructions are only removed if the program doesn't rely on the instruction layout. It's left as is if any jump, load, or store
+        uses a numeric address past the reserved bytes, or if a label is used as a value since code can do arithmetic on it.
+        Addresses computed at runtime from numbers can't be detected. Programs that do that or read or write their own instructions shouldn't use #optimize.
+    */
+    const size_t NO_PATCH = std::numeric_limits<size_t>::max();
+    auto opcode = [&](size_t index) { return (Opcode)_instructions[index].Op.Opcode; };
+    auto addressToIndex = [](size_t address) { return (address - VM::RESERVED_BYTES) / sizeof(Instruction); };
+    auto labelIndex = [&](std::string_view name) //Index of the instruction a label points to. Past the last instruction if it's unknown or at the end of the program.
+    {
+        auto label = _labels.find(name);
+        return label != _labels.end() ? addressToIndex(label->second) : _instructions.size();
+    };
+    auto isJump = [&](size_t index)
+    {
+        const GrammarRule* rule = FindGrammarRule(opcode(index));
+        return rule && rule->Encoding == InstructionEncoding::Address;
+    };
+
+    //Patches of each instruction. Instructions have at most one label patch. OpoVal can have two variable patches but isn't optimized.
+    std::vector<size_t> labelPatchIndices;
+    std::vector<size_t> variablePatchIndices;
+    auto indexPatches = [&]()
+    {
+        labelPatchIndices.assign(_instructions.size(), NO_PATCH);
+        variablePatchIndices.assign(_instructions.size(), NO_PATCH);
+        for (size_t i = 0; i < _labelPatches.size(); i++)
+            labelPatchIndices[_labelPatches[i].Index] = i;
+        for (size_t i = 0; i < _variablePatches.size(); i++)
+            variablePatchIndices[_variablePatches[i].Index] = i;
+    };
+    indexPatches();
+
+    //Value of an instruction immediate with constants resolved. None for labels, variables, and unknown names.
+    auto immediateValue = [&](size_t index) -> std::optional<VmValue>
+    {
+        if (labelPatchIndices[index] != NO_PATCH)
+            return {};
+
+        const size_t patchIndex = variablePatchIndices[index];
+        if (patchIndex == NO_PATCH)
+            return (VmValue)_instructions[index].OpRegisterValue.Value;
+
+        const std::string_view name = _variablePatches[patchIndex].Name;
+        auto variable = _variables.find(name);
+        if (const Keyword* keyword = FindKeyword(name); keyword && keyword->IsConstant())
+            return keyword->Value;
+        else if (variable != _variables.end() && variable->second.Constant)
+            return variable->second.InitialValue;
+        else
+            return {};
+    };
+
+    //Instructions with a label. Code can jump to them from elsewhere.
+    std::vector<bool> labelled(_instructions.size() + 1, false);
+    for (auto& [name, address] : _labels)
+        labelled[addressToIndex(address)] = true;
+
+    //Jumps to numeric addresses can go anywhere, so the instruction before another isn't known to run first
+    bool numericJumps = false;
+    for (size_t i = 0; i < _instructions.size(); i++)
+        numericJumps |= isJump(i) && labelPatchIndices[i] == NO_PATCH;
+
+    //Strength reduction. The previous instruction must set the register to a non negative value, e.g. `and r0 0xFF` or `mov r0 5`.
+    //Interrupt handlers can run in between, but they must preserve registers anyway since that can happen between any two instructions.
+    auto nonNegative = [&](size_t index, u32 reg)
+    {
+        const Opcode previous = opcode(index);
+        if ((previous != Opcode::AndVal && previous != Opcode::MovVal) || _instructions[index].OpRegisterValue.RegA != reg)
+            return false;
+
+        const std::optional<VmValue> value = immediateValue(index);
+        return value && value.value() >= 0;
+    };
+    std::vector<bool> removedPatches(_variablePatches.size(), false);
+    for (size_t i = 0; i < _instructions.size(); i++)
+    {
+        if (opcode(i) != Opcode::ModVal || i == 0 || labelled[i] || numericJumps || !nonNegative(i - 1, _instructions[i].OpRegisterValue.RegA))
+            continue;
 
-Result<VmProgram, CompilerError> Compiler::CompileFile(std::string_view inputFilePath)
-{
-    //Read file to string, tokenize, and compile
-    return Compile(File::ReadAll(inputFilePath) + "\r\n");
+        //Get the divisor. Constants are patched in now since the immediate changes. Variables are left for step 2 to report.
+        const std::optional<VmValue> divisor = immediateValue(i);
+        if (!divisor)
+            continue;
+
+        const bool powerOf2 = divisor.value() > 0 && (divisor.value() & (divisor.value() - 1)) == 0;
+        if (!powerOf2 || divisor.value() - 1 > std::numeric_limits<i16>::max())
+            continue;
+
+        const size_t patchIndex = variablePatchIndices[i];
+        _instructions[i].OpRegisterValue.Opcode = (u16)Opcode::AndVal;
+        _instructions[i].OpRegisterValue.Value = divisor.value() - 1;
+        if (patchIndex != NO_PATCH)
+            removedPatches[patchIndex] = true;
+    }
+    if (std::find(removedPatches.begin(), removedPatches.end(), true) != removedPatches.end())
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < _variablePatches.size(); i++)
+            if (!removedPatches[i])
+                _variablePatches[kept++] = _variablePatches[i];
+
+        _variablePatches.resize(kept);
+        indexPatches();
+    }
+
+    //Remove nops and redundant movs. Skipped if the program relies on the instruction layout.
+    auto numericAddress = [&](size_t index) //Whether a load or store uses a numeric address in program memory. Constants count since they're numbers too.
+    {
+        VmValue address = _instructions[index].OpRegisterValue.Value;
+        if (const size_t patchIndex = variablePatchIndices[index]; patchIndex != NO_PATCH)
+        {
+            //Built in constants are addresses in the reserved bytes. Variables are patched with their address after this.
+            const std::string_view name = _variablePatches[patchIndex].Name;
+            auto variable = _variables.find(name);
+            if (const Keyword* keyword = FindKeyword(name); keyword && keyword->IsConstant())
+                return false;
+            else if (variable == _variables.end() || !variable->second.Constant)
+                return false;
+
+            address = variable->second.InitialValue;
+        }
+
+        return address < 0 || (size_t)address >= VM::RESERVED_BYTES;
+    };
+    bool layoutDependent = numericJumps;
+    for (size_t i = 0; i < _instructions.size(); i++)
+    {
+        if (isJump(i))
+            continue;
+        else if (labelPatchIndices[i] != NO_PATCH)
+            layoutDependent = true; //Label used as a value
+        else if (opcode(i) == Opcode::Load || opcode(i) == Opcode::Store)
+            layoutDependent |= numericAddress(i);
+    }
+
+    std::vector<bool> removed(_instructions.size(), false);
+    bool anyRemoved = false;
+    if (!layoutDependent)
+    {
+        for (size_t i = 0; i < _instructions.size(); i++)
+        {
+            const Instruction& instruction = _instructions[i];
+            const bool patched = labelPatchIndices[i] != NO_PATCH || variablePatchIndices[i] != NO_PATCH;
+            if (opcode(i) == Opcode::Nop)
+                removed[i] = true;
+            else if (opcode(i) == Opcode::Mov && instruction.OpRegisterRegister.RegA == instruction.OpRegisterRegister.RegB)
+                removed[i] = true;
+            else if (opcode(i) == Opcode::MovVal && i > 0 && !labelled[i] && !patched && instruction.Value == _instructions[i - 1].Value
+                     && labelPatchIndices[i - 1] == NO_PATCH && variablePatchIndices[i - 1] == NO_PATCH)
+                removed[i] = true; //Repeat of the previous instruction. Mov doesn't change flags so it has no other effect.
+
+            anyRemoved |= removed[i];
+        }
+    }
+
+    //Compact the instructions and move labels and patches to the new indices. Labels on removed instructions move to the next one.
+    if (anyRemoved)
+    {
+        std::vector<size_t> newIndices(_instructions.size() + 1);
+        size_t kept = 0;
+        for (size_t i = 0; i < _instructions.size(); i++)
+        {
+            newIndices[i] = kept;
+            if (!removed[i])
+                _instructions[kept++] = _instructions[i];
+        }
+        newIndices[_instructions.size()] = kept;
+        _instructions.resize(kept);
+
+        for (auto& [name, address] : _labels)
+            address = VM::RESERVED_BYTES + newIndices[addressToIndex(address)] * sizeof(Instruction);
+        for (Patch& patch : _labelPatches)
+            patch.Index = newIndices[patch.Index];
+        for (Patch& patch : _variablePatches)
+            patch.Index = newIndices[patch.Index];
+
+        indexPatches();
+    }
+
+    //Jump threading. Follow chains of `jmp` until reaching an instruction that isn't one. Hops are limited in case of jump cycles.
+    for (size_t i = 0; i < _instructions.size(); i++)
+    {
+        if (!isJump(i) || labelPatchIndices[i] == NO_PATCH)
+            continue;
+
+        Patch& patch = _labelPatches[labelPatchIndices[i]];
+        for (size_t hops = 0; hops < _instructions.size(); hops++)
+        {
+            const size_t target = labelIndex(patch.Name);
+            if (target >= _instructions.size() || opcode(target) != Opcode::Jmp || labelPatchIndices[target] == NO_PATCH)
+                break;
+
+            patch.Name = _labelPatches[labelPatchIndices[target]].Name;
+        }
+    }
 }
 
 i32 Compiler::GetRegisterIndex(const TokenData& token)
 {
-    if (token.String == "r0")
-        return 0;
-    if (token.String == "r1")
-        return 1;
-    if (token.String == "r2")
-        return 2;
-    if (token.String == "r3")
-        return 3;
-    if (token.String == "r4")
-        return 4;
-    if (token.String == "r5")
-        return 5;
-    if (token.String == "r6")
-        return 6;
-    if (token.String == "r7")
-        return 7;
-    
+    if (const Keyword* keyword = FindKeyword(token.String); keyword && keyword->Type == Token::Register)
+        return keyword->Value;
+
     throw std::runtime_error("Invalid register token enum '" + std::string(token.String) + "' passed to Compiler::GetRegisterIndex()");
 }
 
@@ -504,8 +622,9 @@ std::optional<std::array<TokenData, numTokens>> Compiler::Expect(std::initialize
 {
     //Make sure we won't peek out of bounds
     assert(pattern.size() == numTokens, "Size mismatch with Compiler::Peek<numTokens>(pattern). pattern isn't the same size as numTokens. They must be the same");
+    const std::vector<TokenData>& tokens = *_tokens;
     size_t peekMax = _curTokenIndex + numTokens;
-    if (peekMax >= _tokens.size())
+    if (peekMax >= tokens.size())
         return {};
 
     std::array<TokenData, numTokens> out;
@@ -515,10 +634,10 @@ std::optional<std::array<TokenData, numTokens>> Compiler::Expect(std::initialize
     for (Token token : pattern)
     {
         size_t peekIndex = _curTokenIndex + i + 1;
-        if (peekIndex >= _tokens.size() || _tokens[peekIndex].Type != token)
+        if (peekIndex >= tokens.size() || tokens[peekIndex].Type != token)
             return {}; //Pattern mismatch, return empty
         else
-            out[i] = _tokens[peekIndex];
+            out[i] = tokens[peekIndex];
 
         i++;
     }
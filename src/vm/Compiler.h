@@ -7,6 +7,9 @@
 #include "VmProgram.h"
 #include <magic_enum.hpp>
 #include <array>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 struct CompilerError;
 
@@ -20,14 +23,49 @@ public:
     Result<VmProgram, CompilerError> CompileFile(std::string_view inputFilePath);
 
 private:
+    struct Variable
+    {
+        VmValue Address; //Address relative to the start of the variable block of the program
+        VmValue InitialValue; //Initial value set at compile time
+        bool Constant;
+    };
+    struct Patch //Info about an instruction that needs to be patched in compile step 2
+    {
+        size_t Index; //Index of the instruction to patch
+        std::string_view Name; //Name of the label, variable, or constant that needs to be patched in
+        bool ConstantsOnly = false; //If true, variable patches will only work for constant variables. Doesn't do anything for label patches.
+        //Todo: Come up with a better way of handling this + OpoVal encoding. All the special cases it causes makes the code messy.
+        bool PatchPort = false; //Special variable used for OpoVal. If true the port set, if false the value is set
+    };
+
+    //Clear state left by the previous compile
+    void Reset();
+    //Compile step 1. Generates instructions from tokens and records labels and variables. Can be called once per line so the whole token stream never needs to be in memory.
+    Result<void, CompilerError> Parse(const std::vector<TokenData>& tokens);
+    //Compile steps 2 and 3. Patches labels and variables and generates the program once all tokens are parsed.
+    Result<VmProgram, CompilerError> Link();
+    //Optional step between parsing and patching, enabled by #optimize. Peephole optimizations that lower the cycle cost of the program.
+    void Optimize();
     //Get index of a register from the corresponding token (e.g. Token::Register0, Token::Register1, etc)
     i32 GetRegisterIndex(const TokenData& token);
     //Checks if the provided pattern is next in the stream. If true it returns the taken data and increments _curTokenIndex.
     template<size_t numTokens>
     std::optional<std::array<TokenData, numTokens>> Expect(std::initializer_list<Token> pattern);
 
-    std::vector<TokenData> _tokens = {};
+    const std::vector<TokenData>* _tokens = nullptr; //Tokens being parsed by Parse(). Not owned.
     size_t _curTokenIndex = 0;
+
+    //Compile state. Names are views of the source, so it must stay alive until Link() is done.
+    std::vector<Instruction> _instructions = {};
+    //Symbol tables. Hashed so lookups stay fast for generated programs with many thousands of labels.
+    std::unordered_map<std::string_view, size_t> _labels = {}; //Label name -> address
+    std::unordered_map<std::string_view, Variable> _variables = {}; //Variable and constant names -> value
+    std::vector<VmValue> _variableValues = {}; //Initial value of each non constant variable. In declaration order, which is their order in memory.
+    std::vector<VmConfig> _config = {};
+    //Instructions that need to be patched in step 2
+    std::vector<Patch> _labelPatches = {};
+    std::vector<Patch> _variablePatches = {};
+    bool _optimize = false; //Set by #optimize
 };
 
 enum class CompilerErrorCode
@@ -39,6 +77,7 @@ enum class CompilerErrorCode
     DuplicateLabel,
     DuplicateVariable,
     DuplicateConstant,
+    ValueOutOfRange,
 };
 
 struct CompilerError
@@ -1,9 +1,6 @@
 #pragma once
 #include "Typedefs.h"
 #include "Instruction.h"
-#include <unordered_map>
-#include <string_view>
-#include <limits>
 
 //Ports used to communicate with hardware attached to the robot
 //Ports are stored at the start of VM memory. Their address is simply their value * sizeof(VmValue)
@@ -31,34 +28,17 @@ enum class Port
     NumPorts,
 };
 
-//Built in assembly constants
-static std::unordered_map<std::string_view, VmValue> BuiltInConstants =
+//Hardware events that interrupt the program. See VM::RaiseInterrupt().
+//The interrupt vector table holds the handler address of each interrupt. Set an entry with store to enable the interrupt. 0 disables it.
+enum class Interrupt
 {
-    //Port addresses
-    { "P_SPEDOMETER", (VmValue)Port::Spedometer },
-    { "P_STEERING", (VmValue)Port::Steering },
-    { "P_SHOOT", (VmValue)Port::TurretShoot },
-    { "P_TURRET_OFS", (VmValue)Port::TurretRotateOffset },
-    { "P_TURRET_ABS", (VmValue)Port::TurretRotateAbsolute },
-    { "P_MINELAYER", (VmValue)Port::MineLayer },
-    { "P_MINETRIGGER", (VmValue)Port::MineTrigger },
-    { "P_SONAR", (VmValue)Port::Sonar },
-    { "P_RADAR", (VmValue)Port::Radar },
-    { "P_SCANNER", (VmValue)Port::Scanner },
-    { "P_SCAN_ARC", (VmValue)Port::ScannerArc },
-    { "P_THROTTLE", (VmValue)Port::Throttle },
-    { "P_HEAT", (VmValue)Port::Heat },
-    { "P_COMPASS", (VmValue)Port::Compass },
-    //The old version is P_DAMAGE. Included for compatibility reasons.
-    { "P_ARMOR", (VmValue)Port::Armor }, { "P_DAMAGE", (VmValue)Port::Armor },
-    { "P_RANDOM", (VmValue)Port::Random },
-    { "P_SHIELD", (VmValue)Port::Shield },
-    { "P_ACCURACY", (VmValue)Port::Accuracy },
-    //{ "", (VmValue)Port:: },
-
-    //Interrupts
+    ScannerTarget, //Scanner found a robot
+    Damage,        //Robot took damage
+    Heat,          //Heat reached the damage threshold
+    MinesEmpty,    //Mine layer used its last mine
+    NumInterrupts,
+};
 
-    //Misc
-    { "INT_MAX", std::numeric_limits<VmValue>::max() },
-    { "INT_MIN", std::numeric_limits<VmValue>::min() },
-};
\ No newline at end of file
+//Address of the interrupt vector table. Comes after the ports in the reserved bytes. Entry i is at INTERRUPT_VECTOR_TABLE + i * sizeof(VmValue).
+const VmValue INTERRUPT_VECTOR_TABLE = 128;
+static_assert((size_t)Port::NumPorts * sizeof(VmValue) <= INTERRUPT_VECTOR_TABLE, "Ports overlap the interrupt vector table. Move it up.");
\ No newline at end of file
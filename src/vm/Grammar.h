@@ -0,0 +1,311 @@
+#pragma once
+#include "Typedefs.h"
+#include "Instruction.h"
+#include "Tokenizer.h"
+#include "Keywords.h"
+#include <stdexcept>
+#include <string>
+
+//Kind of token used as an instruction operand
+enum class OperandType : u8
+{
+    None,     //No operand
+    Register, //r0 - r7
+    Value,    //Number
+    Name,     //Variable or constant name
+    Label,    //Label name. Replaced with its address.
+    NumOperandTypes,
+};
+
+//Instruction union member an instruction is encoded with and the order its operands are written in
+enum class InstructionEncoding : u8
+{
+    None,             //op. Instruction::Op
+    Register,         //op register. Instruction::OpRegister
+    RegisterRegister, //op register register. Instruction::OpRegisterRegister
+    RegisterValue,    //op register value. Instruction::OpRegisterValue
+    ValueRegister,    //op value register. Instruction::OpRegisterValue
+    Value,            //op value. Instruction::OpRegisterValue without a register
+    Address,          //op address. Instruction::OpAddress
+    PortValue,        //op port value. Instruction::OpPortValue
+};
+
+//One form of an instruction. E.g. `mov register value`. Values, names, and labels are stored in the instruction immediate.
+struct GrammarRule
+{
+    Token Mnemonic;
+    OperandType Operands[2];
+    Opcode Op; //Opcode the compiler emits for this form
+    InstructionEncoding Encoding;
+    bool ConstantsOnly = false; //Names must be constants. Variable addresses aren't allowed.
+};
+
+//Every instruction form the compiler accepts. The disassembler prints each opcode with the encoding of the first rule that emits it.
+inline constexpr GrammarRule Grammar[] =
+{
+    //op register (register|value|constant|label)
+    { Token::Mov, { OperandType::Register, OperandType::Register }, Opcode::Mov, InstructionEncoding::RegisterRegister },
+    { Token::Mov, { OperandType::Register, OperandType::Value }, Opcode::MovVal, InstructionEncoding::RegisterValue },
+    { Token::Mov, { OperandType::Register, OperandType::Name }, Opcode::MovVal, InstructionEncoding::RegisterValue, true },
+    { Token::Mov, { OperandType::Register, OperandType::Label }, Opcode::MovVal, InstructionEncoding::RegisterValue }, //Label address. E.g. to fill interrupt vector table entries.
+    { Token::Add, { OperandType::Register, OperandType::Register }, Opcode::Add, InstructionEncoding::RegisterRegister },
+    { Token::Add, { OperandType::Register, OperandType::Value }, Opcode::AddVal, InstructionEncoding::RegisterValue },
+    { Token::Add, { OperandType::Register, OperandType::Name }, Opcode::AddVal, InstructionEncoding::RegisterValue, true },
+    { Token::Add, { OperandType::Register, OperandType::Label }, Opcode::AddVal, InstructionEncoding::RegisterValue },
+    { Token::Sub, { OperandType::Register, OperandType::Register }, Opcode::Sub, InstructionEncoding::RegisterRegister },
+    { Token::Sub, { OperandType::Register, OperandType::Value }, Opcode::SubVal, InstructionEncoding::RegisterValue },
+    { Token::Sub, { OperandType::Register, OperandType::Name }, Opcode::SubVal, InstructionEncoding::RegisterValue, true },
+    { Token::Sub, { OperandType::Register, OperandType::Label }, Opcode::SubVal, InstructionEncoding::RegisterValue },
+    { Token::Mul, { OperandType::Register, OperandType::Register }, Opcode::Mul, InstructionEncoding::RegisterRegister },
+    { Token::Mul, { OperandType::Register, OperandType::Value }, Opcode::MulVal, InstructionEncoding::RegisterValue },
+    { Token::Mul, { OperandType::Register, OperandType::Name }, Opcode::MulVal, InstructionEncoding::RegisterValue, true },
+    { Token::Mul, { OperandType::Register, OperandType::Label }, Opcode::MulVal, InstructionEncoding::RegisterValue },
+    { Token::Div, { OperandType::Register, OperandType::Register }, Opcode::Div, InstructionEncoding::RegisterRegister },
+    { Token::Div, { OperandType::Register, OperandType::Value }, Opcode::DivVal, InstructionEncoding::RegisterValue },
+    { Token::Div, { OperandType::Register, OperandType::Name }, Opcode::DivVal, InstructionEncoding::RegisterValue, true },
+    { Token::Div, { OperandType::Register, OperandType::Label }, Opcode::DivVal, InstructionEncoding::RegisterValue },
+    { Token::Mod, { OperandType::Register, OperandType::Register }, Opcode::Mod, InstructionEncoding::RegisterRegister },
+    { Token::Mod, { OperandType::Register, OperandType::Value }, Opcode::ModVal, InstructionEncoding::RegisterValue },
+    { Token::Mod, { OperandType::Register, OperandType::Name }, Opcode::ModVal, InstructionEncoding::RegisterValue, true },
+    { Token::Mod, { OperandType::Register, OperandType::Label }, Opcode::ModVal, InstructionEncoding::RegisterValue },
+    { Token::Cmp, { OperandType::Register, OperandType::Register }, Opcode::Cmp, InstructionEncoding::RegisterRegister },
+    { Token::Cmp, { OperandType::Register, OperandType::Value }, Opcode::CmpVal, InstructionEncoding::RegisterValue },
+    { Token::Cmp, { OperandType::Register, OperandType::Name }, Opcode::CmpVal, InstructionEncoding::RegisterValue, true },
+    { Token::Cmp, { OperandType::Register, OperandType::Label }, Opcode::CmpVal, InstructionEncoding::RegisterValue },
+    { Token::And, { OperandType::Register, OperandType::Register }, Opcode::And, InstructionEncoding::RegisterRegister },
+    { Token::And, { OperandType::Register, OperandType::Value }, Opcode::AndVal, InstructionEncoding::RegisterValue },
+    { Token::And, { OperandType::Register, OperandType::Name }, Opcode::AndVal, InstructionEncoding::RegisterValue, true },
+    { Token::And, { OperandType::Register, OperandType::Label }, Opcode::AndVal, InstructionEncoding::RegisterValue },
+    { Token::Or, { OperandType::Register, OperandType::Register }, Opcode::Or, InstructionEncoding::RegisterRegister },
+    { Token::Or, { OperandType::Register, OperandType::Value }, Opcode::OrVal, InstructionEncoding::RegisterValue },
+    { Token::Or, { OperandType::Register, OperandType::Name }, Opcode::OrVal, InstructionEncoding::RegisterValue, true },
+    { Token::Or, { OperandType::Register, OperandType::Label }, Opcode::OrVal, InstructionEncoding::RegisterValue },
+    { Token::Xor, { OperandType::Register, OperandType::Register }, Opcode::Xor, InstructionEncoding::RegisterRegister },
+    { Token::Xor, { OperandType::Register, OperandType::Value }, Opcode::XorVal, InstructionEncoding::RegisterValue },
+    { Token::Xor, { OperandType::Register, OperandType::Name }, Opcode::XorVal, InstructionEncoding::RegisterValue, true },
+    { Token::Xor, { OperandType::Register, OperandType::Label }, Opcode::XorVal, InstructionEncoding::RegisterValue },
+
+    //op register
+    { Token::Neg, { OperandType::Register }, Opcode::Neg, InstructionEncoding::Register },
+    { Token::Push, { OperandType::Register }, Opcode::Push, InstructionEncoding::Register },
+    { Token::Pop, { OperandType::Register }, Opcode::Pop, InstructionEncoding::Register },
+
+    //load register (register|address|variable)
+    { Token::Load, { OperandType::Register, OperandType::Value }, Opcode::Load, InstructionEncoding::RegisterValue },
+    { Token::Load, { OperandType::Register, OperandType::Name }, Opcode::Load, InstructionEncoding::RegisterValue },
+    { Token::Load, { OperandType::Register, OperandType::Register }, Opcode::LoadP, InstructionEncoding::RegisterRegister },
+
+    //store (register|address|variable) register
+    { Token::Store, { OperandType::Value, OperandType::Register }, Opcode::Store, InstructionEncoding::ValueRegister },
+    { Token::Store, { OperandType::Name, OperandType::Register }, Opcode::Store, InstructionEncoding::ValueRegister },
+    { Token::Store, { OperandType::Register, OperandType::Register }, Opcode::StoreP, InstructionEncoding::RegisterRegister },
+
+    //op (address|label)
+    { Token::Jmp, { OperandType::Value }, Opcode::Jmp, InstructionEncoding::Address },
+    { Token::Jmp, { OperandType::Label }, Opcode::Jmp, InstructionEncoding::Address },
+    { Token::Jeq, { OperandType::Value }, Opcode::Jeq, InstructionEncoding::Address },
+    { Token::Jeq, { OperandType::Label }, Opcode::Jeq, InstructionEncoding::Address },
+    { Token::Jne, { OperandType::Value }, Opcode::Jne, InstructionEncoding::Address },
+    { Token::Jne, { OperandType::Label }, Opcode::Jne, InstructionEncoding::Address },
+    { Token::Jgr, { OperandType::Value }, Opcode::Jgr, InstructionEncoding::Address },
+    { Token::Jgr, { OperandType::Label }, Opcode::Jgr, InstructionEncoding::Address },
+    { Token::Jls, { OperandType::Value }, Opcode::Jls, InstructionEncoding::Address },
+    { Token::Jls, { OperandType::Label }, Opcode::Jls, InstructionEncoding::Address },
+    { Token::Call, { OperandType::Value }, Opcode::Call, InstructionEncoding::Address },
+    { Token::Call, { OperandType::Label }, Opcode::Call, InstructionEncoding::Address },
+
+    //ipo register port
+    { Token::Ipo, { OperandType::Register, OperandType::Name }, Opcode::Ipo, InstructionEncoding::RegisterValue, true },
+    { Token::Ipo, { OperandType::Register, OperandType::Value }, Opcode::Ipo, InstructionEncoding::RegisterValue },
+
+    //opo port (register|value|constant)
+    { Token::Opo, { OperandType::Name, OperandType::Register }, Opcode::Opo, InstructionEncoding::ValueRegister },
+    { Token::Opo, { OperandType::Name, OperandType::Value }, Opcode::OpoVal, InstructionEncoding::PortValue, true },
+    { Token::Opo, { OperandType::Name, OperandType::Name }, Opcode::OpoVal, InstructionEncoding::PortValue, true },
+
+    //wait (register|value|constant)
+    { Token::Wait, { OperandType::Register }, Opcode::Wait, InstructionEncoding::Register },
+    { Token::Wait, { OperandType::Value }, Opcode::WaitVal, InstructionEncoding::Value },
+    { Token::Wait, { OperandType::Name }, Opcode::WaitVal, InstructionEncoding::Value, true },
+
+    //No operands
+    { Token::Ret, {}, Opcode::Ret, InstructionEncoding::None },
+    { Token::Nop, {}, Opcode::Nop, InstructionEncoding::None },
+    { Token::Hlt, {}, Opcode::Hlt, InstructionEncoding::None },
+    { Token::Iret, {}, Opcode::Iret, InstructionEncoding::None },
+};
+
+//Lookup tables for Grammar. Built at compile time.
+struct GrammarTable
+{
+    static constexpr u32 NUM_RULES = sizeof(Grammar) / sizeof(GrammarRule);
+    static constexpr u32 NUM_MNEMONICS = (u32)Token::Iret + 1; //Mnemonic tokens have the values of their opcodes. Iret is the last one.
+    static constexpr u32 NUM_OPERAND_TYPES = (u32)OperandType::NumOperandTypes;
+    static constexpr u32 NUM_OPCODES = 1 << INSTRUCTION_NUM_OPCODE_BITS;
+    static constexpr u8 NO_RULE = 0xFF;
+    static_assert(NUM_RULES < NO_RULE, "Too many grammar rules for u8 indices");
+
+    u8 Rules[NUM_MNEMONICS][NUM_OPERAND_TYPES][NUM_OPERAND_TYPES] = {}; //Index of the rule for a mnemonic and its operand types. NO_RULE if there isn't one.
+    u8 OpcodeRules[NUM_OPCODES] = {}; //Index of the first rule that emits each opcode. NO_RULE for opcodes the compiler doesn't emit.
+    bool Mnemonics[NUM_MNEMONICS] = {}; //True for tokens that start an instruction
+};
+
+constexpr GrammarTable BuildGrammarTable()
+{
+    GrammarTable table = {};
+    for (auto& operandRules : table.Rules)
+        for (auto& rules : operandRules)
+            for (u8& rule : rules)
+                rule = GrammarTable::NO_RULE;
+    for (u8& rule : table.OpcodeRules)
+        rule = GrammarTable::NO_RULE;
+
+    for (u32 i = 0; i < GrammarTable::NUM_RULES; i++)
+    {
+        const GrammarRule& rule = Grammar[i];
+        u8& index = table.Rules[(u32)rule.Mnemonic][(u32)rule.Operands[0]][(u32)rule.Operands[1]];
+        if (index != GrammarTable::NO_RULE)
+            throw std::logic_error("Grammar has two rules for the same mnemonic and operands");
+
+        index = (u8)i;
+        table.Mnemonics[(u32)rule.Mnemonic] = true;
+        if (table.OpcodeRules[(u32)rule.Op] == GrammarTable::NO_RULE)
+            table.OpcodeRules[(u32)rule.Op] = (u8)i;
+    }
+
+    return table;
+}
+
+inline constexpr GrammarTable GrammarTables = BuildGrammarTable();
+
+//Get the rule for a mnemonic and its operand types. Returns nullptr if the mnemonic has no form with those operands.
+constexpr const GrammarRule* FindGrammarRule(Token mnemonic, OperandType operandA, OperandType operandB)
+{
+    if ((u32)mnemonic >= GrammarTable::NUM_MNEMONICS || operandA >= OperandType::NumOperandTypes || operandB >= OperandType::NumOperandTypes)
+        return nullptr;
+
+    const u8 index = GrammarTables.Rules[(u32)mnemonic][(u32)operandA][(u32)operandB];
+    return index != GrammarTable::NO_RULE ? &Grammar[index] : nullptr;
+}
+
+//Get the rule the disassembler uses for an opcode. Returns nullptr for opcodes the compiler doesn't emit, like superinstructions.
+constexpr const GrammarRule* FindGrammarRule(Opcode opcode)
+{
+    const u8 index = GrammarTables.OpcodeRules[(u32)opcode & (GrammarTable::NUM_OPCODES - 1)];
+    return index != GrammarTable::NO_RULE ? &Grammar[index] : nullptr;
+}
+
+//True if token starts an instruction
+constexpr bool IsMnemonic(Token token)
+{
+    return (u32)token < GrammarTable::NUM_MNEMONICS && GrammarTables.Mnemonics[(u32)token];
+}
+
+//Get the operand type of a token. Returns OperandType::NumOperandTypes if the token can't be an operand.
+constexpr OperandType GetOperandType(Token token)
+{
+    switch (token)
+    {
+    case Token::Register:
+        return OperandType::Register;
+    case Token::Value:
+        return OperandType::Value;
+    case Token::VarName:
+        return OperandType::Name;
+    case Token::Label:
+        return OperandType::Label;
+    default:
+        return OperandType::NumOperandTypes;
+    }
+}
+
+//Make sure the tokenizer and grammar agree on the mnemonics. Every mnemonic must be a keyword with the same token.
+constexpr bool GrammarMnemonicsValid()
+{
+    for (const GrammarRule& rule : Grammar)
+    {
+        bool found = false;
+        for (const Keyword& keyword : Keywords)
+            if (keyword.Type == rule.Mnemonic)
+                found = true;
+
+        if (!found)
+            return false;
+    }
+    return true;
+}
+static_assert(GrammarMnemonicsValid(), "Grammar uses a mnemonic that isn't in Keywords");
+
+//Describe a rule. E.g. "mov register value"
+static std::string to_string(const GrammarRule& rule)
+{
+    std::string str = to_string(rule.Op);
+    for (u32 i = 0; i < 2; i++)
+    {
+        //Port operands are named as ports instead of values or constants
+        const bool port = (rule.Op == Opcode::Ipo && i == 1) || ((rule.Op == Opcode::Opo || rule.Op == Opcode::OpoVal) && i == 0);
+        switch (rule.Operands[i])
+        {
+        case OperandType::Register:
+            str += " register";
+            break;
+        case OperandType::Value:
+            str += port ? " port" : rule.Encoding == InstructionEncoding::Address || rule.Op == Opcode::Load || rule.Op == Opcode::Store ? " address" : " value";
+            break;
+        case OperandType::Name:
+            str += port ? " port" : (rule.ConstantsOnly ? " constant" : " variable");
+            break;
+        case OperandType::Label:
+            str += " label";
+            break;
+        default:
+            break;
+        }
+    }
+    return str;
+}
+
+//List every form of a mnemonic for syntax errors. E.g. "`neg register`"
+static std::string GetMnemonicSyntax(Token mnemonic)
+{
+    std::string str;
+    for (const GrammarRule& rule : Grammar)
+    {
+        //Skip forms that are written the same way. E.g. `ipo register port` with a constant or value port.
+        const std::string syntax = "`" + to_string(rule) + "`";
+        if (rule.Mnemonic == mnemonic && str.find(syntax) == std::string::npos)
+            str += (str.empty() ? "" : ", ") + syntax;
+    }
+
+    return str;
+}
+
+//Disassemble an instruction. Operands are written in the order the compiler reads them.
+static std::string to_string(const Instruction& instruction, bool useRealOpcodeNames = false)
+{
+    const GrammarRule* rule = FindGrammarRule((Opcode)instruction.Op.Opcode);
+    if (!rule)
+        return "Unsupported opcode " + std::to_string((u32)instruction.Op.Opcode);
+
+    std::string str = to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames);
+    switch (rule->Encoding)
+    {
+    case InstructionEncoding::Register:
+        return str + " r" + std::to_string(instruction.OpRegister.Reg);
+    case InstructionEncoding::RegisterRegister:
+        return str + " r" + std::to_string(instruction.OpRegisterRegister.RegA) + " r" + std::to_string(instruction.OpRegisterRegister.RegB);
+    case InstructionEncoding::RegisterValue:
+        return str + " r" + std::to_string(instruction.OpRegisterValue.RegA) + " " + std::to_string(instruction.OpRegisterValue.Value);
+    case InstructionEncoding::ValueRegister:
+        return str + " " + std::to_string(instruction.OpRegisterValue.Value) + " r" + std::to_string(instruction.OpRegisterValue.RegA);
+    case InstructionEncoding::Value:
+        return str + " " + std::to_string(instruction.OpRegisterValue.Value);
+    case InstructionEncoding::Address:
+        return str + " " + std::to_string(instruction.OpAddress.Address);
+    case InstructionEncoding::PortValue:
+        return str + " " + std::to_string(instruction.OpPortValue.Port) + " " + std::to_string(instruction.OpPortValue.Value);
+    case InstructionEncoding::None:
+    default:
+        return str;
+    }
+}
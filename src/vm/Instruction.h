@@ -4,9 +4,24 @@
 #include <magic_enum.hpp>
 #include <string>
 #include <cmath>
+#include <type_traits>
 
-//Number of bits/bytes for VM words & addresses
+//VM word size. Registers, variables, ports, and stack values are 16 bit unless the VM_WORD_32 cmake option is enabled.
+//Use 32 bit words for large arenas where distances don't fit in 16 bits. Instruction immediates are 16 bit either way.
+#if defined(VM_WORD_32_ENABLED)
+#define VM_WORD_32
+#endif
+
+//Number of bits/bytes for instruction immediates & addresses
 const u32 INSTRUCTION_NUM_VALUE_BITS = 16; //Range: [-32768, 32767]
+//Range of values the compiler accepts for immediates. Immediates are sign extended, so with 32 bit words only values in the signed range keep their value.
+//With 16 bit words 0x8000 - 0xFFFF are also allowed since they wrap to the same VmValue.
+const i32 INSTRUCTION_VALUE_MIN = -32768;
+#ifdef VM_WORD_32
+const i32 INSTRUCTION_VALUE_MAX = 32767;
+#else
+const i32 INSTRUCTION_VALUE_MAX = 65535;
+#endif
 //The number of bytes per value. Rounded up so the VM doesn't need to deal with sub-byte data sizes if non byte aligned values are ever tried.
 const u32 INSTRUCTION_NUM_VALUE_BYTES = u32(std::ceil(f32(INSTRUCTION_NUM_VALUE_BITS / 8)));
 //Number of bits instructions use for the opcode
@@ -18,8 +33,15 @@ const u32 INSTRUCTION_NUM_REGISTER_BITS = 3; //Allows up to 8 registers
 //This is fine since there are < 100 ports.
 const u32 INSTRUCTION_NUM_PORT_BITS = INSTRUCTION_NUM_VALUE_BITS - INSTRUCTION_NUM_OPCODE_BITS;
 
+#ifdef VM_WORD_32
+using VmValue = i32; //VM variable size
+using VmWide = i64; //Twice the size of VmValue. Arithmetic is done in it and truncated so results wrap instead of overflowing.
+#else
 using VmValue = i16; //VM variable size
+using VmWide = i32; //Twice the size of VmValue. Arithmetic is done in it and truncated so results wrap instead of overflowing.
+#endif
 using Register = VmValue; //VM register size
+using VmAddress = std::make_unsigned_t<VmValue>; //Register value used as a memory address. Negative values become large addresses that fail bounds checks.
 
 //Instruction layout based on SUNY AT instructions. Modified to allow for larger addresses and values, and more variables
 union Instruction
@@ -33,6 +55,7 @@ union Instruction
     } OpRegisterRegister;
 
     //(mov|add|sub|mul|div|cmp|and|or|xor|load|store|ipo|opo) register value
+    //wait value
     struct
     {
         u32 Opcode : INSTRUCTION_NUM_OPCODE_BITS;
@@ -56,14 +79,14 @@ union Instruction
         u32 Address : INSTRUCTION_NUM_VALUE_BITS;
     } OpAddress;
 
-    //(neg|push|pop) register
+    //(neg|push|pop|wait) register
     struct
     {
         u32 Opcode : INSTRUCTION_NUM_OPCODE_BITS;
         u32 Reg    : INSTRUCTION_NUM_REGISTER_BITS;
     } OpRegister;
 
-    //ret
+    //(ret|hlt|iret)
     struct
     {
         u32 Opcode : INSTRUCTION_NUM_OPCODE_BITS;
@@ -92,7 +115,7 @@ static_assert(sizeof(Instruction) == 4, "sizeof(Instruction) must be 4 bytes");
 
 //IMPORTANT: Don't change the values of these without updating the Compiler. It relies on the enums having certain values to shorten the code by combining switch cases.
 //Used to identify instructions
-enum class Opcode
+enum class Opcode : u8
 {
     Mov = 0,        //mov register register
     MovVal = 1,     //mov register value
@@ -132,7 +155,43 @@ enum class Opcode
     Nop = 35,       //nop
     Mod = 36,       //mod register register
     ModVal = 37,    //mod register value
+    Wait = 38,      //wait register
+    WaitVal = 39,   //wait value
+    Hlt = 40,       //hlt
+    Iret = 41,      //iret
+
+    //Superinstructions. Never emitted by the Compiler or stored in VM memory. VM::LoadProgram() fuses common instruction pairs into these in the decoded instruction stream.
+    //The first instruction of the pair is replaced with the superinstruction. Its handler runs both instructions, reading the second from the next DecodedInstruction.
+    CmpJeq = 42,    //cmp register register + jeq address
+    CmpJne = 43,    //cmp register register + jne address
+    CmpJgr = 44,    //cmp register register + jgr address
+    CmpJls = 45,    //cmp register register + jls address
+    CmpValJeq = 46, //cmp register value + jeq address
+    CmpValJne = 47, //cmp register value + jne address
+    CmpValJgr = 48, //cmp register value + jgr address
+    CmpValJls = 49, //cmp register value + jls address
+    IpoCmp = 50,    //ipo register port + cmp register register
+    IpoCmpVal = 51, //ipo register port + cmp register value
+    MovOpo = 52,    //mov register register + opo port register
+    MovValOpo = 53, //mov register value + opo port register
+
+    //Patched over instructions with a breakpoint or watchpoint by VM::PatchBreakpoints(). Never stored in VM memory.
+    //DecodedInstruction::Value indexes the list of patched instructions so the handler can run the original one.
+    Break = 54,
+};
+
+//Instruction unpacked into plain fields. VM::LoadProgram() decodes the whole program into these once so the VM doesn't need to
+//unpack Instruction bitfields or look up instruction durations each cycle. 8 bytes so they pack evenly into cache lines.
+struct alignas(8) DecodedInstruction
+{
+    Opcode Opcode;
+    u8 RegA;
+    u8 RegB;
+    u8 Cycles; //Number of cycles the instruction takes to execute. 0 if the instruction is unsupported.
+    i16 Value; //Immediate value, address, or port depending on the opcode. Same bits as Instruction::OpRegisterValue.Value and Instruction::OpAddress.Address
+    i16 Port; //Port used by ipo and opo. Unused by other opcodes.
 };
+static_assert(sizeof(DecodedInstruction) == 8, "sizeof(DecodedInstruction) must be 8 bytes");
 
 static std::string to_string(Opcode opcode, bool useRealOpcodeNames = false)
 {
@@ -158,84 +217,4 @@ static std::string to_string(Opcode opcode, bool useRealOpcodeNames = false)
     }
 
     return str;
-}
-
-static std::string to_string(const Instruction& instruction, bool useRealOpcodeNames = false)
-{
-    switch ((Opcode)instruction.Op.Opcode)
-    {
-    //Instructions that use OpRegisterRegister
-    case Opcode::Mov:
-    case Opcode::Add:
-    case Opcode::Sub:
-    case Opcode::Mul:
-    case Opcode::Div:
-    case Opcode::Cmp:
-    case Opcode::And:
-    case Opcode::Or:
-    case Opcode::Xor:
-    case Opcode::LoadP:
-    case Opcode::StoreP:
-    case Opcode::Mod:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames) + " "
-               + "r" + std::to_string(instruction.OpRegisterRegister.RegA) + " "
-               + "r" + std::to_string(instruction.OpRegisterRegister.RegB);
-
-    //Instructions that use OpRegisterValue
-    case Opcode::MovVal:
-    case Opcode::AddVal:
-    case Opcode::SubVal:
-    case Opcode::MulVal:
-    case Opcode::DivVal:
-    case Opcode::CmpVal:
-    case Opcode::AndVal:
-    case Opcode::OrVal:
-    case Opcode::XorVal:
-    case Opcode::Load:
-    case Opcode::Ipo:
-    case Opcode::ModVal:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames) + " "
-               + "r" + std::to_string(instruction.OpRegisterValue.RegA) + " "
-               + std::to_string(instruction.OpRegisterValue.Value);
-
-    //Special case for this variant of store & opo
-    case Opcode::Store:
-    case Opcode::Opo:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames) + " "
-               + std::to_string(instruction.OpRegisterValue.Value) + " "
-               + "r" + std::to_string(instruction.OpRegisterValue.RegA);
-
-    //Instructions that use OpAddress
-    case Opcode::Jmp:
-    case Opcode::Jeq:
-    case Opcode::Jne:
-    case Opcode::Jgr:
-    case Opcode::Jls:
-    case Opcode::Call:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames) + " "
-               + std::to_string(instruction.OpAddress.Address);
-
-    //Instructions that use Op
-    case Opcode::Ret:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames);
-
-    //Instructions that use OpRegister
-    case Opcode::Neg:
-    case Opcode::Push:
-    case Opcode::Pop:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames) + " "
-               + "r" + std::to_string(instruction.OpRegister.Reg);
-
-    //Special case for this variant of opo
-    case Opcode::OpoVal:
-        return to_string((Opcode)instruction.Op.Opcode, useRealOpcodeNames) + " "
-               + std::to_string(instruction.OpPortValue.Port) + " "
-               + std::to_string(instruction.OpPortValue.Value);
-    
-    case Opcode::Nop:
-        return "nop";
-
-    default:
-        return "Unsupported opcode " + std::to_string((u32)instruction.Op.Opcode);
-    }
 }
\ No newline at end of file
@@ -0,0 +1,654 @@
+#include "Jit.h"
+#include "VM.h"
+
+#ifdef VM_JIT
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <cstring>
+#include <cstdint>
+
+/*
+    Generated code layout:
+        - Entry point: u64 Entry(VM* vm, u32 cycleBudget, const u8* block). Saves registers and jumps to the block for PC.
+        - One block per instruction. Each checks the cycle budget, subtracts the instruction duration, then runs the instruction.
+        - Exit stubs that store the exit reason and PC, then return to JitProgram::Run().
+
+    Registers used by generated code:
+        rbx = VM*
+        r12d = cycles remaining in the budget
+        r13 = JitProgram::_blocks.data(). Used to jump to the block for a PC only known at runtime (ret).
+        r14 = VM::Memory. Loaded on entry since VM memory isn't stored in the VM.
+        rax, rcx, rdx = scratch
+
+    The return value packs the exit into a u64: (reason << 48) | (PC << 32) | cyclesRemaining
+*/
+
+//x86-64 registers used as operands by the emitter
+enum X64Register : u8
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+};
+
+//x86-64 jump condition codes. Second byte of the near jcc encoding (0F 8x rel32).
+enum X64Condition : u8
+{
+    Below = 0x82,
+    AboveOrEqual = 0x83,
+    Equal = 0x84,
+    NotEqual = 0x85,
+    BelowOrEqual = 0x86,
+    Above = 0x87,
+};
+
+//Writes x86-64 machine code. Only has the handful of instruction encodings the JIT needs.
+//Memory operands are relative to rbx (the VM) or r14 (VM memory). VM memory operands are optionally indexed by rax (VM memory addresses).
+//Word operations use the VM word size. 16 bit operations take an operand size prefix. See VM_WORD_32.
+class X64Emitter
+{
+public:
+    std::vector<u8> Code = {};
+    static constexpr bool WORD_16 = sizeof(VmValue) == 2;
+
+    u32 NewLabel()
+    {
+        _labels.push_back(UNBOUND_LABEL);
+        return (u32)_labels.size() - 1;
+    }
+    void Bind(u32 label) { _labels[label] = Code.size(); }
+    size_t LabelOffset(u32 label) const { return _labels[label]; }
+
+    void Byte(u8 value) { Code.push_back(value); }
+    void Bytes(std::initializer_list<u8> values) { Code.insert(Code.end(), values); }
+    void U16(u16 value) { Bytes({ (u8)value, (u8)(value >> 8) }); }
+    void U32(u32 value) { Bytes({ (u8)value, (u8)(value >> 8), (u8)(value >> 16), (u8)(value >> 24) }); }
+    void U64(u64 value) { U32((u32)value); U32((u32)(value >> 32)); }
+
+    //jmp label
+    void Jump(u32 label)
+    {
+        Byte(0xE9);
+        Fixup(label);
+    }
+    //jcc label
+    void JumpIf(X64Condition condition, u32 label)
+    {
+        Bytes({ 0x0F, (u8)condition });
+        Fixup(label);
+    }
+
+    //movzx reg32, word [rbx + disp] or mov reg32, dword [rbx + disp]
+    void LoadWord(X64Register reg, i32 disp) { if (WORD_16) Bytes({ 0x0F, 0xB7, ModRM(2, reg, 3) }); else Bytes({ 0x8B, ModRM(2, reg, 3) }); U32(disp); }
+    //movsx reg32, word [rbx + disp] or movsxd reg64, dword [rbx + disp]. Sign extended to the width division is done in.
+    void LoadWide(X64Register reg, i32 disp) { if (WORD_16) Bytes({ 0x0F, 0xBF, ModRM(2, reg, 3) }); else Bytes({ 0x48, 0x63, ModRM(2, reg, 3) }); U32(disp); }
+    //mov word [rbx + disp], reg
+    void StoreWord(i32 disp, X64Register reg) { WordPrefix(); Bytes({ 0x89, ModRM(2, reg, 3) }); U32(disp); }
+    //mov word [rbx + disp], imm
+    void StoreImmediateWord(i32 disp, i16 value) { WordPrefix(); Bytes({ 0xC7, ModRM(2, 0, 3) }); U32(disp); Immediate(value); }
+    //movzx reg32, word [r14 + address] or mov reg32, dword [r14 + address]
+    void LoadMemoryWord(X64Register reg, i32 address) { if (WORD_16) Bytes({ 0x41, 0x0F, 0xB7, ModRM(2, reg, 6) }); else Bytes({ 0x41, 0x8B, ModRM(2, reg, 6) }); U32(address); }
+    //mov word [r14 + address], reg
+    void StoreMemoryWord(i32 address, X64Register reg) { WordPrefix(); Bytes({ 0x41, 0x89, ModRM(2, reg, 6) }); U32(address); }
+    //movsx reg32, word [r14 + rax] or mov reg32, dword [r14 + rax]
+    void LoadMemoryWordIndexed(X64Register reg) { if (WORD_16) Bytes({ 0x41, 0x0F, 0xBF, ModRM(0, reg, 4), 0x06 }); else Bytes({ 0x41, 0x8B, ModRM(0, reg, 4), 0x06 }); }
+    //mov word [r14 + rax], reg
+    void StoreMemoryWordIndexed(X64Register reg) { WordPrefix(); Bytes({ 0x41, 0x89, ModRM(0, reg, 4), 0x06 }); }
+    //mov word [r14 + rax], imm
+    void StoreMemoryImmediateWordIndexed(i16 value) { WordPrefix(); Bytes({ 0x41, 0xC7, ModRM(0, 0, 4), 0x06 }); Immediate(value); }
+
+    //op ax, cx. opcode is the 'op r/m, r' opcode. E.g. 0x01 for add.
+    void AluRegister(u8 opcode) { WordPrefix(); Bytes({ opcode, ModRM(3, RCX, RAX) }); }
+    //op ax, imm. opcode is the short 'op ax, imm' opcode. E.g. 0x05 for add.
+    void AluImmediate(u8 opcode, i16 value) { WordPrefix(); Byte(opcode); Immediate(value); }
+    //imul ax, cx
+    void MultiplyRegister() { WordPrefix(); Bytes({ 0x0F, 0xAF, 0xC1 }); }
+    //imul ax, ax, imm
+    void MultiplyImmediate(i16 value) { WordPrefix(); Bytes({ 0x69, 0xC0 }); Immediate(value); }
+    //neg ax
+    void Negate() { WordPrefix(); Bytes({ 0xF7, 0xD8 }); }
+    //test ax, ax
+    void TestWord() { WordPrefix(); Bytes({ 0x85, 0xC0 }); }
+    //mov ecx, imm32 or mov rcx, imm32. Sign extended to the width division is done in.
+    void MoveWideEcx(i32 value) { if (WORD_16) Byte(0xB9); else Bytes({ 0x48, 0xC7, 0xC1 }); U32((u32)value); }
+    //test ecx, ecx or test rcx, rcx
+    void TestWideEcx() { if (WORD_16) Bytes({ 0x85, 0xC9 }); else Bytes({ 0x48, 0x85, 0xC9 }); }
+    //cdq, idiv ecx or cqo, idiv rcx. Done at twice the word size so the min value / -1 doesn't fault.
+    void DivideWide() { if (WORD_16) Bytes({ 0x99, 0xF7, 0xF9 }); else Bytes({ 0x48, 0x99, 0x48, 0xF7, 0xF9 }); }
+
+    //setz byte [rbx + zeroDisp], sets byte [rbx + signDisp]. Copies the x86 flags of the last word result into the VM flags.
+    void SetVmFlags(i32 zeroDisp, i32 signDisp)
+    {
+        Bytes({ 0x0F, 0x94, ModRM(2, 0, 3) }); U32(zeroDisp);
+        Bytes({ 0x0F, 0x98, ModRM(2, 0, 3) }); U32(signDisp);
+    }
+    //cmp byte [rbx + disp], 0
+    void CompareByteZero(i32 disp) { Bytes({ 0x80, ModRM(2, 7, 3) }); U32(disp); Byte(0); }
+    //cmp r12d, imm32
+    void CompareBudget(u32 value) { Bytes({ 0x41, 0x81, 0xFC }); U32(value); }
+    //sub r12d, imm32
+    void SubtractBudget(u32 value) { Bytes({ 0x41, 0x81, 0xEC }); U32(value); }
+    //add r12d, imm32
+    void AddBudget(u32 value) { Bytes({ 0x41, 0x81, 0xC4 }); U32(value); }
+    //cmp eax, imm32
+    void CompareEax(u32 value) { Byte(0x3D); U32(value); }
+    //mov eax, imm32
+    void MoveEax(u32 value) { Byte(0xB8); U32(value); }
+
+    //Patch label references. Returns false if a label was never bound.
+    bool ResolveLabels()
+    {
+        for (const LabelFixup& fixup : _fixups)
+        {
+            if (_labels[fixup.Label] == UNBOUND_LABEL)
+                return false;
+
+            const i32 offset = (i32)(_labels[fixup.Label] - (fixup.Position + sizeof(i32))); //rel32 is relative to the end of the instruction
+            memcpy(&Code[fixup.Position], &offset, sizeof(i32));
+        }
+        return true;
+    }
+
+private:
+    static u8 ModRM(u8 mod, u8 reg, u8 rm) { return (mod << 6) | (reg << 3) | rm; }
+    void WordPrefix() { if (WORD_16) Byte(0x66); }
+    //Instruction immediates are sign extended to the word size
+    void Immediate(i16 value) { if (WORD_16) U16((u16)value); else U32((u32)(i32)value); }
+    void Fixup(u32 label)
+    {
+        _fixups.push_back({ Code.size(), label });
+        U32(0); //Patched by ResolveLabels()
+    }
+
+    struct LabelFixup
+    {
+        size_t Position; //Offset of the rel32 to patch
+        u32 Label;
+    };
+    static constexpr size_t UNBOUND_LABEL = SIZE_MAX;
+    std::vector<size_t> _labels = {};
+    std::vector<LabelFixup> _fixups = {};
+};
+
+std::unique_ptr<JitProgram> JitProgram::Compile(VM& vm, const std::vector<DecodedInstruction>& instructions)
+{
+    if (instructions.empty())
+        return nullptr;
+    for (const DecodedInstruction& instruction : instructions)
+        if (instruction.Cycles == 0)
+            return nullptr; //Unsupported instruction. Let the interpreter report it.
+
+    //Offsets of VM state from the VM pointer held in rbx
+    const i32 registersOffset = (i32)((u8*)&vm.Registers[0] - (u8*)&vm);
+    const i32 memoryPointerOffset = (i32)((u8*)&vm.Memory - (u8*)&vm);
+    const i32 spOffset = (i32)((u8*)&vm.SP - (u8*)&vm);
+    const i32 flagZeroOffset = (i32)((u8*)&vm.FlagZero - (u8*)&vm);
+    const i32 flagSignOffset = (i32)((u8*)&vm.FlagSign - (u8*)&vm);
+    auto reg = [&](u8 index) -> i32 { return registersOffset + index * (i32)sizeof(Register); };
+
+    const u32 instructionsSize = vm.InstructionsSize();
+    const u32 memorySize = vm.MemorySize();
+    const u32 stackLimit = VM::RESERVED_BYTES + vm.InstructionsSize() + vm.VariablesSize(); //SP <= stackLimit is a stack overflow
+
+    std::unique_ptr<JitProgram> program(new JitProgram());
+    program->_blocks.resize(instructions.size());
+    program->_instructions = instructions;
+    X64Emitter e;
+
+    //Labels
+    std::vector<u32> blockLabels(instructions.size());
+    for (u32& label : blockLabels)
+        label = e.NewLabel();
+    const u32 exitLabel = e.NewLabel();
+    const u32 dispatchLabel = e.NewLabel();
+    const u32 dispatchUnalignedLabel = e.NewLabel();
+
+    //Exit stubs emitted after all the blocks
+    struct ExitStub
+    {
+        u32 Label;
+        JitExitReason Reason;
+        u16 PC;
+        u32 Refund; //Cycles to give back to the budget. Used when an instruction is stopped after its cycles were taken.
+    };
+    std::vector<ExitStub> stubs = {};
+    auto exitStub = [&](JitExitReason reason, u16 pc, u32 refund = 0) -> u32
+    {
+        const u32 label = e.NewLabel();
+        stubs.push_back({ label, reason, pc, refund });
+        return label;
+    };
+
+    //Get the label to jump to for a static jump target. Follows the same rules as VM::Fetch().
+    auto jumpTarget = [&](u16 address) -> u32
+    {
+        if (address < VM::RESERVED_BYTES || address >= VM::RESERVED_BYTES + instructionsSize)
+            return blockLabels[0];
+        if ((address - VM::RESERVED_BYTES) % sizeof(Instruction) != 0)
+            return exitStub(JitExitReason::Unaligned, address);
+
+        return blockLabels[(address - VM::RESERVED_BYTES) / sizeof(Instruction)];
+    };
+
+    //Entry point. Save callee saved registers. 4 pushes + 40 bytes keeps the stack 16 byte aligned and provides shadow space for win64 calls.
+    e.Bytes({ 0x53 });             //push rbx
+    e.Bytes({ 0x41, 0x54 });       //push r12
+    e.Bytes({ 0x41, 0x55 });       //push r13
+    e.Bytes({ 0x41, 0x56 });       //push r14
+    e.Bytes({ 0x48, 0x83, 0xEC, 0x28 }); //sub rsp, 40
+#ifdef _WIN32
+    e.Bytes({ 0x48, 0x89, 0xCB }); //mov rbx, rcx
+    e.Bytes({ 0x41, 0x89, 0xD4 }); //mov r12d, edx
+#else
+    e.Bytes({ 0x48, 0x89, 0xFB }); //mov rbx, rdi
+    e.Bytes({ 0x41, 0x89, 0xF4 }); //mov r12d, esi
+#endif
+    e.Bytes({ 0x49, 0xBD }); e.U64((u64)program->_blocks.data()); //mov r13, blocks
+    e.Bytes({ 0x4C, 0x8B, 0xB3 }); e.U32(memoryPointerOffset); //mov r14, [rbx + VM::Memory]
+#ifdef _WIN32
+    e.Bytes({ 0x41, 0xFF, 0xE0 }); //jmp r8
+#else
+    e.Bytes({ 0xFF, 0xE2 });       //jmp rdx
+#endif
+
+    //Call VM::JitPortRead/JitPortWrite(vm, instruction, cyclesRemaining). Exits if it stopped so the caller can update hardware before the port access.
+    //Also exits after the access if the port handler raised an interrupt, so the VM can dispatch it before the next instruction.
+    auto callPortHandler = [&](JitPortResult (*handler)(VM*, const DecodedInstruction*, u32), const DecodedInstruction* instruction, u16 address)
+    {
+#ifdef _WIN32
+        e.Bytes({ 0x48, 0x89, 0xD9 }); //mov rcx, rbx
+        e.Bytes({ 0x48, 0xBA }); e.U64((u64)instruction); //mov rdx, instruction
+        e.Bytes({ 0x45, 0x89, 0xE0 }); //mov r8d, r12d
+#else
+        e.Bytes({ 0x48, 0x89, 0xDF }); //mov rdi, rbx
+        e.Bytes({ 0x48, 0xBE }); e.U64((u64)instruction); //mov rsi, instruction
+        e.Bytes({ 0x44, 0x89, 0xE2 }); //mov edx, r12d
+#endif
+        e.Bytes({ 0x48, 0xB8 }); e.U64((u64)handler); //mov rax, handler
+        e.Bytes({ 0xFF, 0xD0 }); //call rax
+        e.Bytes({ 0x3C, (u8)JitPortResult::Done }); //cmp al, Done
+        e.JumpIf(Below, exitStub(JitExitReason::Port, address, instruction->Cycles));
+        e.JumpIf(Above, exitStub(JitExitReason::Interrupt, address + sizeof(Instruction)));
+    };
+
+    //Generate a block for each instruction
+    for (u32 i = 0; i < instructions.size(); i++)
+    {
+        const DecodedInstruction& instruction = program->_instructions[i]; //The copy owned by the program since port handlers are passed pointers to it
+        const u16 address = VM::RESERVED_BYTES + i * sizeof(Instruction);
+        const u16 nextAddress = address + sizeof(Instruction);
+        const i32 regA = reg(instruction.RegA);
+        const i32 regB = reg(instruction.RegB);
+        const i16 value = instruction.Value; //Sign extended to the word size by the emitter
+        const u16 target = (u16)instruction.Value; //Jump and call address
+        const u32 memoryAddress = (VmAddress)instruction.Value; //Load and store address. Negative values are out of bounds like in the interpreter.
+        e.Bind(blockLabels[i]);
+
+        //Stop if there aren't enough cycles left to run the instruction
+        e.CompareBudget(instruction.Cycles);
+        e.JumpIf(Below, exitStub(JitExitReason::Stop, address));
+        e.SubtractBudget(instruction.Cycles);
+
+        //Only created if the instruction needs it
+        u32 deoptLabel = UINT32_MAX;
+        auto deopt = [&]() -> u32
+        {
+            if (deoptLabel == UINT32_MAX)
+                deoptLabel = exitStub(JitExitReason::Deopt, address);
+            return deoptLabel;
+        };
+
+        switch (instruction.Opcode)
+        {
+        case Opcode::Mov:
+            e.LoadWord(RAX, regB);
+            e.StoreWord(regA, RAX);
+            break;
+        case Opcode::MovVal:
+            e.StoreImmediateWord(regA, value);
+            break;
+
+            //Arithmetic. Done with word sized operations so x86 flags match VM::SetFlags()
+        case Opcode::Add:
+        case Opcode::Sub:
+            e.LoadWord(RAX, regA);
+            e.LoadWord(RCX, regB);
+            e.AluRegister(instruction.Opcode == Opcode::Add ? 0x01 : 0x29);
+            e.StoreWord(regA, RAX);
+            e.SetVmFlags(flagZeroOffset, flagSignOffset);
+            break;
+        case Opcode::AddVal:
+        case Opcode::SubVal:
+            e.LoadWord(RAX, regA);
+            e.AluImmediate(instruction.Opcode == Opcode::AddVal ? 0x05 : 0x2D, value);
+            e.StoreWord(regA, RAX);
+            e.SetVmFlags(flagZeroOffset, flagSignOffset);
+            break;
+        case Opcode::Mul:
+        case Opcode::MulVal:
+            e.LoadWord(RAX, regA);
+            if (instruction.Opcode == Opcode::Mul)
+            {
+                e.LoadWord(RCX, regB);
+                e.MultiplyRegister();
+            }
+            else
+            {
+                e.MultiplyImmediate(value);
+            }
+            e.StoreWord(regA, RAX);
+            e.TestWord();
+            e.SetVmFlags(flagZeroOffset, flagSignOffset);
+            break;
+        case Opcode::Div:
+        case Opcode::DivVal:
+        case Opcode::Mod:
+        case Opcode::ModVal:
+        {
+            //Double width division like the interpreter. Avoids the x86 fault on the min value / -1 with word sized idiv.
+            const bool registerDivisor = instruction.Opcode == Opcode::Div || instruction.Opcode == Opcode::Mod;
+            const bool mod = instruction.Opcode == Opcode::Mod || instruction.Opcode == Opcode::ModVal;
+            if (!registerDivisor && instruction.Value == 0)
+            {
+                e.Jump(deopt()); //Always divides by zero. Interpreter reports the error.
+                break;
+            }
+
+            e.LoadWide(RAX, regA);
+            if (registerDivisor)
+            {
+                e.LoadWide(RCX, regB);
+                e.TestWideEcx();
+                e.JumpIf(Equal, deopt());
+            }
+            else
+            {
+                e.MoveWideEcx(instruction.Value);
+            }
+            e.DivideWide();
+            if (mod)
+            {
+                e.StoreWord(regA, RDX);
+            }
+            else
+            {
+                e.StoreWord(regA, RAX);
+                e.TestWord();
+                e.SetVmFlags(flagZeroOffset, flagSignOffset);
+            }
+            break;
+        }
+        case Opcode::Cmp:
+            e.LoadWord(RAX, regA);
+            e.LoadWord(RCX, regB);
+            e.AluRegister(0x29); //sub ax, cx
+            e.SetVmFlags(flagZeroOffset, flagSignOffset);
+            break;
+        case Opcode::CmpVal:
+            e.LoadWord(RAX, regA);
+            e.AluImmediate(0x2D, value); //sub ax, imm
+            e.SetVmFlags(flagZeroOffset, flagSignOffset);
+            break;
+
+            //Bitwise operations. Don't update VM flags.
+        case Opcode::And:
+        case Opcode::Or:
+        case Opcode::Xor:
+            e.LoadWord(RAX, regA);
+            e.LoadWord(RCX, regB);
+            e.AluRegister(instruction.Opcode == Opcode::And ? 0x21 : instruction.Opcode == Opcode::Or ? 0x09 : 0x31);
+            e.StoreWord(regA, RAX);
+            break;
+        case Opcode::AndVal:
+        case Opcode::OrVal:
+        case Opcode::XorVal:
+            e.LoadWord(RAX, regA);
+            e.AluImmediate(instruction.Opcode == Opcode::AndVal ? 0x25 : instruction.Opcode == Opcode::OrVal ? 0x0D : 0x35, value);
+            e.StoreWord(regA, RAX);
+            break;
+        case Opcode::Neg:
+            e.LoadWord(RAX, regA);
+            e.Negate();
+            e.StoreWord(regA, RAX);
+            break;
+
+            //Jumps go straight to the target block
+        case Opcode::Jmp:
+            if (target >= memorySize)
+                e.Jump(deopt());
+            else
+                e.Jump(jumpTarget(target));
+            break;
+        case Opcode::Jeq:
+            e.CompareByteZero(flagZeroOffset);
+            e.JumpIf(NotEqual, jumpTarget(target));
+            break;
+        case Opcode::Jne:
+            e.CompareByteZero(flagZeroOffset);
+            e.JumpIf(Equal, jumpTarget(target));
+            break;
+        case Opcode::Jgr:
+            e.Bytes({ 0x8A, 0x83 }); e.U32(flagZeroOffset); //mov al, FlagZero
+            e.Bytes({ 0x0A, 0x83 }); e.U32(flagSignOffset); //or al, FlagSign
+            e.JumpIf(Equal, jumpTarget(target));
+            break;
+        case Opcode::Jls:
+            e.CompareByteZero(flagSignOffset);
+            e.JumpIf(NotEqual, jumpTarget(target));
+            break;
+        case Opcode::Call:
+            if (target > memorySize - sizeof(VmValue))
+            {
+                e.Jump(deopt());
+                break;
+            }
+            //Push return address
+            e.LoadWord(RAX, spOffset);
+            e.CompareEax(stackLimit);
+            e.JumpIf(BelowOrEqual, deopt());
+            e.Bytes({ 0x83, 0xE8, sizeof(VmValue) }); //sub eax, sizeof(VmValue)
+            e.StoreWord(spOffset, RAX);
+            e.StoreMemoryImmediateWordIndexed((i16)nextAddress);
+            e.Jump(jumpTarget(target));
+            break;
+        case Opcode::Ret:
+            //Pop return address and jump to it
+            e.LoadWord(RAX, spOffset);
+            e.CompareEax(memorySize);
+            e.JumpIf(AboveOrEqual, deopt());
+            e.LoadMemoryWordIndexed(RCX);
+            e.Bytes({ 0x83, 0xC0, sizeof(VmValue) }); //add eax, sizeof(VmValue)
+            e.StoreWord(spOffset, RAX);
+            e.Bytes({ 0x89, 0xC8 }); //mov eax, ecx
+            e.Jump(dispatchLabel);
+            break;
+
+            //Memory access. Stores to the instruction block are left to the interpreter so it can redecode them.
+        case Opcode::Load:
+            if (memoryAddress > memorySize - sizeof(VmValue))
+            {
+                e.Jump(deopt());
+                break;
+            }
+            e.LoadMemoryWord(RAX, memoryAddress);
+            e.StoreWord(regA, RAX);
+            break;
+        case Opcode::LoadP:
+            e.LoadWord(RAX, regB);
+            e.CompareEax(memorySize - sizeof(VmValue));
+            e.JumpIf(Above, deopt());
+            e.LoadMemoryWordIndexed(RCX);
+            e.StoreWord(regA, RCX);
+            break;
+        case Opcode::Store:
+            if (memoryAddress > memorySize - sizeof(VmValue) || (memoryAddress < VM::RESERVED_BYTES + instructionsSize && memoryAddress + sizeof(VmValue) > VM::RESERVED_BYTES))
+            {
+                e.Jump(deopt());
+                break;
+            }
+            e.LoadWord(RAX, regA);
+            e.StoreMemoryWord(memoryAddress, RAX);
+            break;
+        case Opcode::StoreP:
+        {
+            const u32 storeLabel = e.NewLabel();
+            e.LoadWord(RAX, regA);
+            e.CompareEax(memorySize - sizeof(VmValue));
+            e.JumpIf(Above, deopt());
+            e.CompareEax(VM::RESERVED_BYTES + instructionsSize);
+            e.JumpIf(AboveOrEqual, storeLabel);
+            e.CompareEax(VM::RESERVED_BYTES - sizeof(VmValue) + 1);
+            e.JumpIf(AboveOrEqual, deopt());
+            e.Bind(storeLabel);
+            e.LoadWord(RCX, regB);
+            e.StoreMemoryWordIndexed(RCX);
+            break;
+        }
+        case Opcode::Push:
+            e.LoadWord(RAX, spOffset);
+            e.CompareEax(stackLimit);
+            e.JumpIf(BelowOrEqual, deopt());
+            e.Bytes({ 0x83, 0xE8, sizeof(VmValue) }); //sub eax, sizeof(VmValue)
+            e.StoreWord(spOffset, RAX);
+            e.LoadWord(RCX, regA);
+            e.StoreMemoryWordIndexed(RCX);
+            break;
+        case Opcode::Pop:
+            e.LoadWord(RAX, spOffset);
+            e.CompareEax(memorySize);
+            e.JumpIf(AboveOrEqual, deopt());
+            e.LoadMemoryWordIndexed(RCX);
+            e.Bytes({ 0x83, 0xC0, sizeof(VmValue) }); //add eax, sizeof(VmValue)
+            e.StoreWord(spOffset, RAX);
+            e.StoreWord(regA, RCX);
+            break;
+
+            //Ports call back into the VM port handlers
+        case Opcode::Ipo:
+            callPortHandler(&VM::JitPortRead, &instruction, address);
+            break;
+        case Opcode::Opo:
+        case Opcode::OpoVal:
+            callPortHandler(&VM::JitPortWrite, &instruction, address);
+            break;
+        case Opcode::Nop:
+            break;
+
+        default:
+            e.Jump(deopt());
+            break;
+        }
+    }
+    //Running past the last instruction wraps back to the first one
+    e.Jump(blockLabels[0]);
+
+    //Jump to the block for the PC in eax. Used by ret.
+    e.Bind(dispatchLabel);
+    e.Bytes({ 0x89, 0xC1 }); //mov ecx, eax
+    e.Bytes({ 0x2D }); e.U32(VM::RESERVED_BYTES); //sub eax, RESERVED_BYTES
+    e.CompareEax(instructionsSize);
+    e.JumpIf(AboveOrEqual, blockLabels[0]); //Out of bounds PC resets to the first instruction
+    e.Bytes({ 0xA9 }); e.U32(sizeof(Instruction) - 1); //test eax, 3
+    e.JumpIf(NotEqual, dispatchUnalignedLabel);
+    e.Bytes({ 0x41, 0xFF, 0x64, 0x45, 0x00 }); //jmp [r13 + rax * 2]. 4 bytes per instruction, 8 bytes per block pointer.
+
+    //Unaligned PC only known at runtime. PC is in ecx.
+    e.Bind(dispatchUnalignedLabel);
+    e.Bytes({ 0x0F, 0xB7, 0xC1 }); //movzx eax, cx
+    e.Bytes({ 0x0D }); e.U32((u32)JitExitReason::Unaligned << 16); //or eax, reason
+    e.Jump(exitLabel);
+
+    //Exit stubs. Set eax = (reason << 16) | PC
+    for (const ExitStub& stub : stubs)
+    {
+        e.Bind(stub.Label);
+        if (stub.Refund)
+            e.AddBudget(stub.Refund);
+        e.MoveEax(((u32)stub.Reason << 16) | stub.PC);
+        e.Jump(exitLabel);
+    }
+
+    //Return (eax << 32) | r12d and restore registers
+    e.Bind(exitLabel);
+    e.Bytes({ 0x48, 0xC1, 0xE0, 0x20 }); //shl rax, 32
+    e.Bytes({ 0x44, 0x89, 0xE1 });       //mov ecx, r12d
+    e.Bytes({ 0x48, 0x09, 0xC8 });       //or rax, rcx
+    e.Bytes({ 0x48, 0x83, 0xC4, 0x28 }); //add rsp, 40
+    e.Bytes({ 0x41, 0x5E });             //pop r14
+    e.Bytes({ 0x41, 0x5D });             //pop r13
+    e.Bytes({ 0x41, 0x5C });             //pop r12
+    e.Bytes({ 0x5B });                   //pop rbx
+    e.Bytes({ 0xC3 });                   //ret
+
+    if (!e.ResolveLabels())
+        return nullptr;
+
+    //Copy code to executable memory. Written while read/write, then switched to read/execute.
+    program->_codeSize = e.Code.size();
+#ifdef _WIN32
+    program->_code = (u8*)VirtualAlloc(nullptr, program->_codeSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!program->_code)
+        return nullptr;
+
+    memcpy(program->_code, e.Code.data(), program->_codeSize);
+    DWORD oldProtect;
+    if (!VirtualProtect(program->_code, program->_codeSize, PAGE_EXECUTE_READ, &oldProtect))
+        return nullptr;
+    FlushInstructionCache(GetCurrentProcess(), program->_code, program->_codeSize);
+#else
+    void* code = mmap(nullptr, program->_codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return nullptr;
+
+    program->_code = (u8*)code;
+    memcpy(program->_code, e.Code.data(), program->_codeSize);
+    if (mprotect(program->_code, program->_codeSize, PROT_READ | PROT_EXEC) != 0)
+        return nullptr;
+#endif
+
+    //Get native address of each block
+    for (size_t i = 0; i < program->_blocks.size(); i++)
+        program->_blocks[i] = program->_code + e.LabelOffset(blockLabels[i]);
+
+    return program;
+}
+#endif
+
+JitProgram::~JitProgram()
+{
+#ifdef VM_JIT
+    if (!_code)
+        return;
+
+#ifdef _WIN32
+    VirtualFree(_code, 0, MEM_RELEASE);
+#else
+    munmap(_code, _codeSize);
+#endif
+#endif
+}
+
+#ifndef VM_JIT
+std::unique_ptr<JitProgram> JitProgram::Compile(VM& vm, const std::vector<DecodedInstruction>& instructions)
+{
+    return nullptr; //Host not supported
+}
+#endif
+
+JitExit JitProgram::Run(VM& vm, u32 cycleBudget)
+{
+    using EntryFunction = u64(*)(VM* vm, u32 cycleBudget, const u8* block);
+    const u8* block = _blocks[(vm.PC - VM::RESERVED_BYTES) / sizeof(Instruction)];
+    const u64 result = ((EntryFunction)_code)(&vm, cycleBudget, block);
+
+    JitExit exit;
+    exit.Reason = (JitExitReason)(result >> 48);
+    exit.PC = (u16)(result >> 32);
+    exit.CycleBudget = (u32)result;
+    return exit;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "Typedefs.h"
+#include "Instruction.h"
+#include <memory>
+#include <vector>
+
+//The JIT generates x86-64 machine code so it's only built for x86-64 hosts. Enabled with the VM_JIT cmake option.
+#if defined(VM_JIT_ENABLED) && (defined(_M_X64) || defined(__x86_64__))
+#define VM_JIT
+#endif
+
+class VM;
+
+//Reason the generated code returned to the VM
+enum class JitExitReason : u8
+{
+    Stop,      //Not enough cycles left to run the instruction at PC
+    Deopt,     //The interpreter must run the instruction at PC. Its cycles were already taken from the budget. Used for errors and rare cases like stores to the instruction block.
+    Unaligned, //PC isn't on an instruction boundary. The interpreter must take over.
+    Port,      //Stopped before a port instruction so hardware can be updated first. Its cycles were given back to the budget.
+    Interrupt, //A port handler raised an interrupt. PC is the next instruction. The VM dispatches the interrupt before it runs.
+};
+
+//Returned by the port functions generated code calls. See VM::JitPortRead().
+enum class JitPortResult : u8
+{
+    Stopped,   //The port wasn't accessed. The generated code exits with JitExitReason::Port.
+    Done,      //The port was accessed
+    Interrupt, //The port was accessed and its handler raised an interrupt
+};
+
+struct JitExit
+{
+    JitExitReason Reason;
+    u16 PC;
+    u32 CycleBudget; //Cycles left in the budget
+};
+
+//x86-64 machine code generated from the program loaded into a VM.
+//VM registers, flags, and memory stay in the VM so the interpreter can take over at any instruction boundary.
+class JitProgram
+{
+public:
+    ~JitProgram();
+
+    //Generate native code for the program loaded into vm. instructions must not have superinstructions. Returns nullptr if the host or program isn't supported.
+    static std::unique_ptr<JitProgram> Compile(VM& vm, const std::vector<DecodedInstruction>& instructions);
+    //Run native code starting at vm.PC until the cycle budget runs out or the interpreter needs to take over.
+    //vm.PC must be an instruction boundary inside the instruction block.
+    JitExit Run(VM& vm, u32 cycleBudget);
+
+private:
+    JitProgram() = default;
+
+    u8* _code = nullptr; //Executable memory holding the generated code
+    size_t _codeSize = 0;
+    std::vector<const u8*> _blocks = {}; //Native code address of each instruction. Used for the entry point and by ret.
+    std::vector<DecodedInstruction> _instructions = {}; //Instructions the code was generated from. Generated code passes pointers to them to port handlers.
+};
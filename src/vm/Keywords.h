@@ -0,0 +1,224 @@
+#pragma once
+#include "Typedefs.h"
+#include "Tokenizer.h"
+#include "Constants.h"
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+
+//Reserved word of the assembly language
+struct Keyword
+{
+    std::string_view Name; //Lowercase for everything except built in constants
+    Token Type; //Token::VarName for built in constants
+    VmValue Value = 0; //Register index for registers. Value of built in constants. Unused by other keywords.
+
+    //Built in constants are case sensitive. The other keywords aren't.
+    constexpr bool IsConstant() const { return Type == Token::VarName; }
+};
+
+//Every keyword. Mnemonics, directives, registers, and built in constants. Looked up with FindKeyword().
+inline constexpr Keyword Keywords[] =
+{
+    //Mnemonics
+    { "mov", Token::Mov },
+    { "add", Token::Add },
+    { "sub", Token::Sub },
+    { "mul", Token::Mul },
+    { "div", Token::Div },
+    { "cmp", Token::Cmp },
+    { "jmp", Token::Jmp },
+    { "jeq", Token::Jeq },
+    { "jne", Token::Jne },
+    { "jgr", Token::Jgr },
+    { "jls", Token::Jls },
+    { "call", Token::Call },
+    { "ret", Token::Ret },
+    { "and", Token::And },
+    { "or", Token::Or },
+    { "xor", Token::Xor },
+    { "neg", Token::Neg },
+    { "mod", Token::Mod },
+    { "load", Token::Load },
+    { "store", Token::Store },
+    { "push", Token::Push },
+    { "pop", Token::Pop },
+    { "ipo", Token::Ipo },
+    { "opo", Token::Opo },
+    { "nop", Token::Nop },
+    { "wait", Token::Wait },
+    { "hlt", Token::Hlt },
+    { "iret", Token::Iret },
+
+    //Directives
+    { "var", Token::Var },
+    { "const", Token::Constant },
+    { "#config", Token::Config },
+    { "#optimize", Token::Optimize }, //Enables the peephole optimizer for the program. See Compiler::Optimize().
+
+    //Registers
+    { "r0", Token::Register, 0 },
+    { "r1", Token::Register, 1 },
+    { "r2", Token::Register, 2 },
+    { "r3", Token::Register, 3 },
+    { "r4", Token::Register, 4 },
+    { "r5", Token::Register, 5 },
+    { "r6", Token::Register, 6 },
+    { "r7", Token::Register, 7 },
+
+    //Port addresses
+    { "P_SPEDOMETER", Token::VarName, (VmValue)Port::Spedometer },
+    { "P_STEERING", Token::VarName, (VmValue)Port::Steering },
+    { "P_SHOOT", Token::VarName, (VmValue)Port::TurretShoot },
+    { "P_TURRET_OFS", Token::VarName, (VmValue)Port::TurretRotateOffset },
+    { "P_TURRET_ABS", Token::VarName, (VmValue)Port::TurretRotateAbsolute },
+    { "P_MINELAYER", Token::VarName, (VmValue)Port::MineLayer },
+    { "P_MINETRIGGER", Token::VarName, (VmValue)Port::MineTrigger },
+    { "P_SONAR", Token::VarName, (VmValue)Port::Sonar },
+    { "P_RADAR", Token::VarName, (VmValue)Port::Radar },
+    { "P_SCANNER", Token::VarName, (VmValue)Port::Scanner },
+    { "P_SCAN_ARC", Token::VarName, (VmValue)Port::ScannerArc },
+    { "P_THROTTLE", Token::VarName, (VmValue)Port::Throttle },
+    { "P_HEAT", Token::VarName, (VmValue)Port::Heat },
+    { "P_COMPASS", Token::VarName, (VmValue)Port::Compass },
+    //The old version is P_DAMAGE. Included for compatibility reasons.
+    { "P_ARMOR", Token::VarName, (VmValue)Port::Armor }, { "P_DAMAGE", Token::VarName, (VmValue)Port::Armor },
+    { "P_RANDOM", Token::VarName, (VmValue)Port::Random },
+    { "P_SHIELD", Token::VarName, (VmValue)Port::Shield },
+    { "P_ACCURACY", Token::VarName, (VmValue)Port::Accuracy },
+
+    //Interrupts. Addresses of the interrupt vector table entries. E.g. `mov r0 !onDamage` then `store I_DAMAGE r0` enables the damage interrupt.
+    { "I_SCANNER", Token::VarName, INTERRUPT_VECTOR_TABLE + (VmValue)Interrupt::ScannerTarget * sizeof(VmValue) },
+    { "I_DAMAGE", Token::VarName, INTERRUPT_VECTOR_TABLE + (VmValue)Interrupt::Damage * sizeof(VmValue) },
+    { "I_HEAT", Token::VarName, INTERRUPT_VECTOR_TABLE + (VmValue)Interrupt::Heat * sizeof(VmValue) },
+    { "I_MINES_EMPTY", Token::VarName, INTERRUPT_VECTOR_TABLE + (VmValue)Interrupt::MinesEmpty * sizeof(VmValue) },
+
+    //Misc
+    //Limits of the values immediates can hold. Not VmValue limits since those don't fit in an instruction with 32 bit words.
+    { "INT_MAX", Token::VarName, std::numeric_limits<i16>::max() },
+    { "INT_MIN", Token::VarName, std::numeric_limits<i16>::min() },
+};
+
+//Perfect hash table of Keywords. Built at compile time so it costs nothing at startup.
+//Uses hash and displace. Keywords are split into buckets by their hash. Each bucket has a seed that's mixed into the hash so its keywords land in slots no other keyword uses.
+struct KeywordTable
+{
+    static constexpr u32 NUM_KEYWORDS = sizeof(Keywords) / sizeof(Keyword);
+    static constexpr u32 NUM_BUCKETS = 32; //Must be a power of 2
+    static constexpr u32 NUM_SLOTS = 128; //Must be a power of 2
+    static constexpr u32 SLOT_BITS = 7; //log2(NUM_SLOTS)
+    static constexpr u8 EMPTY_SLOT = 0xFF;
+    static_assert(NUM_KEYWORDS < EMPTY_SLOT, "Too many keywords for u8 slots");
+    static_assert(NUM_KEYWORDS <= NUM_SLOTS * 3 / 4, "Keyword table is too full. Increase NUM_SLOTS.");
+    static_assert((1 << SLOT_BITS) == NUM_SLOTS, "SLOT_BITS must be log2(NUM_SLOTS)");
+
+    u8 Seeds[NUM_BUCKETS] = {}; //Seed of each bucket
+    u8 Slots[NUM_SLOTS] = {}; //Index in Keywords or EMPTY_SLOT
+
+    //Case insensitive FNV-1a hash. Uppercase letters are hashed as lowercase so the case insensitive keywords can share the table.
+    static constexpr u32 Hash(std::string_view str)
+    {
+        u32 hash = 2166136261u;
+        for (char c : str)
+        {
+            hash ^= (u8)((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+    static constexpr u32 Bucket(u32 hash) { return hash & (NUM_BUCKETS - 1); }
+    static constexpr u32 Slot(u32 hash, u32 seed) { return ((hash ^ (seed * 0x9E3779B9u)) * 0x85EBCA6Bu) >> (32 - SLOT_BITS); }
+};
+
+//Place each keyword in a slot. Fails to compile if a bucket has no seed that fits it.
+constexpr KeywordTable BuildKeywordTable()
+{
+    KeywordTable table = {};
+    for (u8& slot : table.Slots)
+        slot = KeywordTable::EMPTY_SLOT;
+
+    u32 hashes[KeywordTable::NUM_KEYWORDS] = {};
+    u32 bucketSizes[KeywordTable::NUM_BUCKETS] = {};
+    u32 largestBucket = 0;
+    for (u32 i = 0; i < KeywordTable::NUM_KEYWORDS; i++)
+    {
+        hashes[i] = KeywordTable::Hash(Keywords[i].Name);
+        const u32 size = ++bucketSizes[KeywordTable::Bucket(hashes[i])];
+        largestBucket = size > largestBucket ? size : largestBucket;
+    }
+
+    //Place the largest buckets first while most slots are free
+    for (u32 size = largestBucket; size > 0; size--)
+    {
+        for (u32 bucket = 0; bucket < KeywordTable::NUM_BUCKETS; bucket++)
+        {
+            if (bucketSizes[bucket] != size)
+                continue;
+
+            for (u32 seed = 0; ; seed++)
+            {
+                if (seed > 0xFF)
+                    throw std::logic_error("No seed fits a keyword table bucket. Increase KeywordTable::NUM_SLOTS.");
+
+                //Try to place every keyword in the bucket. Undo it if one of them collides.
+                bool collision = false;
+                for (u32 i = 0; i < KeywordTable::NUM_KEYWORDS && !collision; i++)
+                {
+                    if (KeywordTable::Bucket(hashes[i]) != bucket)
+                        continue;
+
+                    u8& slot = table.Slots[KeywordTable::Slot(hashes[i], seed)];
+                    if (slot == KeywordTable::EMPTY_SLOT)
+                        slot = (u8)i;
+                    else
+                        collision = true;
+                }
+                if (!collision)
+                {
+                    table.Seeds[bucket] = (u8)seed;
+                    break;
+                }
+
+                for (u8& slot : table.Slots)
+                    if (slot != KeywordTable::EMPTY_SLOT && KeywordTable::Bucket(hashes[slot]) == bucket)
+                        slot = KeywordTable::EMPTY_SLOT;
+            }
+        }
+    }
+
+    return table;
+}
+
+inline constexpr KeywordTable KeywordHashTable = BuildKeywordTable();
+
+//Get the keyword matching str. Returns nullptr if it's not a keyword. Built in constants are case sensitive. The other keywords aren't.
+constexpr const Keyword* FindKeyword(std::string_view str)
+{
+    const u32 hash = KeywordTable::Hash(str);
+    const u8 index = KeywordHashTable.Slots[KeywordTable::Slot(hash, KeywordHashTable.Seeds[KeywordTable::Bucket(hash)])];
+    if (index == KeywordTable::EMPTY_SLOT)
+        return nullptr;
+
+    //The slot might belong to a different keyword
+    const Keyword& keyword = Keywords[index];
+    if (str.size() != keyword.Name.size())
+        return nullptr;
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        const char c = keyword.IsConstant() ? str[i] : ((str[i] >= 'A' && str[i] <= 'Z') ? str[i] + ('a' - 'A') : str[i]);
+        if (c != keyword.Name[i])
+            return nullptr;
+    }
+    return &keyword;
+}
+
+//Make sure every keyword can be found. Checked at compile time.
+constexpr bool KeywordTableValid()
+{
+    for (const Keyword& keyword : Keywords)
+        if (FindKeyword(keyword.Name) != &keyword)
+            return false;
+
+    return true;
+}
+static_assert(KeywordTableValid(), "Keyword table is missing keywords. Check Keywords for duplicates.");
@@ -0,0 +1,23 @@
+#pragma once
+#include "Typedefs.h"
+#include "Instruction.h"
+#include "VmProgram.h"
+#include <memory>
+#include <vector>
+
+class JitProgram;
+
+//Read-only copy of a loaded program. Created by VM::LoadProgram() and shared by every VM that loads it with VM::LoadProgram(std::shared_ptr<const ProgramImage>).
+//VMs share the decoded instructions and native code until the program modifies its own instructions. Then the VM makes its own copy.
+struct ProgramImage
+{
+    u32 InstructionsSize = 0; //Size of the instruction block in bytes
+    u32 VariablesSize = 0; //Size of the variable block in bytes
+    std::vector<u8> Memory = {}; //Initial VM memory up to the end of the variables. Reserved bytes, then instructions, then variables.
+    std::vector<VmConfig> Config = {};
+    std::shared_ptr<std::vector<DecodedInstruction>> DecodedInstructions = nullptr; //Decoded instructions with superinstructions fused
+
+    //Native code. Memory size is baked into it, so it's only shared with VMs that have JitMemorySize bytes of memory. Null if the JIT wasn't used.
+    std::shared_ptr<JitProgram> Jit = nullptr;
+    u32 JitMemorySize = 0;
+};
@@ -1,130 +1,139 @@
 #include "Tokenizer.h"
-#include "utility/String.h"
-#include <iostream>
+#include "Keywords.h"
+#include <charconv>
 
 //Returns true if c is [a-z] || [A-Z]
-bool IsLetter(char c)
+static bool IsLetter(char c)
 {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
 }
 
 //Returns true if c is [0-9]
-bool IsNumber(char c)
+static bool IsNumber(char c)
 {
     return c >= '0' && c <= '9';
 }
 
-//Detect token with boolean func
-TokenizerRule Rule(Token token, TokenizerMatchFunction func)
+//Convert uppercase letters to lowercase. Other characters are returned unchanged.
+static char ToLower(char c)
 {
-    return { func, token };
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
 }
 
-//Detect token with string matching
-TokenizerRule Match(Token token, std::string_view match)
+//Returns true if str is a value. Decimal or hex (0x prefix). Must fit in an i32.
+static bool IsValue(std::string_view str)
 {
-    return { [=](std::string_view str) -> bool { return match == str; }, token };
+    //Hex values only have their 0 checked. Same as String::IsNumber() since from_chars() stops at the x.
+    if (str.size() >= 2 && str[0] == '0' && ToLower(str[1]) == 'x')
+        return true;
+
+    i32 value = 0;
+    auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+    return result.ec == std::errc();
 }
 
-//Tokenizer rules
-const std::vector<TokenizerRule> Tokenizer::Rules =
+//Returns true if str is a valid variable name. Can only contain letters, numbers, and _. Can't start with a number.
+static bool IsVarName(std::string_view str)
 {
-    Match(Token::Mov, "mov"),
-    Match(Token::Add, "add"),
-    Match(Token::Sub, "sub"),
-    Match(Token::Mul, "mul"),
-    Match(Token::Div, "div"),
-    Match(Token::Cmp, "cmp"),
-    Match(Token::Jmp, "jmp"),
-    Match(Token::Jeq, "jeq"),
-    Match(Token::Jne, "jne"),
-    Match(Token::Jgr, "jgr"),
-    Match(Token::Jls, "jls"),
-    Match(Token::Call, "call"),
-    Match(Token::Ret, "ret"),
-    Match(Token::And, "and"),
-    Match(Token::Or, "or"),
-    Match(Token::Xor, "xor"),
-    Match(Token::Neg, "neg"),
-    Match(Token::Mod, "mod"),
-    Match(Token::Load, "load"),
-    Match(Token::Store, "store"),
-    Match(Token::Push, "push"),
-    Match(Token::Pop, "pop"),
-    Match(Token::Ipo, "ipo"),
-    Match(Token::Opo, "opo"),
-    Match(Token::Nop, "nop"),
-    Match(Token::Config, "#config"),
-    Match(Token::Register, "r0"),
-    Match(Token::Register, "r1"),
-    Match(Token::Register, "r2"),
-    Match(Token::Register, "r3"),
-    Match(Token::Register, "r4"),
-    Match(Token::Register, "r5"),
-    Match(Token::Register, "r6"),
-    Match(Token::Register, "r7"),
-    Rule(Token::Value, [](std::string_view str) -> bool { return String::IsNumber(str); }),
-    Match(Token::Var, "var"),
-    Match(Token::Constant, "const"),
-    Rule(Token::Label, [](std::string_view str) -> bool
-    {
-        return str.front() == '!';
-    }),
-    Rule(Token::VarName, [](std::string_view str) -> bool //Run last since many other tokens fit variable naming requirements
-    {
-        //Variable names must start with a letter or _
-        if (IsNumber(str.front()))
+    if (IsNumber(str.front()))
+        return false;
+
+    for (char c : str)
+        if (!IsLetter(c) && !IsNumber(c) && c != '_')
             return false;
-        //Variable names can only contain letters, numbers, and _
-        for (const char& c : str)
-            if (!IsLetter(c) && !IsNumber(c) && c != '_')
-                return false;
 
-        return true;
-    }),
-};
+    return true;
+}
+
+//Identify a token. Returns Token::None if it's invalid.
+static Token Classify(std::string_view str)
+{
+    //Labels and values are checked first since no keyword starts with !, -, or a number
+    if (str.front() == '!')
+        return Token::Label;
+    if (IsValue(str))
+        return Token::Value;
+
+    //Mnemonics, directives, and registers. Built in constants are variable names to the tokenizer.
+    if (const Keyword* keyword = FindKeyword(str); keyword && !keyword->IsConstant())
+        return keyword->Type;
+    if (IsVarName(str)) //Checked last since many other tokens fit variable naming requirements
+        return Token::VarName;
+
+    return Token::None;
+}
+
+//Lines end with \n, \r\n, or \r. Empty lines are skipped.
+static bool IsLineEnd(char c)
+{
+    return c == '\n' || c == '\r';
+}
 
 Result<std::vector<TokenData>, TokenizerError> Tokenizer::Tokenize(std::string_view str)
 {
-    //Split string into lines
-    std::vector<std::string_view> lines = {};
-    if (String::Contains(str, "\r\n"))
-        lines = String::Split(str, "\r\n");
-    else
-        lines = String::Split(str, "\n");
-    
-    //Tokenize each line
+    Tokenizer tokenizer(str);
     std::vector<TokenData> tokens = {};
-    for (std::string_view line : lines)
+    tokens.reserve(str.size() / 4);
+    while (true)
+    {
+        Result<bool, TokenizerError> result = tokenizer.NextLine(tokens);
+        if (result.Error())
+            return Error(result.Error().value());
+        if (!result.Success().value())
+            break; //End of string
+    }
+
+    return Success(std::move(tokens));
+}
+
+Result<bool, TokenizerError> Tokenizer::NextLine(std::vector<TokenData>& tokens)
+{
+    //Skip empty lines
+    const std::string_view str = _str;
+    size_t i = _pos;
+    while (i < str.size() && IsLineEnd(str[i]))
+        i++;
+    if (i >= str.size())
+    {
+        _pos = i;
+        return Success(false);
+    }
+
+    //Tokenize the line. Tokens are views of the string so nothing is copied. They're separated by spaces.
+    while (i < str.size() && !IsLineEnd(str[i]))
     {
         //Ignore anything following semicolons (comments)
-        auto semicolonIndex = line.find_first_of(';');
-        if (semicolonIndex != std::string_view::npos)
-            line = line.substr(0, semicolonIndex);
+        if (str[i] == ';')
+        {
+            while (i < str.size() && !IsLineEnd(str[i]))
+                i++;
+            break;
+        }
+        if (str[i] == ' ')
+        {
+            i++;
+            continue;
+        }
 
-        //Split string by space characters check for tokens
-        std::vector<std::string_view> substrings = String::Split(line, " ");
-        for (std::string_view str : substrings)
+        const size_t start = i;
+        while (i < str.size() && str[i] != ' ' && str[i] != ';' && !IsLineEnd(str[i]))
+            i++;
+
+        const std::string_view token = str.substr(start, i - start);
+        const Token type = Classify(token);
+        if (type == Token::None)
         {
-            //Run each tokenizer rule on the lowercase string
-            const std::string strLowercase = String::ToLower(str);
-            bool match = false;
-            for (const TokenizerRule& rule : Rules)
-            {
-                if (rule.Function(strLowercase))
-                {
-                    tokens.push_back({ str, rule.Type });
-                    match = true;
-                    break;
-                }
-            }
-
-            //String doesn't match any rules
-            if (!match)
-                return Error(TokenizerError{ TokenizerErrorCode::UnsupportedToken, "Unsupported token \"" + std::string(strLowercase) + "\" detected in Tokenizer::Tokenize()." });
+            std::string tokenLowercase(token);
+            for (char& c : tokenLowercase)
+                c = ToLower(c);
+
+            return Error(TokenizerError{ TokenizerErrorCode::UnsupportedToken, "Unsupported token \"" + tokenLowercase + "\" detected in Tokenizer::Tokenize()." });
         }
-        tokens.push_back({ "\n", Token::Newline });
+
+        tokens.push_back({ token, type });
     }
+    tokens.push_back({ "\n", Token::Newline });
 
-    return Success(tokens);
-}
\ No newline at end of file
+    _pos = i;
+    return Success(true);
+}
@@ -4,12 +4,10 @@
 #include <string_view>
 #include "utility/Result.h"
 #include <magic_enum.hpp>
-#include <functional>
 #include <vector>
 
 enum class Token : u8;
 struct TokenData;
-struct TokenizerRule;
 struct TokenizerError;
 enum class TokenizerErrorCode;
 
@@ -18,11 +16,20 @@ class Tokenizer
 {
 public:
     //Returns a list of tokens and their substrings. The string must stay alive while the substrings are in use.
+    //Single pass over the string. Tokens are classified in place without copying or lowercasing them.
     static Result<std::vector<TokenData>, TokenizerError> Tokenize(std::string_view str);
-    static const std::vector<TokenizerRule> Rules;
+
+    //Incremental tokenizer. Tokenizes str one line at a time so the caller only needs to hold one line of tokens.
+    Tokenizer(std::string_view str) : _str(str) {}
+    //Append the tokens of the next non empty line to tokens, followed by Token::Newline. Returns false once the end of the string is reached.
+    Result<bool, TokenizerError> NextLine(std::vector<TokenData>& tokens);
+
+private:
+    std::string_view _str;
+    size_t _pos = 0; //Start of the next line
 };
 
-//Valid tokens. See Tokenizer.cpp for the rules that detect them.
+//Valid tokens. See Classify() in Tokenizer.cpp for how they're detected.
 enum class Token : u8
 {
     //Tokens are set to the value of different opcodes so the compiler doesn't need to convert them
@@ -51,7 +58,11 @@ enum class Token : u8
     Opo = (u32)Opcode::Opo,
     Nop = (u32)Opcode::Nop,
     Mod = (u32)Opcode::Mod,
+    Wait = (u32)Opcode::Wait,
+    Hlt = (u32)Opcode::Hlt,
+    Iret = (u32)Opcode::Iret,
     Config,
+    Optimize,
     Register,
     Var,
     VarName,
@@ -69,14 +80,6 @@ struct TokenData
     Token Type;
 };
 
-//Used to identify tokens. Returns true if the match function detects its token
-using TokenizerMatchFunction = std::function<bool(std::string_view)>;
-struct TokenizerRule
-{
-    TokenizerMatchFunction Function;
-    Token Type;
-};
-
 enum class TokenizerErrorCode
 {
     UnsupportedToken,
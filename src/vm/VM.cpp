@@ -1,45 +1,127 @@
 #include "VM.h"
 #include "Compiler.h"
 #include <stdexcept>
+#include <algorithm>
 
 /*Common error checks used while executing instructions*/
+//Stop execution with an error. The instruction that caused it is discarded. The message isn't formatted until VMStatus::Message() is called.
+#define VM_ERROR(code, operand) {_instruction = nullptr; _instructionCyclesRemaining = 0; return VMStatus::Failure(code, (u16)lastPC, (i32)(operand));}
+
 //Prevent divide by zero
-#define DIVIDE_BY_ZERO_CHECK() if (value == Registers[regB])\
-{return Error(VMError{ VMErrorCode::DivideByZero, "Divide by zero attempt by instruction at address " + std::to_string(lastPC) });}
+#define DIVIDE_BY_ZERO_CHECK(divisor) if ((divisor) == 0)\
+VM_ERROR(VMErrorCode::DivideByZero, 0)
 
 //Prevent accessing data outside of VM memory
-#define OUT_OF_BOUNDS_MEMORY_CHECK() if (address >= VM::MEMORY_SIZE)\
-{return Error(VMError{ VMErrorCode::OutOfBoundsMemoryAccess, "Out of bounds memory access by instruction at address " + std::to_string(lastPC) + ". Instruction.Address = " + std::to_string(address) });}
+#define OUT_OF_BOUNDS_MEMORY_CHECK(address) if ((VmAddress)(address) > MemorySize() - sizeof(VmValue))\
+VM_ERROR(VMErrorCode::OutOfBoundsMemoryAccess, (VmAddress)(address))
 
 //Prevent stack from growing into variable/program memory
 #define STACK_OVERFLOW_CHECK() if (SP <= VM::RESERVED_BYTES + InstructionsSize() + VariablesSize())\
-{return Error(VMError{ VMErrorCode::StackOverflow, "Stack underflow by instruction at address " + std::to_string(lastPC) + ". SP = " + std::to_string(SP) });}
+VM_ERROR(VMErrorCode::StackOverflow, SP)
 
 //Prevent stack from shrinking past the end of VM memory
-#define STACK_UNDERFLOW_CHECK() if (SP >= VM::MEMORY_SIZE)\
-{return Error(VMError{ VMErrorCode::StackUnderflow, "Stack underflow by instruction at address " + std::to_string(lastPC) }); }
+#define STACK_UNDERFLOW_CHECK() if (SP >= MemorySize())\
+VM_ERROR(VMErrorCode::StackUnderflow, SP)
+
+//Instructions that access a port. Includes superinstructions that start with one.
+static bool IsPortOpcode(Opcode opcode)
+{
+    return opcode == Opcode::Ipo || opcode == Opcode::Opo || opcode == Opcode::OpoVal || opcode == Opcode::IpoCmp || opcode == Opcode::IpoCmpVal;
+}
+
+const PortHandlers VM::DefaultPortHandlers = []()
+{
+    PortHandlers handlers = {};
+    for (size_t i = 0; i < (size_t)Port::NumPorts; i++)
+    {
+        handlers.Read[i] = [](void*, f32) {};
+        handlers.Write[i] = [](void*, VmValue, f32) {};
+    }
+    return handlers;
+}();
+
+VM::VM()
+{
+    //Only has the reserved bytes until a program is loaded
+    _memorySizeBytes = VM::RESERVED_BYTES;
+    _memory = std::make_unique<u8[]>(_memorySizeBytes);
+    Memory = _memory.get();
+    SP = _memorySizeBytes;
+}
 
 Result<void, VMError> VM::LoadProgram(const VmProgram& program)
 {
-    //Zero out memory
-    memset(Memory, 0, VM::MEMORY_SIZE);
+    //Build an image of the program that other VMs can load without their own copy of the decoded instructions and native code
+    const u32 programEnd = VM::RESERVED_BYTES + program.Header.InstructionsSize + program.Header.VariablesSize;
+    if (programEnd > std::min(VM::MEMORY_SIZE, VM::MAX_PROGRAM_END))
+        return Error(VMError{ VMErrorCode::ProgramFileLoadFailure, "Program is too large to fit in VM memory. Size: " + std::to_string(programEnd - VM::RESERVED_BYTES) + " bytes" });
+
+    std::shared_ptr<ProgramImage> image = std::make_shared<ProgramImage>();
+    image->InstructionsSize = program.Header.InstructionsSize;
+    image->VariablesSize = program.Header.VariablesSize;
+    image->Config = program.Config;
+    image->Memory.resize(programEnd);
+    memcpy(image->Memory.data() + VM::RESERVED_BYTES, program.Instructions.data(), program.Header.InstructionsSize);
+    memcpy(image->Memory.data() + VM::RESERVED_BYTES + program.Header.InstructionsSize, program.Variables.data(), program.Header.VariablesSize);
 
-    //Copy instructions into memory
-    _instructionsSizeBytes = program.Header.InstructionsSize;
-    memcpy(Memory + VM::RESERVED_BYTES, program.Instructions.data(), program.Header.InstructionsSize);
+    //Decode instructions ahead of time so the VM doesn't need to each cycle
+    image->DecodedInstructions = std::make_shared<std::vector<DecodedInstruction>>();
+    image->DecodedInstructions->reserve(program.Instructions.size());
+    for (const Instruction& instruction : program.Instructions)
+        image->DecodedInstructions->push_back(Decode(instruction));
+    if (!program.Instructions.empty())
+        FuseInstructions(*image->DecodedInstructions, program.Instructions.data(), 0, (u32)program.Instructions.size() - 1);
 
-    //Copy variables into memory
-    _variablesSizeBytes = program.Header.VariablesSize;
-    memcpy(Memory + VM::RESERVED_BYTES + _instructionsSizeBytes, program.Variables.data(), program.Header.VariablesSize);
+    Result<void, VMError> result = LoadProgram(std::shared_ptr<const ProgramImage>(image));
+    if (result.Error())
+        return result;
+
+    //Share the native code generated for this VM with VMs that load the image later
+    image->Jit = _jit;
+    image->JitMemorySize = MemorySize();
+    return Success<void>();
+}
+
+Result<void, VMError> VM::LoadProgram(std::shared_ptr<const ProgramImage> program)
+{
+    //Allocate memory. Either the full address space or just enough for the program and stack.
+    const u32 programEnd = (u32)program->Memory.size();
+    //The stack reservation is rounded up to a whole number of words past the program so SP starts word aligned
+    const u32 wordMask = sizeof(VmValue) - 1;
+    const u32 stackReservation = (StackReservation + wordMask) & ~wordMask;
+    const u32 memorySize = StackReservation ? std::min<u32>(((programEnd + wordMask) & ~wordMask) + stackReservation, VM::MEMORY_SIZE) : VM::MEMORY_SIZE;
+    if (memorySize != _memorySizeBytes)
+    {
+        _memorySizeBytes = memorySize;
+        _memory = std::make_unique<u8[]>(_memorySizeBytes);
+        Memory = _memory.get();
+    }
+
+    //Copy the instructions and variables into memory. Instructions are still copied so programs can read them like any other memory.
+    memcpy(Memory, program->Memory.data(), programEnd);
+    memset(Memory + programEnd, 0, MemorySize() - programEnd);
+    _instructionsSizeBytes = program->InstructionsSize;
+    _variablesSizeBytes = program->VariablesSize;
 
     //Copy misc data from program
-    Config = program.Config;
+    Config = program->Config;
+
+    _program = std::move(program);
+    UseProgramInstructions();
+    _instruction = nullptr;
+    _instructionCyclesRemaining = 0;
+    _waitCyclesRemaining = 0;
+    _pendingInterrupts = 0;
+    _inInterrupt = false;
+    _breakpointResume = 0;
+    ResetProfile();
+    ResetTrace();
 
     //Reset flags and registers
     FlagSign = false;
     FlagZero = false;
     PC = 0;
-    SP = VM::MEMORY_SIZE;
+    SP = MemorySize();
     for (u32 i = 0; i < VM::NUM_REGISTERS; i++)
         Registers[i] = 0;
 
@@ -69,242 +151,926 @@ Result<void, VMError> VM::LoadProgramFromSource(std::string_view inFilePath)
     return LoadProgram(compileResult.Success().value());
 }
 
-Result<void, VMError> VM::Cycle(f32 deltaTime)
+//Append runs of memory in [begin, end) that differ from image to delta. A null image is treated as all zeros.
+//Compared a word at a time so runs may include a few unchanged bytes.
+static void AppendMemoryDelta(std::vector<u8>& delta, const u8* memory, const u8* image, u32 begin, u32 end)
 {
-    if (_instruction) //Continue executing instruction
+    const u32 wordSize = sizeof(u64);
+    const u32 blockSize = 64; //Unchanged blocks are skipped this many bytes at a time
+    static const u8 zeros[blockSize] = { 0 };
+    auto differs = [&](u32 address, u32 size) { return memcmp(memory + address, image ? image + address : zeros, size) != 0; };
+
+    u32 address = begin;
+    while (address < end)
     {
-        if (_instructionCyclesRemaining <= 1) //All cycles elapsed, execute instruction
+        if (end - address >= blockSize && !differs(address, blockSize))
         {
-            Result<void, VMError> result = Execute(deltaTime);
-            _instruction = nullptr;
-            _instructionCyclesRemaining = 0;
-            return result;
+            address += blockSize;
+            continue;
         }
-        else //More cycles, decrement and continue
+
+        const u32 size = std::min(wordSize, end - address);
+        if (!differs(address, size))
         {
-            _instructionCyclesRemaining--;
+            address += size;
+            continue;
+        }
+
+        //Extend the run until a word matches the image
+        u32 runEnd = address + size;
+        while (runEnd < end)
+        {
+            const u32 nextSize = std::min(wordSize, end - runEnd);
+            if (!differs(runEnd, nextSize))
+                break;
+
+            runEnd += nextSize;
         }
+
+        const u16 runAddress = (u16)address;
+        const u16 runSize = (u16)(runEnd - address);
+        delta.insert(delta.end(), (u8*)&runAddress, (u8*)&runAddress + sizeof(u16));
+        delta.insert(delta.end(), (u8*)&runSize, (u8*)&runSize + sizeof(u16));
+        delta.insert(delta.end(), memory + address, memory + runEnd);
+        address = runEnd;
     }
-    else //Fetch next instruction
+}
+
+void VM::Snapshot(VmSnapshot& snapshot) const
+{
+    memcpy(snapshot.Registers, Registers, sizeof(Registers));
+    snapshot.PC = PC;
+    snapshot.SP = SP;
+    snapshot.FlagZero = FlagZero;
+    snapshot.FlagSign = FlagSign;
+    snapshot.InstructionPending = _instruction != nullptr;
+    snapshot.InstructionCyclesRemaining = _instructionCyclesRemaining;
+    snapshot.WaitCyclesRemaining = _waitCyclesRemaining;
+    snapshot.PendingInterrupts = _pendingInterrupts;
+    snapshot.InInterrupt = _inInterrupt;
+    snapshot.MemorySize = MemorySize();
+    snapshot.ProgramImageSize = ProgramImageSize();
+
+    //Only store memory that differs from the program image. Memory past the image started as zeros.
+    snapshot.MemoryDelta.clear();
+    if (_program)
+        AppendMemoryDelta(snapshot.MemoryDelta, Memory, _program->Memory.data(), 0, ProgramImageSize());
+    AppendMemoryDelta(snapshot.MemoryDelta, Memory, nullptr, ProgramImageSize(), MemorySize());
+}
+
+Result<void, VMError> VM::Restore(const VmSnapshot& snapshot)
+{
+    if (snapshot.MemorySize != MemorySize() || snapshot.ProgramImageSize != ProgramImageSize())
+        return Error(VMError{ VMErrorCode::InvalidSnapshot, "Snapshot memory layout doesn't match the VM. Was it taken with a different program loaded?" });
+
+    //Validate the runs before touching memory
+    const std::vector<u8>& delta = snapshot.MemoryDelta;
+    for (size_t i = 0; i < delta.size(); )
     {
-        //Reset PC to first instruction if it's out of bounds
-        if (PC < VM::RESERVED_BYTES || PC >= VM::RESERVED_BYTES + InstructionsSize())
-            PC = VM::RESERVED_BYTES;
+        if (i + 2 * sizeof(u16) > delta.size())
+            return Error(VMError{ VMErrorCode::InvalidSnapshot, "Snapshot memory delta is truncated." });
+
+        const u16 address = *(u16*)&delta[i];
+        const u16 size = *(u16*)&delta[i + sizeof(u16)];
+        i += 2 * sizeof(u16) + size;
+        if ((u32)address + size > MemorySize() || i > delta.size())
+            return Error(VMError{ VMErrorCode::InvalidSnapshot, "Snapshot memory delta is out of bounds." });
+    }
 
-        //Fetch next instruction
-        _instruction = (Instruction*)(&Memory[PC]);
+    //The newest trace record gets its values from the state being replaced
+    if (_traceRecordPending)
+        FinishTraceRecord();
 
-        //Get number of cycles the instruction takes to execute
-        _instructionCyclesRemaining = GetInstructionDuration(*_instruction);
-        if (_instructionCyclesRemaining == 0xFFFFFFFF)
-            return Error(VMError{ VMErrorCode::UnsupportedInstruction, "Failed to get instruction duration in VM. Opcode: " + std::to_string((u32)_instruction->Op.Opcode) });
+    //Rebuild memory from the program image and the runs that differ from it
+    if (_program)
+        memcpy(Memory, _program->Memory.data(), ProgramImageSize());
+    memset(Memory + ProgramImageSize(), 0, MemorySize() - ProgramImageSize());
+    for (size_t i = 0; i < delta.size(); )
+    {
+        const u16 address = *(u16*)&delta[i];
+        const u16 size = *(u16*)&delta[i + sizeof(u16)];
+        memcpy(Memory + address, &delta[i + 2 * sizeof(u16)], size);
+        i += 2 * sizeof(u16) + size;
+    }
+
+    //Keep decoded instructions in sync with memory if either state had self modified code
+    if (_program && memcmp(Memory + VM::RESERVED_BYTES, _program->Memory.data() + VM::RESERVED_BYTES, InstructionsSize()) != 0)
+        DecodeProgram();
+    else if (_program && _decodedInstructions != _program->DecodedInstructions)
+        UseProgramInstructions();
+
+    memcpy(Registers, snapshot.Registers, sizeof(Registers));
+    PC = snapshot.PC;
+    SP = snapshot.SP;
+    FlagZero = snapshot.FlagZero;
+    FlagSign = snapshot.FlagSign;
+    //Instructions are always left pending at PC
+    _instruction = snapshot.InstructionPending ? Fetch() : nullptr;
+    _instructionCyclesRemaining = snapshot.InstructionCyclesRemaining;
+    _waitCyclesRemaining = snapshot.WaitCyclesRemaining;
+    _pendingInterrupts = snapshot.PendingInterrupts;
+    _inInterrupt = snapshot.InInterrupt;
+    _breakpointResume = 0;
+    return Success<void>();
+}
+
+VMStatus VM::Cycle(f32 deltaTime)
+{
+    return Run(1, deltaTime, false);
+}
+
+VMStatus VM::Run(u32 cycleBudget, f32 deltaTime, bool stopAtPorts)
+{
+    u32 cyclesRemaining = cycleBudget;
+    const u32 portStopBudget = stopAtPorts ? cycleBudget : 0;
+    VMStatus status;
+    if (_trace)
+        _traceCycleEnd = _trace->Cycles + cycleBudget;
 
-        if (_instructionCyclesRemaining <= 1) //Execute the instruction now if it takes 1 cycle
+    //Dispatch interrupts raised since the last call. An instruction in progress finishes first if there are enough cycles for it.
+    //The engines dispatch interrupts raised while they run themselves.
+    if (InterruptReady())
+    {
+        if (_instruction && _instructionCyclesRemaining <= cyclesRemaining)
         {
-            Result<void, VMError> result = Execute(deltaTime);
-            _instruction = nullptr;
-            _instructionCyclesRemaining = 0;
-            return result;
+            u32 budget = _instructionCyclesRemaining;
+            cyclesRemaining -= budget;
+            if (_trace) //Records are stamped relative to the end of the budget passed to the interpreter
+                _traceCycleEnd = _trace->Cycles + cycleBudget - cyclesRemaining;
+
+            status = InterpretChecked(budget, deltaTime, 0, false);
+            cyclesRemaining += budget; //Only left over if it stopped at a breakpoint
+            if (_trace)
+                _traceCycleEnd = _trace->Cycles + cycleBudget;
+            if (!status.Ok || status.Breakpoint)
+                goto exit;
         }
-        else //Otherwise decrement the cycle counter
+        if (!_instruction && InterruptReady())
         {
-            _instructionCyclesRemaining--;
+            status = DispatchInterrupt();
+            if (!status.Ok)
+                goto exit;
         }
     }
 
-    return Success<void>();
+    //Skip cycles spent suspended by wait or hlt in one step
+    cyclesRemaining -= Sleep(cyclesRemaining);
+    if (Instrumented()) //Only the checked interpreter collects profiles and traces
+        status = InterpretChecked(cyclesRemaining, deltaTime, portStopBudget, ThreadedDispatch);
+    else if (UseJit && _jit)
+        status = RunJit(cyclesRemaining, deltaTime, portStopBudget);
+#ifdef VM_THREADED_DISPATCH
+    else if (ThreadedDispatch)
+        status = _verified ? Interpret<true, false>(cyclesRemaining, deltaTime, portStopBudget) : Interpret<true, true>(cyclesRemaining, deltaTime, portStopBudget);
+#endif
+    else
+        status = _verified ? Interpret<false, false>(cyclesRemaining, deltaTime, portStopBudget) : Interpret<false, true>(cyclesRemaining, deltaTime, portStopBudget);
+
+exit:
+    status.CyclesElapsed = cycleBudget - cyclesRemaining;
+    if (_trace)
+        _trace->Cycles += status.CyclesElapsed;
+
+    return status;
 }
 
-//Decodes and executes _instruction
-//_instruction is fetched by VM::Cycle()
-Result<void, VMError> VM::Execute(f32 deltaTime)
+VMStatus VM::InterpretChecked(u32& cycleBudget, f32 deltaTime, u32 portStopBudget, bool threaded)
 {
-    u32 lastPC = PC; //Store before incrementing for error messages
-    PC += sizeof(Instruction);
+#if defined(VM_PROFILER) || defined(VM_TRACE)
+    if (Instrumented())
+    {
+#ifdef VM_THREADED_DISPATCH
+        if (threaded)
+            return Interpret<true, true, true>(cycleBudget, deltaTime, portStopBudget);
+#endif
+        return Interpret<false, true, true>(cycleBudget, deltaTime, portStopBudget);
+    }
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+    if (threaded)
+        return Interpret<true, true>(cycleBudget, deltaTime, portStopBudget);
+#endif
+    return Interpret<false, true>(cycleBudget, deltaTime, portStopBudget);
+}
 
-    //Decode
-    Opcode opcode = (Opcode)_instruction->Op.Opcode;
-    //Only some of these are valid depending on the opcode. See vm/Instructions.h for info on the data used by each instruction.
-    u16 regA = _instruction->OpRegisterRegister.RegA;
-    u16 regB = _instruction->OpRegisterRegister.RegB;
-    i16 value = _instruction->OpRegisterValue.Value;
-    u16 address = _instruction->OpAddress.Address;
+std::string VMStatus::Message() const
+{
+    if (Ok)
+        return "No error";
 
-    //Execute
-    switch (opcode)
+    switch (Code)
     {
-    case Opcode::Mov:
-        Registers[regA] = Registers[regB];
-        break;
-    case Opcode::MovVal:
-        Registers[regA] = value;
-        break;
-    case Opcode::Add:
-        Registers[regA] += Registers[regB];
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::AddVal:
-        Registers[regA] += value;
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::Sub:
-        Registers[regA] -= Registers[regB];
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::SubVal:
-        Registers[regA] -= value;
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::Mul:
-        Registers[regA] *= Registers[regB];
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::MulVal:
-        Registers[regA] *= value;
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::Div:
-        if (value == Registers[regB])
-            return Error(VMError{ VMErrorCode::DivideByZero, "Divide by zero attempt by instruction at address " + std::to_string(lastPC) });
+    case VMErrorCode::DivideByZero:
+        return "Divide by zero attempt by instruction at address " + std::to_string(PC);
+    case VMErrorCode::OutOfBoundsMemoryAccess:
+        return "Out of bounds memory access by instruction at address " + std::to_string(PC) + ". Instruction.Address = " + std::to_string(Operand);
+    case VMErrorCode::StackOverflow:
+        return "Stack overflow by instruction at address " + std::to_string(PC) + ". SP = " + std::to_string(Operand);
+    case VMErrorCode::StackUnderflow:
+        return "Stack underflow by instruction at address " + std::to_string(PC) + ". SP = " + std::to_string(Operand);
+    case VMErrorCode::UnsupportedInstruction:
+        return "Unsupported opcode '" + std::to_string(Operand) + "' at address " + std::to_string(PC);
+    default:
+        return to_string(Code) + " by instruction at address " + std::to_string(PC);
+    }
+}
 
-        Registers[regA] /= Registers[regB];
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::DivVal:
-        if (value == 0)
-            return Error(VMError{ VMErrorCode::DivideByZero, "Divide by zero attempt by instruction at address " + std::to_string(lastPC) });
+const DecodedInstruction* VM::Fetch()
+{
+    //Reset PC to first instruction if it's out of bounds
+    if (PC < VM::RESERVED_BYTES || PC >= VM::RESERVED_BYTES + InstructionsSize())
+        PC = VM::RESERVED_BYTES;
 
-        Registers[regA] /= value;
-        SetFlags(Registers[regA]);
-        break;
-    case Opcode::Mod:
-        Registers[regA] %= Registers[regB];
-        break;
-    case Opcode::ModVal:
-        Registers[regA] %= value;
-        break;
-    case Opcode::Cmp:
-        SetFlags(Registers[regA] - Registers[regB]); //Update flags with difference
-        break;
-    case Opcode::CmpVal:
-        SetFlags(Registers[regA] - value); //Update flags with difference
-        break;
-    case Opcode::Jmp:
-        if (address >= VM::MEMORY_SIZE)
-            return Error(VMError{ VMErrorCode::OutOfBoundsMemoryAccess, "Out of bounds memory access by instruction at address " + std::to_string(lastPC) + ". Instruction.Address = " + std::to_string(address) });
+    //Use pre-decoded instruction
+    const u32 offset = PC - VM::RESERVED_BYTES;
+    if (offset % sizeof(Instruction) == 0)
+        return &(*_decodedInstructions)[offset / sizeof(Instruction)];
 
-        PC = address; //Set next instruction to be executed
-        break;
-    case Opcode::Jeq:
-        if (FlagZero)
-            PC = address;
-        break;
-    case Opcode::Jne:
-        if (!FlagZero)
-            PC = address;
-        break;
-    case Opcode::Jgr:
-        if (!FlagZero && !FlagSign)
-            PC = address;
-        break;
-    case Opcode::Jls:
-        if (FlagSign)
-            PC = address;
-        break;
-    case Opcode::Call:
-        STACK_OVERFLOW_CHECK();
-        OUT_OF_BOUNDS_MEMORY_CHECK();
-        //Push PC onto the stack and set it to the new address
-        Push(PC);
-        PC = address;
-        break;
-    case Opcode::Ret:
-        STACK_UNDERFLOW_CHECK();
-        OUT_OF_BOUNDS_MEMORY_CHECK();
-        //Pop old PC value off the stack
-        PC = Pop();
-        break;
-    case Opcode::And:
-        Registers[regA] &= Registers[regB];
-        break;
-    case Opcode::AndVal:
-        Registers[regA] &= value;
-        break;
-    case Opcode::Or:
-        Registers[regA] |= Registers[regB];
-        break;
-    case Opcode::OrVal:
-        Registers[regA] |= value;
-        break;
-    case Opcode::Xor:
-        Registers[regA] ^= Registers[regB];
-        break;
-    case Opcode::XorVal:
-        Registers[regA] ^= value;
-        break;
-    case Opcode::Neg:
-        Registers[regA] *= -1;
-        break;
-    case Opcode::Load:
-        OUT_OF_BOUNDS_MEMORY_CHECK();
-        Registers[regA] = Load(address);
-        break;
-    case Opcode::LoadP:
-        OUT_OF_BOUNDS_MEMORY_CHECK();
-        Registers[regA] = Load(Registers[regB]);
-        break;
-    case Opcode::Store:
-        OUT_OF_BOUNDS_MEMORY_CHECK();
-        Store(address, Registers[regA]);
-        break;
-    case Opcode::StoreP:
-        OUT_OF_BOUNDS_MEMORY_CHECK();
-        Store(Registers[regA], Registers[regB]);
-        break;
-    case Opcode::Push:
-        STACK_OVERFLOW_CHECK();
-        //Push the value of regA onto the stack
-        Push(Registers[regA]);
-        break;
-    case Opcode::Pop:
-        STACK_UNDERFLOW_CHECK();
-        //Pop a value off the stack and store it in register A
-        Registers[regA] = Pop();
-        break;
-    case Opcode::Ipo:
-        OnPortRead((Port)value, deltaTime);
-        Registers[regA] = GetPort((Port)value); //Value contains the port index. Set via the built in port constants
-        break;
-    case Opcode::Opo:
-        OnPortWrite((Port)value, Registers[regA], deltaTime); //Write the value of registerA to the port
-        break;
-    case Opcode::OpoVal:
-        OnPortWrite((Port)_instruction->OpPortValue.Port, _instruction->OpPortValue.Value, deltaTime); //Write value to the port. The callback is allowed to discard the value.
-        break;
-    case Opcode::Nop:
-        break;
+    //PC isn't on an instruction boundary. Can happen if a program jumps to a computed address. Decode it from memory instead.
+    _unalignedInstruction = Decode(*(Instruction*)(&Memory[PC]));
+    return &_unalignedInstruction;
+}
+
+const DecodedInstruction* VM::FetchVerified()
+{
+    if (PC < VM::RESERVED_BYTES || PC >= VM::RESERVED_BYTES + InstructionsSize())
+        PC = VM::RESERVED_BYTES;
+
+    const u32 offset = PC - VM::RESERVED_BYTES;
+    if (offset % sizeof(Instruction) == 0)
+        return &(*_decodedInstructions)[offset / sizeof(Instruction)];
+
+    //The verifier only saw aligned instructions. 0 cycles sends the unchecked interpreter to the checked one.
+    _unalignedInstruction = Decode(*(Instruction*)(&Memory[PC]));
+    if (!VerifyInstruction(_unalignedInstruction))
+        _unalignedInstruction.Cycles = 0;
+
+    return &_unalignedInstruction;
+}
+
+/*Interpreter dispatch. Each handler is written once and used by both dispatch engines.*/
+//Count the instruction about to run in the profile and trace. Port instructions are counted by their handler after PORT_STOP_CHECK() instead, since they can be stopped and run again next call.
+//Breakpoints are counted as the instruction they replaced once they decide not to stop.
+#define INSTRUMENT_INSTRUCTION() if constexpr (Instrumented) \
+    if (!IsPortOpcode(instruction->Opcode) && instruction->Opcode != Opcode::Break) \
+        Instrument(*instruction, lastPC, cycleBudget);
+
+//Count a port instruction that's past PORT_STOP_CHECK() in the profile and trace
+#define INSTRUMENT_PORT_ACCESS() if constexpr (Instrumented) \
+    Instrument(*instruction, lastPC, cycleBudget);
+
+#ifdef VM_THREADED_DISPATCH
+//Fetch the next instruction and jump straight to its handler. Copied into the end of every handler so each one has its own indirect jump.
+#define VM_THREADED_NEXT() \
+{ \
+    if (cycleBudget == 0) \
+        goto exitIdle; \
+    instruction = Checked ? Fetch() : FetchVerified(); \
+    if (instruction->Cycles == 0) \
+        goto unsupportedInstruction; \
+    if (instruction->Cycles > cycleBudget) \
+        goto exitPending; \
+    cycleBudget -= instruction->Cycles; \
+    lastPC = PC; \
+    INSTRUMENT_INSTRUCTION(); \
+    PC += sizeof(Instruction); \
+    goto *handlers[(u32)instruction->Opcode]; \
+}
+#define VM_NEXT() if constexpr (Threaded) VM_THREADED_NEXT() else goto next;
+#else
+#define VM_NEXT() goto next;
+#endif
+
+//Stop before a port instruction executes if cycles elapsed before the cycle it executes on. That way the caller can update hardware up to that cycle.
+//The instruction is left pending with 1 cycle remaining so it executes on the first cycle of the next call.
+#define PORT_STOP_CHECK() if (cycleBudget + 1 < portStopBudget) \
+{ \
+    PC = lastPC; \
+    cycleBudget++; \
+    _instruction = instruction; \
+    _instructionCyclesRemaining = 1; \
+    return VMStatus{}; \
+}
+
+//Dispatch interrupts raised by a port handler before the next instruction
+#define INTERRUPT_CHECK() if (InterruptReady()) \
+    goto interrupt;
+
+//Continue in the checked interpreter. Used by the unchecked interpreter when it reaches an instruction the verifier didn't see.
+#define VM_CHECKED_FALLBACK() \
+{ \
+    _instruction = nullptr; \
+    return Interpret<Threaded, true>(cycleBudget, deltaTime, portStopBudget); \
+}
+
+//Run the second instruction of a superinstruction. Goes straight to its handler instead of fetching and dispatching it.
+//Each instruction still executes on its own last cycle, so if the budget runs out between the two the second one is left pending like normal.
+#define VM_FUSED_NEXT(handler) \
+{ \
+    if (cycleBudget == 0) \
+        goto exitIdle; \
+    instruction++; \
+    if (instruction->Cycles > cycleBudget) \
+        goto exitPending; \
+    cycleBudget -= instruction->Cycles; \
+    lastPC = PC; \
+    INSTRUMENT_INSTRUCTION(); \
+    PC += sizeof(Instruction); \
+    goto handler; \
+}
+
+//Runs until cycleBudget cycles have elapsed. Instructions execute on the last cycle of their duration.
+//If an instruction needs more cycles than are left it's stored in _instruction and finished by the next call.
+//Threaded == true uses computed goto dispatch (GCC/Clang only). Otherwise a switch is used.
+//Checked == false leaves out jump target and constant address checks. Those are proven by VerifyInstructions() when the program is loaded.
+//Instrumented == true counts each instruction in _profile and records it in _trace.
+template<bool Threaded, bool Checked, bool Instrumented>
+VMStatus VM::Interpret(u32& cycleBudget, f32 deltaTime, u32 portStopBudget)
+{
+#ifdef VM_THREADED_DISPATCH
+    //Handler for each opcode. Must match the order of the Opcode enum.
+    static void* const handlers[] =
+    {
+        &&op_Mov, &&op_MovVal, &&op_Add, &&op_AddVal, &&op_Sub, &&op_SubVal, &&op_Mul, &&op_MulVal, &&op_Div, &&op_DivVal,
+        &&op_Cmp, &&op_CmpVal, &&op_Jmp, &&op_Jeq, &&op_Jne, &&op_Jgr, &&op_Jls, &&op_Call, &&op_Ret, &&op_And,
+        &&op_AndVal, &&op_Or, &&op_OrVal, &&op_Xor, &&op_XorVal, &&op_Neg, &&op_Load, &&op_LoadP, &&op_Store, &&op_StoreP,
+        &&op_Push, &&op_Pop, &&op_Ipo, &&op_Opo, &&op_OpoVal, &&op_Nop, &&op_Mod, &&op_ModVal, &&op_Wait, &&op_WaitVal,
+        &&op_Hlt, &&op_Iret, &&op_CmpJeq, &&op_CmpJne, &&op_CmpJgr, &&op_CmpJls, &&op_CmpValJeq, &&op_CmpValJne, &&op_CmpValJgr, &&op_CmpValJls,
+        &&op_IpoCmp, &&op_IpoCmpVal, &&op_MovOpo, &&op_MovValOpo, &&op_Break,
+    };
+#endif
+
+    const DecodedInstruction* instruction = _instruction;
+    u32 lastPC = PC; //PC of the instruction being executed. Used by error messages.
+
+    //Finish the instruction in progress. Every engine starts at the fetch below if there isn't one.
+    if (!instruction)
+        goto next;
+
+    if constexpr (!Checked)
+        if (instruction == &_unalignedInstruction) //Not verified. Fetched by another engine.
+            return Interpret<Threaded, true>(cycleBudget, deltaTime, portStopBudget);
+
+    if (_instructionCyclesRemaining > cycleBudget)
+    {
+        _instructionCyclesRemaining -= cycleBudget;
+        cycleBudget = 0;
+        return VMStatus{};
+    }
+
+    cycleBudget -= _instructionCyclesRemaining;
+    goto execute;
+
+next:
+    //Fetch next instruction
+    if (cycleBudget == 0)
+        goto exitIdle;
+
+    instruction = Checked ? Fetch() : FetchVerified();
+    if (instruction->Cycles == 0)
+        goto unsupportedInstruction;
+    if (instruction->Cycles > cycleBudget) //Not enough cycles left to finish it
+        goto exitPending;
+
+    cycleBudget -= instruction->Cycles;
+
+execute:
+    lastPC = PC;
+    INSTRUMENT_INSTRUCTION();
+    PC += sizeof(Instruction);
+
+dispatch:
+#ifdef VM_THREADED_DISPATCH
+    if constexpr (Threaded)
+        goto *handlers[(u32)instruction->Opcode];
+#endif
+
+    switch (instruction->Opcode)
+    {
+    case Opcode::Mov:    goto op_Mov;
+    case Opcode::MovVal: goto op_MovVal;
+    case Opcode::Add:    goto op_Add;
+    case Opcode::AddVal: goto op_AddVal;
+    case Opcode::Sub:    goto op_Sub;
+    case Opcode::SubVal: goto op_SubVal;
+    case Opcode::Mul:    goto op_Mul;
+    case Opcode::MulVal: goto op_MulVal;
+    case Opcode::Div:    goto op_Div;
+    case Opcode::DivVal: goto op_DivVal;
+    case Opcode::Mod:    goto op_Mod;
+    case Opcode::ModVal: goto op_ModVal;
+    case Opcode::Cmp:    goto op_Cmp;
+    case Opcode::CmpVal: goto op_CmpVal;
+    case Opcode::Jmp:    goto op_Jmp;
+    case Opcode::Jeq:    goto op_Jeq;
+    case Opcode::Jne:    goto op_Jne;
+    case Opcode::Jgr:    goto op_Jgr;
+    case Opcode::Jls:    goto op_Jls;
+    case Opcode::Call:   goto op_Call;
+    case Opcode::Ret:    goto op_Ret;
+    case Opcode::And:    goto op_And;
+    case Opcode::AndVal: goto op_AndVal;
+    case Opcode::Or:     goto op_Or;
+    case Opcode::OrVal:  goto op_OrVal;
+    case Opcode::Xor:    goto op_Xor;
+    case Opcode::XorVal: goto op_XorVal;
+    case Opcode::Neg:    goto op_Neg;
+    case Opcode::Load:   goto op_Load;
+    case Opcode::LoadP:  goto op_LoadP;
+    case Opcode::Store:  goto op_Store;
+    case Opcode::StoreP: goto op_StoreP;
+    case Opcode::Push:   goto op_Push;
+    case Opcode::Pop:    goto op_Pop;
+    case Opcode::Ipo:    goto op_Ipo;
+    case Opcode::Opo:    goto op_Opo;
+    case Opcode::OpoVal: goto op_OpoVal;
+    case Opcode::Nop:    goto op_Nop;
+    case Opcode::Wait:   goto op_Wait;
+    case Opcode::WaitVal: goto op_WaitVal;
+    case Opcode::Hlt:    goto op_Hlt;
+    case Opcode::Iret:   goto op_Iret;
+    case Opcode::CmpJeq:    goto op_CmpJeq;
+    case Opcode::CmpJne:    goto op_CmpJne;
+    case Opcode::CmpJgr:    goto op_CmpJgr;
+    case Opcode::CmpJls:    goto op_CmpJls;
+    case Opcode::CmpValJeq: goto op_CmpValJeq;
+    case Opcode::CmpValJne: goto op_CmpValJne;
+    case Opcode::CmpValJgr: goto op_CmpValJgr;
+    case Opcode::CmpValJls: goto op_CmpValJls;
+    case Opcode::IpoCmp:    goto op_IpoCmp;
+    case Opcode::IpoCmpVal: goto op_IpoCmpVal;
+    case Opcode::MovOpo:    goto op_MovOpo;
+    case Opcode::MovValOpo: goto op_MovValOpo;
+    case Opcode::Break:     goto op_Break;
     default:
-        return Error(VMError{ VMErrorCode::UnsupportedInstruction, "Unsupported opcode '" + std::to_string((u32)_instruction->Op.Opcode) + "' decoded by VM." });
+        VM_ERROR(VMErrorCode::UnsupportedInstruction, instruction->Opcode);
     }
 
-    return Success<void>();
+    //Instruction handlers. Only some DecodedInstruction fields are valid depending on the opcode. See vm/Instruction.h for info on the data used by each instruction.
+op_Mov:
+    Registers[instruction->RegA] = Registers[instruction->RegB];
+    VM_NEXT();
+op_MovVal:
+    Registers[instruction->RegA] = instruction->Value;
+    VM_NEXT();
+op_Add:
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] + Registers[instruction->RegB]);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_AddVal:
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] + instruction->Value);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_Sub:
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] - Registers[instruction->RegB]);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_SubVal:
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] - instruction->Value);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_Mul:
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] * Registers[instruction->RegB]);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_MulVal:
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] * instruction->Value);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_Div:
+    DIVIDE_BY_ZERO_CHECK(Registers[instruction->RegB]);
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] / Registers[instruction->RegB]); //Wide so the min value / -1 doesn't fault
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_DivVal:
+    DIVIDE_BY_ZERO_CHECK(instruction->Value);
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] / instruction->Value);
+    SetFlags(Registers[instruction->RegA]);
+    VM_NEXT();
+op_Mod:
+    DIVIDE_BY_ZERO_CHECK(Registers[instruction->RegB]);
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] % Registers[instruction->RegB]);
+    VM_NEXT();
+op_ModVal:
+    DIVIDE_BY_ZERO_CHECK(instruction->Value);
+    Registers[instruction->RegA] = (VmValue)((VmWide)Registers[instruction->RegA] % instruction->Value);
+    VM_NEXT();
+op_Cmp:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - Registers[instruction->RegB])); //Update flags with difference
+    VM_NEXT();
+op_CmpVal:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - instruction->Value)); //Update flags with difference
+    VM_NEXT();
+op_Jmp:
+    if constexpr (Checked)
+        if ((u16)instruction->Value >= MemorySize())
+            VM_ERROR(VMErrorCode::OutOfBoundsMemoryAccess, (u16)instruction->Value);
+
+    PC = (u16)instruction->Value; //Set next instruction to be executed
+    VM_NEXT();
+op_Jeq:
+    if (FlagZero)
+        PC = (u16)instruction->Value;
+    VM_NEXT();
+op_Jne:
+    if (!FlagZero)
+        PC = (u16)instruction->Value;
+    VM_NEXT();
+op_Jgr:
+    if (!FlagZero && !FlagSign)
+        PC = (u16)instruction->Value;
+    VM_NEXT();
+op_Jls:
+    if (FlagSign)
+        PC = (u16)instruction->Value;
+    VM_NEXT();
+op_Call:
+    STACK_OVERFLOW_CHECK();
+    if constexpr (Checked)
+        OUT_OF_BOUNDS_MEMORY_CHECK((u16)instruction->Value); //Jump addresses are unsigned
+    //Push PC onto the stack and set it to the new address
+    PushUnchecked(PC);
+    PC = (u16)instruction->Value;
+    VM_NEXT();
+op_Ret:
+    STACK_UNDERFLOW_CHECK();
+    //Pop old PC value off the stack
+    PC = PopUnchecked();
+    VM_NEXT();
+op_And:
+    Registers[instruction->RegA] &= Registers[instruction->RegB];
+    VM_NEXT();
+op_AndVal:
+    Registers[instruction->RegA] &= instruction->Value;
+    VM_NEXT();
+op_Or:
+    Registers[instruction->RegA] |= Registers[instruction->RegB];
+    VM_NEXT();
+op_OrVal:
+    Registers[instruction->RegA] |= instruction->Value;
+    VM_NEXT();
+op_Xor:
+    Registers[instruction->RegA] ^= Registers[instruction->RegB];
+    VM_NEXT();
+op_XorVal:
+    Registers[instruction->RegA] ^= instruction->Value;
+    VM_NEXT();
+op_Neg:
+    Registers[instruction->RegA] = (VmValue)-(VmWide)Registers[instruction->RegA];
+    VM_NEXT();
+op_Load:
+    if constexpr (Checked)
+        OUT_OF_BOUNDS_MEMORY_CHECK(instruction->Value);
+    Registers[instruction->RegA] = LoadUnchecked(instruction->Value);
+    VM_NEXT();
+op_LoadP:
+    OUT_OF_BOUNDS_MEMORY_CHECK(Registers[instruction->RegB]);
+    Registers[instruction->RegA] = LoadUnchecked(Registers[instruction->RegB]);
+    VM_NEXT();
+op_Store:
+    if constexpr (Checked)
+        OUT_OF_BOUNDS_MEMORY_CHECK(instruction->Value);
+    StoreUnchecked(instruction->Value, Registers[instruction->RegA]);
+    if constexpr (!Checked)
+        if (!_verified) //Modified its instructions into something the verifier rejects
+            VM_CHECKED_FALLBACK();
+    VM_NEXT();
+op_StoreP:
+    OUT_OF_BOUNDS_MEMORY_CHECK(Registers[instruction->RegA]);
+    StoreUnchecked(Registers[instruction->RegA], Registers[instruction->RegB]);
+    if constexpr (!Checked)
+        if (!_verified)
+            VM_CHECKED_FALLBACK();
+    VM_NEXT();
+op_Push:
+    STACK_OVERFLOW_CHECK();
+    //Push the value of regA onto the stack
+    PushUnchecked(Registers[instruction->RegA]);
+    VM_NEXT();
+op_Pop:
+    STACK_UNDERFLOW_CHECK();
+    //Pop a value off the stack and store it in register A
+    Registers[instruction->RegA] = PopUnchecked();
+    VM_NEXT();
+op_Ipo:
+    PORT_STOP_CHECK();
+    INSTRUMENT_PORT_ACCESS();
+    _portHandlers->Read[instruction->Port](_portContext, deltaTime);
+    Registers[instruction->RegA] = GetPort((Port)instruction->Port); //Port index set via the built in port constants
+    INTERRUPT_CHECK();
+    VM_NEXT();
+op_Opo:
+    PORT_STOP_CHECK();
+    INSTRUMENT_PORT_ACCESS();
+    _portHandlers->Write[instruction->Port](_portContext, Registers[instruction->RegA], deltaTime); //Write the value of registerA to the port
+    INTERRUPT_CHECK();
+    VM_NEXT();
+op_OpoVal:
+    PORT_STOP_CHECK();
+    INSTRUMENT_PORT_ACCESS();
+    _portHandlers->Write[instruction->Port](_portContext, instruction->Value, deltaTime); //Write value to the port. The callback is allowed to discard the value.
+    INTERRUPT_CHECK();
+    VM_NEXT();
+op_Nop:
+    VM_NEXT();
+op_Wait:
+    _waitCyclesRemaining = (u32)std::max<VmValue>(Registers[instruction->RegA], 0);
+    goto sleep;
+op_WaitVal:
+    _waitCyclesRemaining = (u32)std::max<VmValue>(instruction->Value, 0);
+    goto sleep;
+op_Hlt:
+    _waitCyclesRemaining = VM::WAIT_HALTED;
+    goto sleep;
+op_Iret:
+    if (SP + sizeof(VmValue) >= MemorySize())
+        VM_ERROR(VMErrorCode::StackUnderflow, SP);
+    //Pop the flags then PC pushed by DispatchInterrupt()
+    {
+        const VmValue flags = PopUnchecked();
+        FlagZero = (flags & 1) != 0;
+        FlagSign = (flags & 2) != 0;
+    }
+    PC = PopUnchecked();
+    _inInterrupt = false;
+    INTERRUPT_CHECK(); //Interrupts raised during the handler
+    VM_NEXT();
+
+    //Superinstructions. Run the first instruction then jump to the handler of the second.
+op_CmpJeq:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - Registers[instruction->RegB]));
+    VM_FUSED_NEXT(op_Jeq);
+op_CmpJne:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - Registers[instruction->RegB]));
+    VM_FUSED_NEXT(op_Jne);
+op_CmpJgr:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - Registers[instruction->RegB]));
+    VM_FUSED_NEXT(op_Jgr);
+op_CmpJls:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - Registers[instruction->RegB]));
+    VM_FUSED_NEXT(op_Jls);
+op_CmpValJeq:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - instruction->Value));
+    VM_FUSED_NEXT(op_Jeq);
+op_CmpValJne:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - instruction->Value));
+    VM_FUSED_NEXT(op_Jne);
+op_CmpValJgr:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - instruction->Value));
+    VM_FUSED_NEXT(op_Jgr);
+op_CmpValJls:
+    SetFlags((VmValue)((VmWide)Registers[instruction->RegA] - instruction->Value));
+    VM_FUSED_NEXT(op_Jls);
+op_IpoCmp:
+    PORT_STOP_CHECK();
+    INSTRUMENT_PORT_ACCESS();
+    _portHandlers->Read[instruction->Port](_portContext, deltaTime);
+    Registers[instruction->RegA] = GetPort((Port)instruction->Port);
+    INTERRUPT_CHECK(); //The handler runs before the cmp
+    VM_FUSED_NEXT(op_Cmp);
+op_IpoCmpVal:
+    PORT_STOP_CHECK();
+    INSTRUMENT_PORT_ACCESS();
+    _portHandlers->Read[instruction->Port](_portContext, deltaTime);
+    Registers[instruction->RegA] = GetPort((Port)instruction->Port);
+    INTERRUPT_CHECK();
+    VM_FUSED_NEXT(op_CmpVal);
+op_MovOpo:
+    Registers[instruction->RegA] = Registers[instruction->RegB];
+    VM_FUSED_NEXT(op_Opo);
+op_MovValOpo:
+    Registers[instruction->RegA] = instruction->Value;
+    VM_FUSED_NEXT(op_Opo);
+
+op_Break:
+    //Breakpoint or watchpoint patched over an instruction. Stop before the original instruction runs unless it's being resumed or the condition is false.
+    if (_breakpointResume == lastPC)
+    {
+        _breakpointResume = 0;
+    }
+    else if (BreakpointHit(_breakPatches[instruction->Value].Original, lastPC))
+    {
+        //Left pending with 1 cycle remaining like PORT_STOP_CHECK(). Runs on the first cycle of the next call.
+        PC = lastPC;
+        cycleBudget++;
+        _instruction = instruction;
+        _instructionCyclesRemaining = 1;
+        _breakpointResume = lastPC;
+        VMStatus status;
+        status.Breakpoint = true;
+        return status;
+    }
+    instruction = &_breakPatches[instruction->Value].Original;
+    INSTRUMENT_INSTRUCTION();
+    goto dispatch;
+
+sleep:
+    //Suspended by wait or hlt. The cycles pass without fetching anything.
+    cycleBudget -= Sleep(cycleBudget);
+    VM_NEXT();
+
+interrupt:
+    //Jump to the interrupt handler. The instruction at PC runs after iret.
+    {
+        const VMStatus status = DispatchInterrupt();
+        if (!status.Ok)
+        {
+            _instruction = nullptr;
+            _instructionCyclesRemaining = 0;
+            return status;
+        }
+    }
+    VM_NEXT();
+
+unsupportedInstruction:
+    if constexpr (!Checked) //Either unsupported or an unaligned instruction that failed verification. The checked interpreter sorts out which.
+        VM_CHECKED_FALLBACK();
+    VM_ERROR(VMErrorCode::UnsupportedInstruction, instruction->Opcode);
+
+exitPending:
+    //Instruction needs more cycles than are left in the budget. Finish it next call.
+    _instruction = instruction;
+    _instructionCyclesRemaining = instruction->Cycles - cycleBudget;
+    cycleBudget = 0;
+    return VMStatus{};
+
+exitIdle:
+    _instruction = nullptr;
+    _instructionCyclesRemaining = 0;
+    return VMStatus{};
+}
+
+VMStatus VM::RunJit(u32& cycleBudget, f32 deltaTime, u32 portStopBudget)
+{
+    _deltaTime = deltaTime;
+    _portStopBudget = portStopBudget;
+    while (cycleBudget > 0)
+    {
+        //Finish the instruction in progress. Only give the interpreter the cycles it needs so the rest can run as native code.
+        if (_instruction)
+        {
+            const u32 otherCycles = cycleBudget - std::min(_instructionCyclesRemaining, cycleBudget);
+            u32 budget = cycleBudget - otherCycles;
+            VMStatus status = Interpret<false, true>(budget, deltaTime, portStopBudget ? portStopBudget - otherCycles : 0);
+            cycleBudget = otherCycles + budget;
+            if (!status.Ok || budget > 0) //Error or stopped before a port access
+                return status;
+            if (!_jit) //Instruction modified the program
+                return Interpret<false, true>(cycleBudget, deltaTime, portStopBudget);
+            continue;
+        }
+
+        //Reset PC to first instruction if it's out of bounds
+        if (PC < VM::RESERVED_BYTES || PC >= VM::RESERVED_BYTES + InstructionsSize())
+            PC = VM::RESERVED_BYTES;
+        //Generated code only has entry points on instruction boundaries
+        if ((PC - VM::RESERVED_BYTES) % sizeof(Instruction) != 0)
+            return Interpret<false, true>(cycleBudget, deltaTime, portStopBudget);
+
+        JitExit exit = _jit->Run(*this, cycleBudget);
+        PC = exit.PC;
+        cycleBudget = exit.CycleBudget;
+        switch (exit.Reason)
+        {
+        case JitExitReason::Stop:
+            //Not enough cycles left to run the next instruction. Finish it next call.
+            if (cycleBudget > 0)
+            {
+                _instruction = Fetch();
+                _instructionCyclesRemaining = _instruction->Cycles - cycleBudget;
+                cycleBudget = 0;
+            }
+            return VMStatus{};
+
+        case JitExitReason::Deopt:
+        {
+            //The instruction cycles were already taken from the budget. Let the interpreter run it so errors and rare cases are handled in one place.
+            u32 budget = 1;
+            _instruction = Fetch();
+            _instructionCyclesRemaining = 1;
+            VMStatus status = Interpret<false, true>(budget, deltaTime, 0);
+            if (!status.Ok)
+                return status;
+            if (!_jit) //Instruction modified the program
+                return Interpret<false, true>(cycleBudget, deltaTime, portStopBudget);
+
+            cycleBudget -= Sleep(cycleBudget); //Instruction was wait or hlt
+            break;
+        }
+
+        case JitExitReason::Unaligned:
+            return Interpret<false, true>(cycleBudget, deltaTime, portStopBudget);
+
+        case JitExitReason::Port:
+            //Stopped before a port access. All but the cycle the port instruction executes on elapse now. It runs on the first cycle of the next call.
+            _instruction = Fetch();
+            _instructionCyclesRemaining = 1;
+            cycleBudget -= _instruction->Cycles - 1;
+            return VMStatus{};
+
+        case JitExitReason::Interrupt:
+        {
+            VMStatus status = DispatchInterrupt();
+            if (!status.Ok)
+                return status;
+
+            break;
+        }
+        }
+    }
+
+    return VMStatus{};
 }
 
+u32 VM::Sleep(u32 cycleBudget)
+{
+    const u32 cycles = std::min(_waitCyclesRemaining, cycleBudget);
+    if (_waitCyclesRemaining != VM::WAIT_HALTED)
+        _waitCyclesRemaining -= cycles;
+    if (_profile)
+        _profile->SuspendedCycles += cycles;
+
+    return cycles;
+}
+
+void VM::RaiseInterrupt(Interrupt interrupt)
+{
+    //Disabled until the program sets a handler
+    if (GetInterruptHandler(interrupt) == 0)
+        return;
+
+    _pendingInterrupts |= 1 << (u32)interrupt;
+    Wake();
+}
+
+VMStatus VM::DispatchInterrupt()
+{
+    //Lowest interrupts first. The rest stay pending until iret.
+    u32 interrupt = 0;
+    while ((_pendingInterrupts & (1 << interrupt)) == 0)
+        interrupt++;
+    _pendingInterrupts &= ~(1 << interrupt);
+
+    //Handler was removed after the interrupt was raised
+    const VmValue handler = GetInterruptHandler((Interrupt)interrupt);
+    if (handler == 0)
+        return VMStatus{};
+
+    if (SP <= VM::RESERVED_BYTES + InstructionsSize() + VariablesSize() + sizeof(VmValue)) //Room for two pushes
+        return VMStatus::Failure(VMErrorCode::StackOverflow, (u16)PC, SP);
+
+    //iret pops these in reverse
+    PushUnchecked(PC);
+    PushUnchecked((FlagZero ? 1 : 0) | (FlagSign ? 2 : 0));
+    PC = handler;
+    _inInterrupt = true;
+    return VMStatus{};
+}
+
+JitPortResult VM::JitPortRead(VM* vm, const DecodedInstruction* instruction, u32 cycleBudget)
+{
+    if (cycleBudget + 1 < vm->_portStopBudget)
+        return JitPortResult::Stopped;
+
+    vm->_portHandlers->Read[instruction->Port](vm->_portContext, vm->_deltaTime);
+    vm->Registers[instruction->RegA] = vm->GetPort((Port)instruction->Port);
+    return vm->InterruptReady() ? JitPortResult::Interrupt : JitPortResult::Done;
+}
+
+JitPortResult VM::JitPortWrite(VM* vm, const DecodedInstruction* instruction, u32 cycleBudget)
+{
+    if (cycleBudget + 1 < vm->_portStopBudget)
+        return JitPortResult::Stopped;
+
+    const VmValue value = instruction->Opcode == Opcode::Opo ? vm->Registers[instruction->RegA] : instruction->Value;
+    vm->_portHandlers->Write[instruction->Port](vm->_portContext, value, vm->_deltaTime);
+    return vm->InterruptReady() ? JitPortResult::Interrupt : JitPortResult::Done;
+}
 
 VmValue VM::Load(VmValue address)
 {
-    if (address >= VM::MEMORY_SIZE) //Caller is required to do their own bounds checking. Overkill to use Result<VmValue, VmError> for this func.
+    if ((VmAddress)address > MemorySize() - sizeof(VmValue)) //Caller is required to do their own bounds checking. Overkill to use Result<VmValue, VmError> for this func.
         throw std::runtime_error("Out of bounds address passed to VM::Load().");
 
-    return *(VmValue*)(&Memory[address]);
+    return LoadUnchecked(address);
 }
 
 void VM::Store(VmValue address, VmValue value)
 {
-    if (address >= VM::MEMORY_SIZE) //Caller is required to do their own bounds checking. Overkill to use Result<VmValue, VmError> for this func.
+    if ((VmAddress)address > MemorySize() - sizeof(VmValue)) //Caller is required to do their own bounds checking. Overkill to use Result<VmValue, VmError> for this func.
         throw std::runtime_error("Out of bounds address passed to VM::Store().");
 
-    *(VmValue*)(&Memory[address]) = value;
+    StoreUnchecked(address, value);
+}
+
+void VM::StoreUnchecked(VmValue address, VmValue value)
+{
+    *(VmValue*)(&Memory[(VmAddress)address]) = value;
+
+    //Keep decoded instructions in sync with self modifying programs
+    if ((VmAddress)address < VM::RESERVED_BYTES + InstructionsSize() && (VmAddress)address + sizeof(VmValue) > VM::RESERVED_BYTES)
+        RedecodeInstructions((VmAddress)address, sizeof(VmValue));
 }
 
 void VM::Push(VmValue value)
@@ -313,19 +1079,16 @@ void VM::Push(VmValue value)
         throw std::runtime_error("Stack overflow caused by VM::Push() call. SP = " + std::to_string(PC));
 
     //Grow stack down into memory and push a value onto it
-    SP -= INSTRUCTION_NUM_VALUE_BYTES;
-    Store(SP, value);
+    PushUnchecked(value);
 }
 
 VmValue VM::Pop()
 {
-    if (SP >= VM::MEMORY_SIZE)
+    if (SP >= MemorySize())
         throw std::runtime_error("Stack underflow caused by VM::Pop() call. SP = " + std::to_string(PC));
 
     //Pop a value off the top of stack and shrink it up towards the end of memory
-    VmValue value = Load(SP);
-    SP += INSTRUCTION_NUM_VALUE_BYTES;
-    return value;
+    return PopUnchecked();
 }
 
 void VM::SetFlags(VmValue result)
@@ -340,6 +1103,331 @@ VmValue& VM::GetPort(Port port)
     return *(VmValue*)(&Memory[address]);
 }
 
+void VM::EnableProfiler(bool enabled)
+{
+#ifdef VM_PROFILER
+    if (!enabled)
+    {
+        _profile = nullptr;
+        return;
+    }
+    if (!_profile)
+    {
+        _profile = std::make_unique<VmProfile>();
+        ResetProfile();
+    }
+#endif
+}
+
+void VM::ResetProfile()
+{
+    if (!_profile)
+        return;
+
+    *_profile = VmProfile{};
+    _profile->Instructions.resize(InstructionsSize() / sizeof(Instruction));
+}
+
+void VM::RecordProfile(const DecodedInstruction& instruction, u32 address)
+{
+    VmProfile& profile = *_profile;
+    VmProfile::InstructionCounters& counters = profile.Instructions[(address - VM::RESERVED_BYTES) / sizeof(Instruction)];
+    counters.Executions++;
+    counters.Cycles += instruction.Cycles;
+    profile.Cycles += instruction.Cycles;
+    if (IsPortOpcode(instruction.Opcode))
+    {
+        VmProfile::PortCounters& port = profile.Ports[instruction.Port];
+        const bool read = instruction.Opcode == Opcode::Ipo || instruction.Opcode == Opcode::IpoCmp || instruction.Opcode == Opcode::IpoCmpVal;
+        (read ? port.Reads : port.Writes)++;
+        port.Cycles += instruction.Cycles;
+        counters.PortAccesses++;
+    }
+}
+
+void VM::SetBreakpoint(const Breakpoint& breakpoint)
+{
+    auto it = std::find_if(_breakpoints.begin(), _breakpoints.end(), [&](const Breakpoint& other) { return other.Address == breakpoint.Address; });
+    if (it != _breakpoints.end())
+        *it = breakpoint;
+    else
+        _breakpoints.push_back(breakpoint);
+
+    UpdateBreakpoints();
+}
+
+void VM::RemoveBreakpoint(u16 address)
+{
+    _breakpoints.erase(std::remove_if(_breakpoints.begin(), _breakpoints.end(), [&](const Breakpoint& breakpoint) { return breakpoint.Address == address; }), _breakpoints.end());
+    UpdateBreakpoints();
+}
+
+const Breakpoint* VM::GetBreakpoint(u16 address) const
+{
+    for (const Breakpoint& breakpoint : _breakpoints)
+        if (breakpoint.Address == address)
+            return &breakpoint;
+
+    return nullptr;
+}
+
+void VM::AddWatchpoint(u16 address)
+{
+    if (!Watched(address))
+        _watchpoints.push_back(address);
+
+    UpdateBreakpoints();
+}
+
+void VM::RemoveWatchpoint(u16 address)
+{
+    _watchpoints.erase(std::remove(_watchpoints.begin(), _watchpoints.end(), address), _watchpoints.end());
+    UpdateBreakpoints();
+}
+
+void VM::UpdateBreakpoints()
+{
+    if (!_decodedInstructions)
+        return; //No program loaded. Patched once one is.
+
+    UnpatchBreakpoints();
+    if (HasBreakpoints())
+        PatchBreakpoints();
+    else if (_program && _decodedInstructions != _program->DecodedInstructions && memcmp(Memory + VM::RESERVED_BYTES, _program->Memory.data() + VM::RESERVED_BYTES, InstructionsSize()) == 0)
+        UseProgramInstructions(); //Share the program image and its native code again
+
+    //The pending instruction may point into the old decoded instructions. Instructions are always left pending at PC.
+    if (_instruction)
+        _instruction = Fetch();
+
+    //Only resume past a breakpoint while its patch is still the pending instruction. Otherwise the next arrival at a breakpoint set again there would run through it.
+    if (!_instruction || _instruction->Opcode != Opcode::Break || PC != _breakpointResume)
+        _breakpointResume = 0;
+}
+
+void VM::PatchBreakpoints()
+{
+    if (!HasBreakpoints())
+        return;
+
+    //Copy on write. The program image is shared with other VMs. Generated code doesn't see the patches so the interpreter takes over.
+    _jit = nullptr;
+    if (_program && _decodedInstructions == _program->DecodedInstructions)
+        _decodedInstructions = std::make_shared<std::vector<DecodedInstruction>>(*_program->DecodedInstructions);
+
+    for (const Breakpoint& breakpoint : _breakpoints)
+        if (breakpoint.Address >= VM::RESERVED_BYTES && (breakpoint.Address - VM::RESERVED_BYTES) % sizeof(Instruction) == 0)
+            PatchInstruction((breakpoint.Address - VM::RESERVED_BYTES) / sizeof(Instruction));
+
+    //Watched values can only be written by store and storep. Ports, push, call, and interrupts write to the reserved bytes and stack.
+    //storep writes a runtime address so all of them are patched. store is only patched if its constant address overlaps a watched value.
+    if (!_watchpoints.empty())
+    {
+        const Instruction* instructions = (Instruction*)&Memory[VM::RESERVED_BYTES];
+        const std::vector<DecodedInstruction>& decoded = *_decodedInstructions;
+        for (u32 i = 0; i < decoded.size(); i++)
+        {
+            const Opcode opcode = (Opcode)instructions[i].Op.Opcode;
+            const VmAddress address = (VmAddress)decoded[i].Value;
+            if (opcode == Opcode::StoreP)
+                PatchInstruction(i);
+            else if (opcode == Opcode::Store)
+                for (u16 watch : _watchpoints)
+                    if (address < watch + sizeof(VmValue) && address + sizeof(VmValue) > watch)
+                        PatchInstruction(i);
+        }
+    }
+}
+
+void VM::UnpatchBreakpoints()
+{
+    if (_breakPatches.empty())
+        return;
+
+    std::vector<DecodedInstruction>& decoded = *_decodedInstructions;
+    for (const BreakPatch& patch : _breakPatches)
+        decoded[patch.Index] = patch.Original;
+
+    //Fuse the pairs that were split up by patches again
+    for (const BreakPatch& patch : _breakPatches)
+        FuseInstructions(decoded, (Instruction*)&Memory[VM::RESERVED_BYTES], patch.Index > 0 ? patch.Index - 1 : 0, patch.Index);
+
+    _breakPatches.clear();
+}
+
+void VM::PatchInstruction(u32 index)
+{
+    std::vector<DecodedInstruction>& decoded = *_decodedInstructions;
+    if (index >= decoded.size() || decoded[index].Opcode == Opcode::Break || decoded[index].Cycles == 0)
+        return;
+
+    //Keep the original with its superinstruction split up. The Break instruction takes the same number of cycles as it.
+    const Instruction* instructions = (Instruction*)&Memory[VM::RESERVED_BYTES];
+    DecodedInstruction& instruction = decoded[index];
+    BreakPatch& patch = _breakPatches.emplace_back(BreakPatch{ index, instruction });
+    patch.Original.Opcode = (Opcode)instructions[index].Op.Opcode;
+    instruction.Opcode = Opcode::Break;
+    instruction.Value = (i16)(_breakPatches.size() - 1);
+
+    //The previous instruction can't jump straight to the handler of this one anymore
+    if (index > 0 && decoded[index - 1].Opcode != Opcode::Break)
+        decoded[index - 1].Opcode = (Opcode)instructions[index - 1].Op.Opcode;
+}
+
+bool VM::BreakpointHit(const DecodedInstruction& instruction, u32 address) const
+{
+    const Breakpoint* breakpoint = GetBreakpoint((u16)address);
+    if (breakpoint)
+    {
+        const VmValue value = Registers[breakpoint->Register % VM::NUM_REGISTERS];
+        switch (breakpoint->Condition)
+        {
+        case BreakCondition::Always:   return true;
+        case BreakCondition::Equal:    if (value == breakpoint->Value) return true; break;
+        case BreakCondition::NotEqual: if (value != breakpoint->Value) return true; break;
+        case BreakCondition::Less:     if (value < breakpoint->Value) return true; break;
+        case BreakCondition::Greater:  if (value > breakpoint->Value) return true; break;
+        }
+    }
+
+    //Watchpoints. Stop if the store overlaps a watched value.
+    if (instruction.Opcode == Opcode::Store || instruction.Opcode == Opcode::StoreP)
+    {
+        const VmAddress target = instruction.Opcode == Opcode::Store ? (VmAddress)instruction.Value : (VmAddress)Registers[instruction.RegA];
+        for (u16 watch : _watchpoints)
+            if (target < watch + sizeof(VmValue) && target + sizeof(VmValue) > watch)
+                return true;
+    }
+
+    return false;
+}
+
+void VM::EnableTrace(u32 capacity)
+{
+#ifdef VM_TRACE
+    if (capacity == 0)
+    {
+        _trace = nullptr;
+        _traceRecordPending = false;
+        return;
+    }
+
+    //Round up to a power of 2 so records can be indexed with a mask
+    u32 size = 1;
+    while (size < capacity && size < (1u << 31))
+        size <<= 1;
+
+    if (!_trace)
+        _trace = std::make_unique<VmTrace>();
+    if (_trace->Records.size() != size)
+        _trace->Records.assign(size, VmTraceRecord{});
+    ResetTrace();
+#endif
+}
+
+const VmTrace* VM::Trace()
+{
+    if (_traceRecordPending)
+        FinishTraceRecord();
+
+    return _trace.get();
+}
+
+void VM::ResetTrace()
+{
+    _traceRecordPending = false;
+    if (!_trace)
+        return;
+
+    _trace->Written = 0;
+    _trace->Cycles = 0;
+}
+
+void VM::Instrument(const DecodedInstruction& instruction, u32 address, u32 cycleBudget)
+{
+    if (_profile)
+        RecordProfile(instruction, address);
+    if (_trace)
+        RecordTrace(address, _traceCycleEnd - cycleBudget);
+}
+
+void VM::RecordTrace(u32 address, u64 cycle)
+{
+    //The previous instruction has executed by now
+    if (_traceRecordPending)
+        FinishTraceRecord();
+
+    VmTrace& trace = *_trace;
+    VmTraceRecord& record = trace.Records[trace.Written & (trace.Records.size() - 1)];
+    record.Cycle = cycle;
+    record.Flags = 0;
+    record.Code = *(Instruction*)&Memory[address];
+    record.PC = (u16)address;
+    record.Value = 0;
+    trace.Written++;
+    _traceRecordPending = true;
+}
+
+void VM::FinishTraceRecord()
+{
+    VmTrace& trace = *_trace;
+    VmTraceRecord& record = trace.Records[(trace.Written - 1) & (trace.Records.size() - 1)];
+    const Instruction code = record.Code;
+    u64 flags = (FlagZero ? TraceFlagZero : 0) | (FlagSign ? TraceFlagSign : 0);
+    switch ((Opcode)code.Op.Opcode)
+    {
+    //Instructions that write their first register
+    case Opcode::Mov:
+    case Opcode::MovVal:
+    case Opcode::Add:
+    case Opcode::AddVal:
+    case Opcode::Sub:
+    case Opcode::SubVal:
+    case Opcode::Mul:
+    case Opcode::MulVal:
+    case Opcode::Div:
+    case Opcode::DivVal:
+    case Opcode::Mod:
+    case Opcode::ModVal:
+    case Opcode::And:
+    case Opcode::AndVal:
+    case Opcode::Or:
+    case Opcode::OrVal:
+    case Opcode::Xor:
+    case Opcode::XorVal:
+    case Opcode::Neg:
+    case Opcode::Load:
+    case Opcode::LoadP:
+    case Opcode::Pop:
+        flags |= TraceRegisterWrite;
+        record.Value = Registers[code.OpRegister.Reg];
+        break;
+    case Opcode::Ipo:
+        flags |= TraceRegisterWrite | TracePortRead;
+        record.Value = Registers[code.OpRegister.Reg];
+        break;
+    case Opcode::Opo:
+        flags |= TracePortWrite;
+        record.Value = Registers[code.OpRegisterValue.RegA];
+        break;
+    case Opcode::OpoVal:
+        flags |= TracePortWrite;
+        record.Value = code.OpPortValue.Value;
+        break;
+    default:
+        break;
+    }
+
+    record.Flags = flags;
+    _traceRecordPending = false;
+}
+
+VmValue& VM::GetInterruptHandler(Interrupt interrupt)
+{
+    VmValue address = INTERRUPT_VECTOR_TABLE + (VmValue)interrupt * sizeof(VmValue);
+    return *(VmValue*)(&Memory[address]);
+}
+
 u32 VM::GetInstructionDuration(const Instruction& instruction) const
 {
     Opcode opcode = (Opcode)instruction.Op.Opcode;
@@ -352,26 +1440,188 @@ u32 VM::GetInstructionDuration(const Instruction& instruction) const
         else if (opcode == Opcode::OpoVal)
             port = (Port)instruction.OpPortValue.Port;
 
-        auto search = PortDurations.find(port);
-        if (search == PortDurations.end())
+        if ((u32)port >= std::size(PortDurations))
         {
             printf("Unsupported port %d passed to VM::GetInstructionTime()\n", (u32)port);
             return 0xFFFFFFFF;
         }
 
-        return search->second;
+        return PortDurations[(u32)port];
     }
     else
     {
         //All other instructions use InstructionDurations
-        auto search = InstructionDurations.find(opcode);
-        if (search == InstructionDurations.end())
+        if ((u32)opcode >= std::size(InstructionDurations))
         {
             printf("Unsupported opcode '%d' passed to VM::GetInstructionTime()\n", (u32)opcode);
             return 0xFFFFFFFF;
         }
 
-        return search->second;
+        return InstructionDurations[(u32)opcode];
+    }
+}
+
+DecodedInstruction VM::Decode(const Instruction& instruction) const
+{
+    DecodedInstruction decoded = {};
+    decoded.Opcode = (Opcode)instruction.Op.Opcode;
+    decoded.RegA = instruction.OpRegisterRegister.RegA;
+    decoded.RegB = instruction.OpRegisterRegister.RegB;
+    decoded.Value = instruction.OpRegisterValue.Value;
+    if (decoded.Opcode == Opcode::OpoVal) //OpoVal is the only instruction that stores the port separately
+    {
+        decoded.Port = instruction.OpPortValue.Port;
+        decoded.Value = instruction.OpPortValue.Value;
+    }
+    else if (decoded.Opcode == Opcode::Ipo || decoded.Opcode == Opcode::Opo)
+    {
+        decoded.Port = instruction.OpRegisterValue.Value;
+    }
+
+    const u32 duration = GetInstructionDuration(instruction);
+    decoded.Cycles = duration == 0xFFFFFFFF ? 0 : (u8)duration;
+    return decoded;
+}
+
+std::vector<DecodedInstruction> VM::DecodeInstructions() const
+{
+    std::vector<DecodedInstruction> decoded = {};
+    decoded.reserve(InstructionsSize() / sizeof(Instruction));
+    for (u32 i = 0; i < InstructionsSize() / sizeof(Instruction); i++)
+        decoded.push_back(Decode(*(Instruction*)(&Memory[VM::RESERVED_BYTES + i * sizeof(Instruction)])));
+
+    return decoded;
+}
+
+bool VM::VerifyInstruction(const DecodedInstruction& instruction) const
+{
+    switch (instruction.Opcode)
+    {
+    case Opcode::Jmp:
+    case Opcode::Jeq:
+    case Opcode::Jne:
+    case Opcode::Jgr:
+    case Opcode::Jls:
+    case Opcode::Call:
+    {
+        //Must land on an instruction in the program
+        const u16 target = (u16)instruction.Value;
+        return target >= VM::RESERVED_BYTES && target < VM::RESERVED_BYTES + InstructionsSize() && (target - VM::RESERVED_BYTES) % sizeof(Instruction) == 0;
+    }
+    case Opcode::Load:
+    case Opcode::Store:
+        return (VmAddress)instruction.Value <= MemorySize() - sizeof(VmValue);
+    default:
+        return true;
+    }
+}
+
+bool VM::VerifyInstructions() const
+{
+    //Fused instructions don't need their own case. The first half of each is an instruction without static checks and the second half keeps its own opcode.
+    for (const DecodedInstruction& instruction : *_decodedInstructions)
+        if (!VerifyInstruction(instruction))
+            return false;
+
+    return true;
+}
+
+void VM::UseProgramInstructions()
+{
+    _decodedInstructions = _program->DecodedInstructions;
+    if (!UseJit)
+        _jit = nullptr;
+    else if (_program->Jit && _program->JitMemorySize == MemorySize())
+        _jit = _program->Jit;
+    else //Memory size is baked into native code. Generate a copy for this VM.
+        _jit = JitProgram::Compile(*this, DecodeInstructions());
+
+    _verified = VerifyInstructions();
+    _breakPatches.clear();
+    PatchBreakpoints();
+}
+
+void VM::DecodeProgram()
+{
+    //Generate native code before fusing instructions. The JIT works on single instructions.
+    std::vector<DecodedInstruction> decoded = DecodeInstructions();
+    _jit = UseJit ? JitProgram::Compile(*this, decoded) : nullptr;
+    if (!decoded.empty())
+        FuseInstructions(decoded, (Instruction*)&Memory[VM::RESERVED_BYTES], 0, (u32)decoded.size() - 1);
+
+    _decodedInstructions = std::make_shared<std::vector<DecodedInstruction>>(std::move(decoded));
+    _verified = VerifyInstructions();
+    _breakPatches.clear();
+    PatchBreakpoints();
+}
+
+void VM::RedecodeInstructions(u32 address, u32 size)
+{
+    //Generated code is out of date. Interpreter takes over for the rest of the program.
+    _jit = nullptr;
+    UnpatchBreakpoints();
+
+    //Copy on write. The program image is shared with other VMs.
+    if (_program && _decodedInstructions == _program->DecodedInstructions)
+        _decodedInstructions = std::make_shared<std::vector<DecodedInstruction>>(*_program->DecodedInstructions);
+
+    std::vector<DecodedInstruction>& decoded = *_decodedInstructions;
+    const u32 first = (std::max(address, VM::RESERVED_BYTES) - VM::RESERVED_BYTES) / sizeof(Instruction);
+    const u32 last = std::min((address + size - 1 - VM::RESERVED_BYTES) / (u32)sizeof(Instruction), (u32)decoded.size() - 1);
+    for (u32 i = first; i <= last; i++)
+    {
+        decoded[i] = Decode(*(Instruction*)(&Memory[VM::RESERVED_BYTES + i * sizeof(Instruction)]));
+        if (!VerifyInstruction(decoded[i]))
+            _verified = false;
+    }
+
+    //The previous instruction may have been fused with the first changed one
+    FuseInstructions(decoded, (Instruction*)&Memory[VM::RESERVED_BYTES], first > 0 ? first - 1 : first, last);
+
+    //Changed stores may write a watched address now
+    PatchBreakpoints();
+}
+
+void VM::FuseInstructions(std::vector<DecodedInstruction>& decodedInstructions, const Instruction* instructions, u32 first, u32 last) const
+{
+    for (u32 i = first; i <= last; i++)
+    {
+        DecodedInstruction& decoded = decodedInstructions[i];
+        const Opcode opcode = (Opcode)instructions[i].Op.Opcode; //Use the raw opcode since the decoded one may already be fused
+        decoded.Opcode = opcode;
+        if (i + 1 >= decodedInstructions.size() || decoded.Cycles == 0 || decodedInstructions[i + 1].Cycles == 0)
+            continue;
+
+        //Replace the opcode of the first instruction of the pair with the superinstruction
+        const Opcode nextOpcode = (Opcode)instructions[i + 1].Op.Opcode;
+        if (opcode == Opcode::Cmp || opcode == Opcode::CmpVal)
+        {
+            const bool val = opcode == Opcode::CmpVal;
+            switch (nextOpcode)
+            {
+            case Opcode::Jeq: decoded.Opcode = val ? Opcode::CmpValJeq : Opcode::CmpJeq; break;
+            case Opcode::Jne: decoded.Opcode = val ? Opcode::CmpValJne : Opcode::CmpJne; break;
+            case Opcode::Jgr: decoded.Opcode = val ? Opcode::CmpValJgr : Opcode::CmpJgr; break;
+            case Opcode::Jls: decoded.Opcode = val ? Opcode::CmpValJls : Opcode::CmpJls; break;
+            default: break;
+            }
+        }
+        else if (opcode == Opcode::Ipo && nextOpcode == Opcode::Cmp)
+        {
+            decoded.Opcode = Opcode::IpoCmp;
+        }
+        else if (opcode == Opcode::Ipo && nextOpcode == Opcode::CmpVal)
+        {
+            decoded.Opcode = Opcode::IpoCmpVal;
+        }
+        else if (opcode == Opcode::Mov && nextOpcode == Opcode::Opo)
+        {
+            decoded.Opcode = Opcode::MovOpo;
+        }
+        else if (opcode == Opcode::MovVal && nextOpcode == Opcode::Opo)
+        {
+            decoded.Opcode = Opcode::MovValOpo;
+        }
     }
 }
 
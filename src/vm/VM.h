@@ -5,10 +5,96 @@
 #include "utility/Span.h"
 #include "Instruction.h"
 #include "Constants.h"
-#include <unordered_map>
-#include <functional>
+#include "Jit.h"
+#include "ProgramImage.h"
+#include "VmTrace.h"
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <type_traits>
 
-struct VMError;
+//Computed goto dispatch uses the labels as values extension, which is only supported by GCC and Clang. Enabled with the VM_THREADED_DISPATCH cmake option.
+#if defined(VM_THREADED_DISPATCH_ENABLED) && (defined(__GNUC__) || defined(__clang__))
+#define VM_THREADED_DISPATCH
+#endif
+
+//Per instruction execution counters. Enabled with the VM_PROFILER cmake option. VMs only collect them once VM::EnableProfiler() is called.
+#if defined(VM_PROFILER_ENABLED)
+#define VM_PROFILER
+#endif
+
+//Binary execution trace. Enabled with the VM_TRACE cmake option. VMs only record it once VM::EnableTrace() is called.
+#if defined(VM_TRACE_ENABLED)
+#define VM_TRACE
+#endif
+
+struct VmSnapshot;
+struct VmProfile;
+
+enum VMErrorCode
+{
+    DivideByZero,
+    OutOfBoundsMemoryAccess,
+    StackUnderflow,
+    StackOverflow,
+    UnsupportedInstruction,
+    ProgramFileLoadFailure,
+    InvalidSnapshot,
+};
+
+//Returned when the VM encounters an error
+struct VMError
+{
+    VMErrorCode Code;
+    std::string Message;
+};
+
+//Returned by VM::Run() and VM::Cycle(). Trivially copyable so checking it every cycle is cheap. The message is only formatted when Message() is called.
+struct VMStatus
+{
+    bool Ok = true;
+    VMErrorCode Code = DivideByZero; //Only valid if Ok is false
+    u16 PC = 0; //Address of the instruction that caused the error
+    i32 Operand = 0; //Address for OutOfBoundsMemoryAccess, SP for StackOverflow, opcode for UnsupportedInstruction. Unused otherwise.
+    u32 CyclesElapsed = 0; //Cycles that elapsed during the call, including on error
+    bool Breakpoint = false; //Stopped before the instruction at VM::PC because of a breakpoint or watchpoint. Only set when Ok is true.
+
+    static VMStatus Failure(VMErrorCode code, u16 pc, i32 operand) { return VMStatus{ false, code, pc, operand }; }
+    std::string Message() const; //Describe the error
+    VMError ToError() const { return VMError{ Code, Message() }; }
+};
+static_assert(std::is_trivially_copyable_v<VMStatus>, "VMStatus must stay trivially copyable. It's returned on every VM::Run() call.");
+
+
+//Called when ports are read or written to. context is the pointer passed to VM::SetPortHandlers(). E.g. the Robot that owns the VM.
+using PortReadHandler = void(*)(void* context, f32 deltaTime); //Called before the VM stores the port value in a register. That way the handler can update the port value.
+using PortWriteHandler = void(*)(void* context, VmValue value, f32 deltaTime); //Called after the VM updates the port value. That way the handler can update the hardware with the new port value.
+
+//Handler for each port. Indexed by Port. Plain function pointers so each port goes straight to its own handler.
+struct PortHandlers
+{
+    PortReadHandler Read[(size_t)Port::NumPorts];
+    PortWriteHandler Write[(size_t)Port::NumPorts];
+};
+
+//Condition a breakpoint checks before stopping the VM. Compares Breakpoint::Register with Breakpoint::Value.
+enum class BreakCondition : u8
+{
+    Always,
+    Equal,
+    NotEqual,
+    Less,
+    Greater,
+};
+
+//Stops the VM before the instruction at Address runs. Set with VM::SetBreakpoint().
+struct Breakpoint
+{
+    u16 Address = 0; //Address of an instruction. Must be on an instruction boundary.
+    BreakCondition Condition = BreakCondition::Always;
+    u8 Register = 0;
+    VmValue Value = 0;
+};
 
 //Virtual machine that runs binaries generated by Compiler.
 class VM
@@ -16,25 +102,75 @@ class VM
 public:
     //Constants
     static const u32 RESERVED_BYTES = 256; //Bytes at the start of VM memory reserved for ports and other VM data
+#ifdef VM_WORD_32
+    static const u32 MEMORY_SIZE = 65532; //Limited by the 16 bit addresses used by jumps and VmSnapshot
+#else
     static const u32 MEMORY_SIZE = 32766; //Note: Less than VmValue max so SP can be set out of bounds to signify an empty stack
+#endif
+    static const u32 MAX_PROGRAM_END = 32767; //Instructions and variables must end before this. Load and store addresses are signed 16 bit immediates.
     static const u32 NUM_REGISTERS = 8;
-    static_assert(MEMORY_SIZE <= std::numeric_limits<Register>::max(), "VM::MEMORY_SIZE too big! Must be fit inside VM registers. Either make memory smaller or make registers larger (see VM.h)");
-    
+    static const u32 WAIT_HALTED = 0xFFFFFFFF; //Wait cycles of a VM suspended by hlt
+    static_assert(MEMORY_SIZE <= std::numeric_limits<Register>::max(), "VM::MEMORY_SIZE too big! Must be fit inside VM registers. Either make memory smaller or make registers larger (see VM_WORD_32 in Instruction.h)");
+    static_assert(INTERRUPT_VECTOR_TABLE + (size_t)Interrupt::NumInterrupts * sizeof(VmValue) <= RESERVED_BYTES, "Interrupt vector table must fit in the reserved bytes");
+
+    VM();
     Result<void, VMError> LoadProgram(const VmProgram& program); //Load program binary
+    Result<void, VMError> LoadProgram(std::shared_ptr<const ProgramImage> program); //Load a program already loaded by another VM. Shares its decoded instructions and native code.
     Result<void, VMError> LoadProgram(std::string_view inFilePath); //Load program binary from file
     Result<void, VMError> LoadProgramFromSource(std::string_view inFilePath); //Compile and load program from source file
-    Result<void, VMError> Cycle(f32 deltaTime); //Run a single clock cycle. deltaTime is time since elapsed since last Cycle. Passed to port callbacks.
+    void Snapshot(VmSnapshot& snapshot) const; //Save the execution state of the VM. Memory is stored as the difference from the loaded program so it stays small.
+    Result<void, VMError> Restore(const VmSnapshot& snapshot); //Restore a snapshot taken by a VM with the same program loaded
+    VMStatus Cycle(f32 deltaTime); //Run a single clock cycle. deltaTime is time since elapsed since last Cycle. Passed to port callbacks.
+    //Run until cycleBudget cycles have elapsed. VMStatus::CyclesElapsed is the number of cycles that elapsed. deltaTime is the time elapsed per cycle. Passed to port callbacks.
+    //If stopAtPorts is true it stops early before a port is accessed, so the caller can update hardware for the cycles that elapsed before the access.
+    VMStatus Run(u32 cycleBudget, f32 deltaTime, bool stopAtPorts = true);
     VmValue Load(VmValue address); //Read value from VM memory
     void Store(VmValue address, VmValue value); //Set value in VM memory
     void Push(VmValue value); //Push a value onto the stack
     VmValue Pop(); //Pop a value off of the stack
     void SetFlags(VmValue result); //Update arithmetic flags
     VmValue& GetPort(Port port); //Get reference to a port
+    VmValue& GetInterruptHandler(Interrupt interrupt); //Get reference to an interrupt vector table entry
+    //Suspended by wait or hlt. Run() lets the cycles pass without executing anything until it wakes up.
+    bool Suspended() const { return _waitCyclesRemaining != 0; }
+    bool Halted() const { return _waitCyclesRemaining == VM::WAIT_HALTED; } //Suspended by hlt. Only Wake() resumes it.
+    void Wake() { _waitCyclesRemaining = 0; } //Resume a VM suspended by wait or hlt. E.g. when a hardware event happens.
+    //Signal a hardware event. Ignored if the program hasn't set a handler for it in the interrupt vector table. Otherwise it wakes the VM and the handler runs before the next instruction.
+    //The handler runs with PC and the flags pushed onto the stack. iret restores them. Interrupts raised while a handler runs wait until it returns.
+    void RaiseInterrupt(Interrupt interrupt);
+    bool InInterrupt() const { return _inInterrupt; } //True while an interrupt handler runs
+    //Count the executions, cycles, and port accesses of each instruction. Profiled VMs always run on the checked interpreter, so it's slower while enabled.
+    //Does nothing if the profiler was compiled out with the VM_PROFILER cmake option.
+    void EnableProfiler(bool enabled);
+    const VmProfile* Profile() const { return _profile.get(); } //Counters collected since the profiler was enabled or reset. Null if it's disabled.
+    void ResetProfile(); //Zero the profile counters. Also done when a program is loaded.
+    //Record each instruction executed into a ring buffer of the last capacity instructions. Rounded up to a power of 2. 0 disables it.
+    //The buffer is allocated here so recording doesn't allocate. Traced VMs run on the checked interpreter like profiled ones.
+    //Does nothing if the trace was compiled out with the VM_TRACE cmake option.
+    void EnableTrace(u32 capacity);
+    const VmTrace* Trace(); //Records collected since the trace was enabled or reset. Null if it's disabled.
+    void ResetTrace(); //Clear the trace. Also done when a program is loaded.
+    //Breakpoints and watchpoints. Patched into the decoded instructions as Opcode::Break, so VMs without any run at full speed and never check for them.
+    //Run() stops before an instruction with a breakpoint or a store to a watched address and sets VMStatus::Breakpoint. The next Run() call runs that instruction and continues.
+    //VMs with breakpoints or watchpoints don't use the JIT. They're kept when a program is loaded.
+    void SetBreakpoint(const Breakpoint& breakpoint); //Add a breakpoint. Replaces the one at the same address if there is one.
+    void RemoveBreakpoint(u16 address);
+    const Breakpoint* GetBreakpoint(u16 address) const; //Null if there's no breakpoint at address
+    const std::vector<Breakpoint>& Breakpoints() const { return _breakpoints; }
+    void AddWatchpoint(u16 address); //Stop before store and storep write the value at address. E.g. a variable address.
+    void RemoveWatchpoint(u16 address);
+    bool Watched(u16 address) const { return std::find(_watchpoints.begin(), _watchpoints.end(), address) != _watchpoints.end(); }
+    const std::vector<u16>& Watchpoints() const { return _watchpoints; }
+    bool HasBreakpoints() const { return !_breakpoints.empty() || !_watchpoints.empty(); }
 
     u32 InstructionsSize() const { return _instructionsSizeBytes; } //The number of bytes that instructions take up in memory
+    //True if the loaded program passed the load time verifier. Verified programs run on an interpreter without jump target and constant address checks.
+    bool Verified() const { return _verified; }
     u32 VariablesSize() const { return _variablesSizeBytes; } //The number of bytes that variables take up in memory
-    u32 StackSize() const { return VM::MEMORY_SIZE - SP; } //The number of bytes that the stack is using currently
-    u32 MaxStackSize() const { return VM::MEMORY_SIZE - VM::RESERVED_BYTES - InstructionsSize() - VariablesSize(); } //Max bytes the stack can use
+    u32 StackSize() const { return MemorySize() - SP; } //The number of bytes that the stack is using currently
+    u32 MaxStackSize() const { return MemorySize() - VM::RESERVED_BYTES - InstructionsSize() - VariablesSize(); } //Max bytes the stack can use
+    u32 MemorySize() const { return _memorySizeBytes; } //The number of bytes of memory the VM has. At most MEMORY_SIZE.
+    std::shared_ptr<const ProgramImage> Program() const { return _program; } //The loaded program. Pass to LoadProgram() to load it into other VMs.
 
     //Get a non-owning view of the program instructions
     const Span<Instruction> Instructions() { return Span<Instruction>((Instruction*)&Memory[VM::RESERVED_BYTES], InstructionsSize() / sizeof(Instruction)); };
@@ -42,123 +178,271 @@ public:
     const Span<VmValue> Variables() { return Span<VmValue>((VmValue*)&Memory[VM::RESERVED_BYTES + InstructionsSize()], VariablesSize() / sizeof(VmValue)); };
     //Get the number of cycles it takes to execute an instruction. Returns u32_max if the instruction is unsupported.
     u32 GetInstructionDuration(const Instruction& instruction) const;
+    //Unpack an instruction into a DecodedInstruction
+    DecodedInstruction Decode(const Instruction& instruction) const;
 
     std::optional<VmValue> GetConfig(const std::string& name);
     VmValue GetConfigOr(const std::string& name, VmValue or = 0);
 
-    u8 Memory[VM::MEMORY_SIZE] = { 0 };
+    u8* Memory = nullptr; //MemorySize() bytes. Set by LoadProgram().
     Register Registers[VM::NUM_REGISTERS] = { 0 };
     Register PC = VM::RESERVED_BYTES; //Memory address of the next instruction to be executed
-    Register SP = VM::MEMORY_SIZE; //Memory address of the top of the stack. Initially just past the end of Memory. Grows down from the top of Memory.
+    Register SP = 0; //Memory address of the top of the stack. Initially just past the end of Memory. Grows down from the top of Memory.
 
     //Set with the result of arithmetic instructions and with the difference between registers when cmp is executed. Used by conditional jump instructions like jle and jgr.
     bool FlagZero = false; //True when result == 0
     bool FlagSign = false; //True when result < 0
 
-    //Called when ports are read or written to
-    std::function<void(Port port, f32 deltaTime)> OnPortRead;  //Called before the VM stores the port value in a register. That way the callback can update the port value.
-    std::function<void(Port port, VmValue value, f32 deltaTime)> OnPortWrite; //Called after the VM updates the port value. That way the callback can update the hardware with the new port value.
+    //Set the functions called when ports are read or written to. handlers must outlive the VM. context is passed to each handler.
+    void SetPortHandlers(const PortHandlers* handlers, void* context) { _portHandlers = handlers; _portContext = context; }
 
     //Config values
     std::vector<VmConfig> Config = {};
 
+    //Bytes of stack space to reserve when loading programs. If non zero LoadProgram() only gives the VM enough memory for the program and stack, instead of MEMORY_SIZE bytes.
+    //Useful when running many VMs since most programs only use a small part of the address space.
+    u32 StackReservation = 0;
+
+    //Use the computed goto interpreter instead of the switch interpreter. Ignored if VM_THREADED_DISPATCH isn't supported by the compiler.
+    bool ThreadedDispatch = true;
+    //Run programs as native code generated by JitProgram. Ignored if the JIT isn't supported by the host or the program.
+    bool UseJit = true;
+
 private:
-    //Executes _instruction and increments PC
-    Result<void, VMError> Execute(f32 deltaTime);
+    friend class JitProgram;
+    friend class VmBatch;
+
+    //Executes instructions until cycleBudget cycles have elapsed. Threaded selects the dispatch engine. cycleBudget is set to the cycles that weren't used.
+    //If portStopBudget != 0 it stops before a port instruction executes if any cycles elapsed since cycleBudget was portStopBudget.
+    //Checked == false skips the checks done by VerifyInstruction(). Only used on verified programs. Falls back to the checked interpreter if it reaches an instruction that wasn't verified.
+    //Instrumented == true updates _profile and _trace. Only used with Checked == true.
+    template<bool Threaded, bool Checked, bool Instrumented = false>
+    VMStatus Interpret(u32& cycleBudget, f32 deltaTime, u32 portStopBudget);
+    //Run the checked interpreter. Uses the instrumented version if the profiler or trace is enabled.
+    VMStatus InterpretChecked(u32& cycleBudget, f32 deltaTime, u32 portStopBudget, bool threaded);
+    bool Instrumented() const { return _profile || _trace; } //True if the profiler or trace is enabled
+    //Update the profile and trace with an instruction run by the instrumented interpreter. cycleBudget is the budget left after taking the instruction cycles.
+    void Instrument(const DecodedInstruction& instruction, u32 address, u32 cycleBudget);
+    //Count an instruction in the profile. Port instructions are counted as port accesses too. address is where the instruction is in memory.
+    void RecordProfile(const DecodedInstruction& instruction, u32 address);
+    //Append the instruction at address to the trace. Its register and port values are filled in by FinishTraceRecord() once it's executed.
+    void RecordTrace(u32 address, u64 cycle);
+    //Fill in the values written by the newest trace record
+    void FinishTraceRecord();
+    //Replace instructions that have a breakpoint or might write a watched address with Opcode::Break. Expects no patches to be applied.
+    void PatchBreakpoints();
+    //Put back the instructions replaced by PatchBreakpoints()
+    void UnpatchBreakpoints();
+    //Patch a breakpoint over the instruction at index in the decoded instructions. Does nothing if it's already patched.
+    void PatchInstruction(u32 index);
+    //Rebuild the patches after the breakpoints or watchpoints change
+    void UpdateBreakpoints();
+    //True if a breakpoint or watchpoint stops the VM before instruction runs. instruction is the original instruction at address.
+    bool BreakpointHit(const DecodedInstruction& instruction, u32 address) const;
+    //Get the decoded instruction at PC. Resets PC to the first instruction if it's out of bounds.
+    const DecodedInstruction* Fetch();
+    //Fetch() for the unchecked interpreter. Unaligned instructions weren't seen by the verifier. Ones that fail it are returned with 0 cycles so the interpreter falls back to the checked path.
+    const DecodedInstruction* FetchVerified();
+    //Returns true if the static checks the unchecked interpreter skips are known to pass. Jump and call targets must be an instruction in the program and constant load/store addresses must be in bounds.
+    bool VerifyInstruction(const DecodedInstruction& instruction) const;
+    //Run VerifyInstruction() on every instruction in the program
+    bool VerifyInstructions() const;
+    //Memory access used by the interpreter once it's done its own checks. The public versions check again and throw.
+    VmValue LoadUnchecked(VmValue address) const { return *(VmValue*)(&Memory[(VmAddress)address]); }
+    void StoreUnchecked(VmValue address, VmValue value);
+    void PushUnchecked(VmValue value) { SP -= sizeof(VmValue); StoreUnchecked(SP, value); }
+    VmValue PopUnchecked() { const VmValue value = LoadUnchecked(SP); SP += sizeof(VmValue); return value; }
+    //Re-decode instructions overlapping [address, address + size). Called when a store writes to the instruction block.
+    void RedecodeInstructions(u32 address, u32 size);
+    //Fuse common instruction pairs in decodedInstructions[first, last] into superinstructions. Pairs that no longer match are unfused. instructions is the raw instruction block.
+    void FuseInstructions(std::vector<DecodedInstruction>& decodedInstructions, const Instruction* instructions, u32 first, u32 last) const;
+    //Decode the instructions in memory without fusing them
+    std::vector<DecodedInstruction> DecodeInstructions() const;
+    //Use the decoded instructions and native code of the program image
+    void UseProgramInstructions();
+    //Decode the instructions in memory into a copy owned by this VM, generate native code for them, then fuse superinstructions. Used when memory doesn't match the program image.
+    void DecodeProgram();
+    u32 ProgramImageSize() const { return _program ? (u32)_program->Memory.size() : 0; }
+    //Run native code until cycleBudget cycles have elapsed. Hands off to the interpreter for errors and instructions the JIT doesn't handle.
+    VMStatus RunJit(u32& cycleBudget, f32 deltaTime, u32 portStopBudget);
+    //Let up to cycleBudget cycles pass while suspended by wait or hlt. Returns the number of cycles that passed.
+    u32 Sleep(u32 cycleBudget);
+    //True if an interrupt is pending and no handler is running
+    bool InterruptReady() const { return _pendingInterrupts != 0 && !_inInterrupt; }
+    //Jump to the handler of the lowest pending interrupt. Pushes PC then the flags for iret to restore. Only call when InterruptReady() is true.
+    VMStatus DispatchInterrupt();
+    //Called by JIT generated code for port instructions. Return JitPortResult::Stopped without accessing the port if the JIT should stop before it.
+    static JitPortResult JitPortRead(VM* vm, const DecodedInstruction* instruction, u32 cycleBudget);
+    static JitPortResult JitPortWrite(VM* vm, const DecodedInstruction* instruction, u32 cycleBudget);
 
     u32 _instructionsSizeBytes = 0; //The number of bytes that the program takes up in memory
     u32 _variablesSizeBytes = 0; //The number of bytes that variables take up in memory
+    u32 _memorySizeBytes = 0; //The number of bytes that Memory points to
+    std::unique_ptr<u8[]> _memory = nullptr;
+    //The loaded program. Snapshots only store the memory that differs from its initial memory.
+    std::shared_ptr<const ProgramImage> _program = nullptr;
+
+    //Decoded copy of each instruction in the instruction block. Shared with the program image until the program modifies its instructions. Kept in sync by Store().
+    std::shared_ptr<std::vector<DecodedInstruction>> _decodedInstructions = nullptr;
+    //Used when PC isn't on an instruction boundary and the instruction must be decoded from memory
+    DecodedInstruction _unalignedInstruction = {};
+    //Set when the program passes VerifyInstructions(). Cleared if the program modifies itself into something that doesn't.
+    bool _verified = false;
 
     //Current instruction being executed by the VM. Used for instructions that take > 1 cycle to execute.
-    Instruction* _instruction = nullptr;
+    const DecodedInstruction* _instruction = nullptr;
     u32 _instructionCyclesRemaining = 0;
+    //Cycles left until a wait instruction finishes. WAIT_HALTED after hlt.
+    u32 _waitCyclesRemaining = 0;
+    //Interrupts raised but not dispatched yet. Bit i is set for Interrupt i.
+    u16 _pendingInterrupts = 0;
+    static_assert((size_t)Interrupt::NumInterrupts <= 16, "VM::_pendingInterrupts needs more bits");
+    bool _inInterrupt = false; //Set while an interrupt handler runs. Cleared by iret.
+
+    //Instruction replaced with Opcode::Break by PatchBreakpoints()
+    struct BreakPatch
+    {
+        u32 Index; //Index in the decoded instructions
+        DecodedInstruction Original; //Never a superinstruction. The handlers of those read the next instruction from the decoded instructions.
+    };
+    std::vector<Breakpoint> _breakpoints = {};
+    std::vector<u16> _watchpoints = {};
+    std::vector<BreakPatch> _breakPatches = {}; //Indexed by DecodedInstruction::Value of the Break instructions
+    u32 _breakpointResume = 0; //Address of the instruction the VM last stopped at. It runs without stopping again when execution resumes. 0 if there isn't one.
+
+    //Port handlers set by SetPortHandlers(). Ports do nothing until then.
+    static const PortHandlers DefaultPortHandlers;
+    const PortHandlers* _portHandlers = &VM::DefaultPortHandlers;
+    void* _portContext = nullptr;
+
+    //Native code for the loaded program. Usually shared with the program image. Null if the JIT isn't in use. Discarded if the program modifies its instructions.
+    std::shared_ptr<JitProgram> _jit = nullptr;
+    f32 _deltaTime = 0.0f; //deltaTime of the current RunJit() call. Passed to port callbacks by JIT generated code.
+    u32 _portStopBudget = 0; //portStopBudget of the current RunJit() call
+
+    //Execution counters. Null unless the profiler is enabled.
+    std::unique_ptr<VmProfile> _profile = nullptr;
+    //Execution trace. Null unless the trace is enabled.
+    std::unique_ptr<VmTrace> _trace = nullptr;
+    bool _traceRecordPending = false; //The newest trace record hasn't been finished by FinishTraceRecord() yet
+    u64 _traceCycleEnd = 0; //VmTrace::Cycles once the current Run() call ends. Records are stamped with this minus the cycle budget left.
 
 public:
-    //The number of cycles it takes to execute each instruction
-    const std::unordered_map<Opcode, u32> InstructionDurations =
+    //The number of cycles it takes to execute each instruction. Indexed by Opcode. Shared by all VMs.
+    static constexpr u8 InstructionDurations[] =
     {
-        { Opcode::Mov,    1 },
-        { Opcode::MovVal, 1 },
-        { Opcode::Add,    1 },
-        { Opcode::AddVal, 1 },
-        { Opcode::Sub,    1 },
-        { Opcode::SubVal, 1 },
-        { Opcode::Mul,    2 },
-        { Opcode::MulVal, 2 },
-        { Opcode::Div,    2 },
-        { Opcode::DivVal, 2 },
-        { Opcode::Mod,    10},
-        { Opcode::ModVal, 10},
-        { Opcode::Cmp,    1 },
-        { Opcode::CmpVal, 1 },
-        { Opcode::Jmp,    1 },
-        { Opcode::Jeq,    1 },
-        { Opcode::Jne,    1 },
-        { Opcode::Jgr,    1 },
-        { Opcode::Jls,    1 },
-        { Opcode::Call,   1 },
-        { Opcode::Ret,    1 },
-        { Opcode::And,    1 },
-        { Opcode::AndVal, 1 },
-        { Opcode::Or,     1 },
-        { Opcode::OrVal,  1 },
-        { Opcode::Xor,    1 },
-        { Opcode::XorVal, 1 },
-        { Opcode::Neg,    1 },
-        { Opcode::Load,   4 },
-        { Opcode::LoadP,  4 },
-        { Opcode::Store,  4 },
-        { Opcode::StoreP, 4 },
-        { Opcode::Push,   1 },
-        { Opcode::Pop,    1 },
+        1,  //Mov
+        1,  //MovVal
+        1,  //Add
+        1,  //AddVal
+        1,  //Sub
+        1,  //SubVal
+        2,  //Mul
+        2,  //MulVal
+        2,  //Div
+        2,  //DivVal
+        1,  //Cmp
+        1,  //CmpVal
+        1,  //Jmp
+        1,  //Jeq
+        1,  //Jne
+        1,  //Jgr
+        1,  //Jls
+        1,  //Call
+        1,  //Ret
+        1,  //And
+        1,  //AndVal
+        1,  //Or
+        1,  //OrVal
+        1,  //Xor
+        1,  //XorVal
+        1,  //Neg
+        4,  //Load
+        4,  //LoadP
+        4,  //Store
+        4,  //StoreP
+        1,  //Push
+        1,  //Pop
         //Note: ipo and both variants of opo ignore this and instead use PortDurations
-        { Opcode::Ipo,    1 },
-        { Opcode::Opo,    1 },
-        { Opcode::OpoVal, 1 },
-        { Opcode::Nop,    1 },
+        1,  //Ipo
+        1,  //Opo
+        1,  //OpoVal
+        1,  //Nop
+        10, //Mod
+        10, //ModVal
+        1,  //Wait
+        1,  //WaitVal
+        1,  //Hlt
+        1,  //Iret
     };
+    static_assert(std::size(InstructionDurations) == (size_t)Opcode::Iret + 1, "VM::InstructionDurations must have an entry for each opcode");
 
-    //The number of cycles it takes to read/write from each port.
-    const std::unordered_map<Port, u32> PortDurations =
+    //The number of cycles it takes to read/write from each port. Indexed by Port. Shared by all VMs.
+    static constexpr u8 PortDurations[] =
     {
-        { Port::Spedometer,           1 },
-        { Port::Heat,                 1 },
-        { Port::Compass,              1 },
-        { Port::Steering,             1 },
-        { Port::TurretShoot,          1 },
-        { Port::TurretRotateOffset,   1 },
-        { Port::TurretRotateAbsolute, 1 },
-        { Port::MineLayer,            1 },
-        { Port::MineTrigger,          1 },
-        { Port::Sonar,                1 },
-        { Port::Radar,                3 },
-        { Port::Scanner,              1 },
-        { Port::ScannerArc,           1 },
-        { Port::Throttle,             1 },
-        { Port::Heat,                 1 },
-        { Port::Compass,              1 },
-        { Port::Armor,                1 },
-        { Port::Random,               1 },
-        { Port::Shield,               1 },
-        { Port::Accuracy,             1 },
+        1, //Spedometer
+        1, //Steering
+        1, //TurretShoot
+        1, //TurretRotateOffset
+        1, //TurretRotateAbsolute
+        1, //MineLayer
+        1, //MineTrigger
+        1, //Sonar
+        3, //Radar
+        1, //Scanner
+        1, //ScannerArc
+        1, //Throttle
+        1, //Heat
+        1, //Compass
+        1, //Armor
+        1, //Random
+        1, //Shield
+        1, //Accuracy
     };
+    static_assert(std::size(PortDurations) == (size_t)Port::NumPorts, "VM::PortDurations must have an entry for each port");
 };
 
-enum VMErrorCode
+//Execution counters collected while VM::EnableProfiler() is on
+struct VmProfile
 {
-    DivideByZero,
-    OutOfBoundsMemoryAccess,
-    StackUnderflow,
-    StackOverflow,
-    UnsupportedInstruction,
-    ProgramFileLoadFailure,
+    //Counters for one instruction in the instruction block
+    struct InstructionCounters
+    {
+        u64 Executions = 0;
+        u64 Cycles = 0; //Cycles spent running the instruction. Doesn't include time spent suspended by wait or hlt.
+        u64 PortAccesses = 0; //Reads and writes by ipo and opo
+    };
+    //Counters for one port
+    struct PortCounters
+    {
+        u64 Reads = 0;
+        u64 Writes = 0;
+        u64 Cycles = 0; //Cycles spent by ipo and opo accessing the port
+    };
+
+    //One per instruction. Indexed by (address - VM::RESERVED_BYTES) / sizeof(Instruction). Unaligned instructions are counted on the instruction they start in.
+    std::vector<InstructionCounters> Instructions = {};
+    PortCounters Ports[(size_t)Port::NumPorts] = {}; //Indexed by Port
+    u64 Cycles = 0; //Total cycles spent running instructions
+    u64 SuspendedCycles = 0; //Total cycles spent suspended by wait or hlt
 };
 
-//Returned when the VM encounters an error
-struct VMError
+//Execution state of a VM. Saved by VM::Snapshot() and loaded by VM::Restore().
+struct VmSnapshot
 {
-    VMErrorCode Code;
-    std::string Message;
+    Register Registers[VM::NUM_REGISTERS] = { 0 };
+    Register PC = 0;
+    Register SP = 0;
+    bool FlagZero = false;
+    bool FlagSign = false;
+    bool InstructionPending = false; //An instruction at PC was started but needs more cycles to finish
+    u32 InstructionCyclesRemaining = 0;
+    u32 WaitCyclesRemaining = 0;
+    u16 PendingInterrupts = 0;
+    bool InInterrupt = false;
+    u32 MemorySize = 0; //Must match the VM it's restored to
+    u32 ProgramImageSize = 0; //Must match the VM it's restored to
+    std::vector<u8> MemoryDelta = {}; //Runs of memory that differ from the program image. Each is a u16 address and u16 size followed by the bytes.
 };
 
 static std::string to_string(VMErrorCode value)
@@ -0,0 +1,551 @@
+#include "VmBatch.h"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+
+/*Lane vector operations. Each lane holds a register, PC, etc of one VM. Masks have all bits set in lanes where they're true.*/
+#if defined(__AVX2__)
+#include <immintrin.h>
+using LaneVector = __m256i;
+static constexpr u32 VECTOR_LANES = sizeof(LaneVector) / sizeof(VmValue);
+static LaneVector VecLoad(const VmValue* src) { return _mm256_loadu_si256((const __m256i*)src); }
+static void VecStore(VmValue* dst, LaneVector value) { _mm256_storeu_si256((__m256i*)dst, value); }
+#ifdef VM_WORD_32
+static LaneVector VecSet(VmValue value) { return _mm256_set1_epi32(value); }
+static LaneVector VecAdd(LaneVector a, LaneVector b) { return _mm256_add_epi32(a, b); }
+static LaneVector VecSub(LaneVector a, LaneVector b) { return _mm256_sub_epi32(a, b); }
+static LaneVector VecMul(LaneVector a, LaneVector b) { return _mm256_mullo_epi32(a, b); }
+static LaneVector VecEqual(LaneVector a, LaneVector b) { return _mm256_cmpeq_epi32(a, b); }
+static LaneVector VecGreater(LaneVector a, LaneVector b) { return _mm256_cmpgt_epi32(a, b); }
+static LaneVector VecMin(LaneVector a, LaneVector b) { return _mm256_min_epi32(a, b); }
+#else
+static LaneVector VecSet(VmValue value) { return _mm256_set1_epi16(value); }
+static LaneVector VecAdd(LaneVector a, LaneVector b) { return _mm256_add_epi16(a, b); }
+static LaneVector VecSub(LaneVector a, LaneVector b) { return _mm256_sub_epi16(a, b); }
+static LaneVector VecMul(LaneVector a, LaneVector b) { return _mm256_mullo_epi16(a, b); }
+static LaneVector VecEqual(LaneVector a, LaneVector b) { return _mm256_cmpeq_epi16(a, b); }
+static LaneVector VecGreater(LaneVector a, LaneVector b) { return _mm256_cmpgt_epi16(a, b); }
+static LaneVector VecMin(LaneVector a, LaneVector b) { return _mm256_min_epi16(a, b); }
+#endif
+static LaneVector VecAnd(LaneVector a, LaneVector b) { return _mm256_and_si256(a, b); }
+static LaneVector VecOr(LaneVector a, LaneVector b) { return _mm256_or_si256(a, b); }
+static LaneVector VecXor(LaneVector a, LaneVector b) { return _mm256_xor_si256(a, b); }
+static LaneVector VecSelect(LaneVector mask, LaneVector a, LaneVector b) { return _mm256_blendv_epi8(b, a, mask); }
+static bool VecAny(LaneVector mask) { return _mm256_movemask_epi8(mask) != 0; }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+using LaneVector = __m128i;
+static constexpr u32 VECTOR_LANES = sizeof(LaneVector) / sizeof(VmValue);
+static LaneVector VecLoad(const VmValue* src) { return _mm_loadu_si128((const __m128i*)src); }
+static void VecStore(VmValue* dst, LaneVector value) { _mm_storeu_si128((__m128i*)dst, value); }
+static LaneVector VecAnd(LaneVector a, LaneVector b) { return _mm_and_si128(a, b); }
+static LaneVector VecOr(LaneVector a, LaneVector b) { return _mm_or_si128(a, b); }
+static LaneVector VecXor(LaneVector a, LaneVector b) { return _mm_xor_si128(a, b); }
+static LaneVector VecSelect(LaneVector mask, LaneVector a, LaneVector b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+static bool VecAny(LaneVector mask) { return _mm_movemask_epi8(mask) != 0; }
+#ifdef VM_WORD_32
+static LaneVector VecSet(VmValue value) { return _mm_set1_epi32(value); }
+static LaneVector VecAdd(LaneVector a, LaneVector b) { return _mm_add_epi32(a, b); }
+static LaneVector VecSub(LaneVector a, LaneVector b) { return _mm_sub_epi32(a, b); }
+static LaneVector VecEqual(LaneVector a, LaneVector b) { return _mm_cmpeq_epi32(a, b); }
+static LaneVector VecGreater(LaneVector a, LaneVector b) { return _mm_cmpgt_epi32(a, b); }
+static LaneVector VecMin(LaneVector a, LaneVector b) { return VecSelect(VecGreater(a, b), b, a); } //SSE2 has no 32 bit min
+static LaneVector VecMul(LaneVector a, LaneVector b)
+{
+    //SSE2 has no 32 bit mullo. Multiply the even and odd lanes separately then interleave the low halves of the 64 bit products.
+    const LaneVector even = _mm_mul_epu32(a, b);
+    const LaneVector odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#else
+static LaneVector VecSet(VmValue value) { return _mm_set1_epi16(value); }
+static LaneVector VecAdd(LaneVector a, LaneVector b) { return _mm_add_epi16(a, b); }
+static LaneVector VecSub(LaneVector a, LaneVector b) { return _mm_sub_epi16(a, b); }
+static LaneVector VecMul(LaneVector a, LaneVector b) { return _mm_mullo_epi16(a, b); }
+static LaneVector VecEqual(LaneVector a, LaneVector b) { return _mm_cmpeq_epi16(a, b); }
+static LaneVector VecGreater(LaneVector a, LaneVector b) { return _mm_cmpgt_epi16(a, b); }
+static LaneVector VecMin(LaneVector a, LaneVector b) { return _mm_min_epi16(a, b); }
+#endif
+#else
+//No SIMD support. Runs one lane at a time.
+using LaneVector = VmValue;
+static constexpr u32 VECTOR_LANES = 1;
+static LaneVector VecLoad(const VmValue* src) { return *src; }
+static void VecStore(VmValue* dst, LaneVector value) { *dst = value; }
+static LaneVector VecSet(VmValue value) { return value; }
+static LaneVector VecAdd(LaneVector a, LaneVector b) { return (VmValue)((VmWide)a + b); }
+static LaneVector VecSub(LaneVector a, LaneVector b) { return (VmValue)((VmWide)a - b); }
+static LaneVector VecMul(LaneVector a, LaneVector b) { return (VmValue)((VmWide)a * b); }
+static LaneVector VecAnd(LaneVector a, LaneVector b) { return a & b; }
+static LaneVector VecOr(LaneVector a, LaneVector b) { return a | b; }
+static LaneVector VecXor(LaneVector a, LaneVector b) { return a ^ b; }
+static LaneVector VecEqual(LaneVector a, LaneVector b) { return a == b ? -1 : 0; }
+static LaneVector VecGreater(LaneVector a, LaneVector b) { return a > b ? -1 : 0; }
+static LaneVector VecMin(LaneVector a, LaneVector b) { return std::min(a, b); }
+static LaneVector VecSelect(LaneVector mask, LaneVector a, LaneVector b) { return mask ? a : b; }
+static bool VecAny(LaneVector mask) { return mask != 0; }
+#endif
+
+//How the batch runs an instruction
+enum class LaneExecution
+{
+    Vector, //All lanes at once with vector instructions
+    Lane,   //One lane at a time by VmBatch::ExecuteLane()
+    Alone,  //One lane at a time by its VM
+};
+
+static LaneExecution GetLaneExecution(const DecodedInstruction& instruction, u32 minMemorySize)
+{
+    switch (instruction.Opcode)
+    {
+    case Opcode::Mov: case Opcode::MovVal:
+    case Opcode::Add: case Opcode::AddVal:
+    case Opcode::Sub: case Opcode::SubVal:
+    case Opcode::Mul: case Opcode::MulVal:
+    case Opcode::And: case Opcode::AndVal:
+    case Opcode::Or: case Opcode::OrVal:
+    case Opcode::Xor: case Opcode::XorVal:
+    case Opcode::Neg:
+    case Opcode::Cmp: case Opcode::CmpVal:
+    case Opcode::Jeq: case Opcode::Jne: case Opcode::Jgr: case Opcode::Jls:
+    case Opcode::Nop:
+        return LaneExecution::Vector;
+    case Opcode::Jmp:
+        //Let each VM handle out of bounds jumps since memory size can vary
+        return (u16)instruction.Value < minMemorySize ? LaneExecution::Vector : LaneExecution::Alone;
+    case Opcode::Div: case Opcode::DivVal:
+    case Opcode::Mod: case Opcode::ModVal:
+    case Opcode::Load: case Opcode::LoadP:
+    case Opcode::Store: case Opcode::StoreP:
+    case Opcode::Push: case Opcode::Pop:
+    case Opcode::Call: case Opcode::Ret:
+    case Opcode::Ipo: case Opcode::Opo: case Opcode::OpoVal:
+        return LaneExecution::Lane;
+    default: //Unsupported instructions
+        return LaneExecution::Alone;
+    }
+}
+
+bool VmBatch::Add(VM* vm)
+{
+    if (_vms.empty())
+    {
+        //Decode the program. Not taken from VM::_decodedInstructions since it has superinstructions.
+        _instructions.clear();
+        for (const Instruction& instruction : vm->Instructions())
+            _instructions.push_back(vm->Decode(instruction));
+
+        _instructionsEnd = VM::RESERVED_BYTES + vm->InstructionsSize();
+        _programEnd = _instructionsEnd + vm->VariablesSize();
+        _minMemorySize = vm->MemorySize();
+    }
+    else
+    {
+        const VM* first = _vms[0];
+        if (vm->InstructionsSize() != first->InstructionsSize() || vm->VariablesSize() != first->VariablesSize() ||
+            memcmp(vm->Memory + VM::RESERVED_BYTES, first->Memory + VM::RESERVED_BYTES, vm->InstructionsSize()) != 0)
+            return false;
+
+        _minMemorySize = std::min(_minMemorySize, vm->MemorySize());
+    }
+
+    _vms.push_back(vm);
+    _errors.push_back({});
+    _modifiedProgram.push_back(false);
+
+    //Pad lanes to a multiple of the vector width
+    _numLanes = (((u32)_vms.size() + VECTOR_LANES - 1) / VECTOR_LANES) * VECTOR_LANES;
+    _registers.resize(VM::NUM_REGISTERS * _numLanes);
+    _pc.resize(_numLanes);
+    _sp.resize(_numLanes);
+    _flagZero.resize(_numLanes);
+    _flagSign.resize(_numLanes);
+    _budget.resize(_numLanes);
+    _mask.resize(_numLanes);
+    return true;
+}
+
+void VmBatch::Clear()
+{
+    _vms.clear();
+    _errors.clear();
+    _modifiedProgram.clear();
+    _instructions.clear();
+    _numLanes = 0;
+}
+
+void VmBatch::Run(u32 cycleBudget, f32 deltaTime)
+{
+    std::fill(_errors.begin(), _errors.end(), VMStatus{});
+    while (cycleBudget > 0)
+    {
+        const u32 chunk = std::min(cycleBudget, VmBatch::MAX_CHUNK_CYCLES);
+        RunChunk(chunk, deltaTime);
+        cycleBudget -= chunk;
+    }
+}
+
+void VmBatch::RunChunk(u32 cycleBudget, f32 deltaTime)
+{
+    //Copy VM state into lanes
+    std::fill(_budget.begin(), _budget.end(), 0);
+    for (u32 lane = 0; lane < _vms.size(); lane++)
+    {
+        VM& vm = *_vms[lane];
+        if (!_errors[lane].Ok || _errors[lane].Breakpoint) //Stopped by an error or breakpoint earlier in the Run() call
+        {
+            LoadLane(lane);
+            continue;
+        }
+
+        u32 budget = cycleBudget;
+        //Profiled and traced VMs run alone so every instruction is recorded. VMs with breakpoints need the patched instructions only they have.
+        const bool alone = _modifiedProgram[lane] || vm.Instrumented() || vm.HasBreakpoints();
+        if (vm.InterruptReady() && !vm._instruction && !alone) //Raised since the last call. Same as VM::Run().
+        {
+            VMStatus status = vm.DispatchInterrupt();
+            if (!status.Ok)
+            {
+                _errors[lane] = status;
+                budget = 0;
+            }
+        }
+
+        if (alone) //Program doesn't match the other lanes anymore or the VM is instrumented
+        {
+            VMStatus status = vm.Run(budget, deltaTime, false);
+            if (!status.Ok || status.Breakpoint)
+                _errors[lane] = status;
+
+            budget = 0;
+        }
+        else if (vm.Suspended()) //Sleep through wait or hlt
+        {
+            budget -= vm.Sleep(budget);
+        }
+        else if (vm._instruction) //Finish the instruction in progress
+        {
+            const u32 cycles = std::min(vm._instructionCyclesRemaining, budget);
+            VMStatus status = vm.Run(cycles, deltaTime, false);
+            budget -= cycles;
+            if (!status.Ok)
+            {
+                _errors[lane] = status;
+                budget = 0;
+            }
+        }
+
+        _budget[lane] = (VmValue)budget;
+        LoadLane(lane);
+    }
+
+    //Run the lanes at the lowest PC until every lane is out of cycles. No lane is at NO_PC so the first step only finds the lowest PC.
+    u32 pc = Step(VmBatch::NO_PC, deltaTime);
+    while (pc != VmBatch::NO_PC)
+        pc = Step(pc, deltaTime);
+
+    //Copy lane state back into the VMs
+    for (u32 lane = 0; lane < _vms.size(); lane++)
+        StoreLane(lane);
+}
+
+u32 VmBatch::Step(u32 pc, f32 deltaTime)
+{
+    //Lanes in the middle of an instruction are left to their VM
+    const u32 offset = pc - VM::RESERVED_BYTES;
+    const u32 index = offset / sizeof(Instruction);
+    const DecodedInstruction* instruction = offset % sizeof(Instruction) == 0 && index < _instructions.size() ? &_instructions[index] : nullptr;
+    const LaneExecution execution = instruction && instruction->Cycles != 0 ? GetLaneExecution(*instruction, _minMemorySize) : LaneExecution::Alone;
+
+    const LaneVector zero = VecSet(0);
+    const LaneVector groupPC = VecSet((VmValue)pc);
+    const LaneVector programStart = VecSet(VM::RESERVED_BYTES);
+    const LaneVector programLast = VecSet((VmValue)(_instructionsEnd - 1));
+    const LaneVector noPC = VecSet(VmBatch::NO_PC);
+    LaneVector minPC = noPC;
+    for (u32 i = 0; i < _numLanes; i += VECTOR_LANES)
+    {
+        const LaneVector pcs = VecLoad(&_pc[i]);
+        const LaneVector budget = VecLoad(&_budget[i]);
+        const LaneVector group = VecAnd(VecEqual(pcs, groupPC), VecGreater(budget, zero));
+        if (!VecAny(group))
+        {
+            minPC = VecMin(minPC, VecSelect(VecGreater(budget, zero), pcs, noPC));
+            continue;
+        }
+
+        LaneVector ready = zero;
+        if (execution == LaneExecution::Vector)
+        {
+            //Lanes without enough cycles left are left for their VM to finish next call
+            ready = VecAnd(group, VecGreater(budget, VecSet(instruction->Cycles - 1)));
+            if (VecAny(ready))
+            {
+                VmValue* regA = &LaneRegister(instruction->RegA, i);
+                VmValue* flagZero = &_flagZero[i];
+                VmValue* flagSign = &_flagSign[i];
+                const LaneVector a = VecLoad(regA);
+                const LaneVector b = VecLoad(&LaneRegister(instruction->RegB, i));
+                const LaneVector value = VecSet(instruction->Value);
+                LaneVector result = a;
+                LaneVector flagsResult = a;
+                bool setFlags = false;
+                LaneVector next = VecAdd(pcs, VecSet(sizeof(Instruction)));
+                switch (instruction->Opcode)
+                {
+                case Opcode::Mov:    result = b; break;
+                case Opcode::MovVal: result = value; break;
+                case Opcode::Add:    result = flagsResult = VecAdd(a, b); setFlags = true; break;
+                case Opcode::AddVal: result = flagsResult = VecAdd(a, value); setFlags = true; break;
+                case Opcode::Sub:    result = flagsResult = VecSub(a, b); setFlags = true; break;
+                case Opcode::SubVal: result = flagsResult = VecSub(a, value); setFlags = true; break;
+                case Opcode::Mul:    result = flagsResult = VecMul(a, b); setFlags = true; break;
+                case Opcode::MulVal: result = flagsResult = VecMul(a, value); setFlags = true; break;
+                case Opcode::And:    result = VecAnd(a, b); break;
+                case Opcode::AndVal: result = VecAnd(a, value); break;
+                case Opcode::Or:     result = VecOr(a, b); break;
+                case Opcode::OrVal:  result = VecOr(a, value); break;
+                case Opcode::Xor:    result = VecXor(a, b); break;
+                case Opcode::XorVal: result = VecXor(a, value); break;
+                case Opcode::Neg:    result = VecSub(zero, a); break;
+                case Opcode::Cmp:    flagsResult = VecSub(a, b); setFlags = true; break;
+                case Opcode::CmpVal: flagsResult = VecSub(a, value); setFlags = true; break;
+                case Opcode::Jmp:    next = value; break;
+                case Opcode::Jeq:    next = VecSelect(VecLoad(flagZero), value, next); break;
+                case Opcode::Jne:    next = VecSelect(VecLoad(flagZero), next, value); break;
+                case Opcode::Jgr:    next = VecSelect(VecOr(VecLoad(flagZero), VecLoad(flagSign)), next, value); break;
+                case Opcode::Jls:    next = VecSelect(VecLoad(flagSign), value, next); break;
+                default: break;
+                }
+                if (setFlags)
+                {
+                    VecStore(flagZero, VecSelect(ready, VecEqual(flagsResult, zero), VecLoad(flagZero)));
+                    VecStore(flagSign, VecSelect(ready, VecGreater(zero, flagsResult), VecLoad(flagSign)));
+                }
+
+                //Reset PC to the first instruction if it left the instruction block. Same as VM::Fetch(), so it's only done for lanes that have cycles left to fetch another instruction.
+                const LaneVector budgetLeft = VecSub(budget, VecSet(instruction->Cycles));
+                const LaneVector outside = VecAnd(VecGreater(budgetLeft, zero), VecOr(VecGreater(programStart, next), VecGreater(next, programLast)));
+                next = VecSelect(outside, programStart, next);
+
+                VecStore(regA, VecSelect(ready, result, a));
+                VecStore(&_pc[i], VecSelect(ready, next, pcs));
+                VecStore(&_budget[i], VecSelect(ready, budgetLeft, budget));
+            }
+        }
+
+        //Run the rest of the lanes one at a time
+        const LaneVector single = VecXor(group, ready);
+        if (VecAny(single))
+        {
+            VecStore(&_mask[i], single);
+            for (u32 lane = i; lane < i + VECTOR_LANES; lane++)
+            {
+                if (!_mask[lane])
+                    continue;
+                if (execution == LaneExecution::Lane && _budget[lane] >= instruction->Cycles && ExecuteLane(*instruction, lane, deltaTime))
+                    continue;
+
+                RunLane(lane, deltaTime);
+            }
+        }
+
+        //Find the PC to run next while the lanes are at hand
+        minPC = VecMin(minPC, VecSelect(VecGreater(VecLoad(&_budget[i]), zero), VecLoad(&_pc[i]), noPC));
+    }
+
+    VmValue minPCs[VECTOR_LANES];
+    VecStore(minPCs, minPC);
+    return (u32)*std::min_element(std::begin(minPCs), std::end(minPCs));
+}
+
+bool VmBatch::ExecuteLane(const DecodedInstruction& instruction, u32 lane, f32 deltaTime)
+{
+    VM& vm = *_vms[lane];
+    const u32 lastAddress = vm.MemorySize() - sizeof(VmValue); //Highest address a value can be read from
+    VmValue& regA = LaneRegister(instruction.RegA, lane);
+    const VmValue regB = LaneRegister(instruction.RegB, lane);
+    u32 sp = (VmAddress)_sp[lane];
+    Register pc = (Register)(_pc[lane] + sizeof(Instruction));
+    std::optional<VmValue> flagsResult = {};
+    switch (instruction.Opcode)
+    {
+    case Opcode::Div:
+        if (regB == 0)
+            return false;
+        regA = (VmValue)((VmWide)regA / regB); //Wide so the min value / -1 doesn't fault
+        flagsResult = regA;
+        break;
+    case Opcode::DivVal:
+        if (instruction.Value == 0)
+            return false;
+        regA = (VmValue)((VmWide)regA / instruction.Value);
+        flagsResult = regA;
+        break;
+    case Opcode::Mod:
+        if (regB == 0)
+            return false;
+        regA = (VmValue)((VmWide)regA % regB);
+        break;
+    case Opcode::ModVal:
+        if (instruction.Value == 0)
+            return false;
+        regA = (VmValue)((VmWide)regA % instruction.Value);
+        break;
+    case Opcode::Load:
+    case Opcode::LoadP:
+    {
+        const u32 address = instruction.Opcode == Opcode::Load ? (VmAddress)instruction.Value : (VmAddress)regB;
+        if (address > lastAddress)
+            return false;
+        regA = *(VmValue*)&vm.Memory[address];
+        break;
+    }
+    case Opcode::Store:
+    case Opcode::StoreP:
+    {
+        const u32 address = instruction.Opcode == Opcode::Store ? (VmAddress)instruction.Value : (VmAddress)regA;
+        const VmValue value = instruction.Opcode == Opcode::Store ? regA : regB;
+        if (address > lastAddress)
+            return false;
+        if (address < _instructionsEnd && address + sizeof(VmValue) > VM::RESERVED_BYTES)
+        {
+            //Self modifying code. The VM keeps its decoded instructions in sync. This lane can't share the batch program anymore.
+            _modifiedProgram[lane] = true;
+            return false;
+        }
+        *(VmValue*)&vm.Memory[address] = value;
+        break;
+    }
+    case Opcode::Push:
+        if (sp <= _programEnd)
+            return false;
+        sp -= sizeof(VmValue);
+        *(VmValue*)&vm.Memory[sp] = regA;
+        break;
+    case Opcode::Pop:
+        if (sp >= vm.MemorySize())
+            return false;
+        regA = *(VmValue*)&vm.Memory[sp];
+        sp += sizeof(VmValue);
+        break;
+    case Opcode::Call:
+        if (sp <= _programEnd || (u16)instruction.Value > lastAddress)
+            return false;
+        sp -= sizeof(VmValue);
+        *(VmValue*)&vm.Memory[sp] = pc;
+        pc = (u16)instruction.Value;
+        break;
+    case Opcode::Ret:
+        if (sp >= vm.MemorySize())
+            return false;
+        pc = *(VmValue*)&vm.Memory[sp];
+        sp += sizeof(VmValue);
+        break;
+    case Opcode::Ipo:
+        //Registers aren't copied back to the VM first. Handlers only need the ports in VM memory.
+        vm._portHandlers->Read[instruction.Port](vm._portContext, deltaTime);
+        regA = vm.GetPort((Port)instruction.Port);
+        break;
+    case Opcode::Opo:
+        vm._portHandlers->Write[instruction.Port](vm._portContext, regA, deltaTime);
+        break;
+    case Opcode::OpoVal:
+        vm._portHandlers->Write[instruction.Port](vm._portContext, instruction.Value, deltaTime);
+        break;
+    default:
+        return false;
+    }
+
+    if (flagsResult)
+    {
+        _flagZero[lane] = flagsResult.value() == 0 ? -1 : 0;
+        _flagSign[lane] = flagsResult.value() < 0 ? -1 : 0;
+    }
+
+    //Reset PC to the first instruction if it left the instruction block. Same as VM::Fetch().
+    _budget[lane] -= instruction.Cycles;
+    if (_budget[lane] > 0 && (pc < (Register)VM::RESERVED_BYTES || pc >= (Register)_instructionsEnd))
+        pc = VM::RESERVED_BYTES;
+
+    _pc[lane] = pc;
+    _sp[lane] = (VmValue)sp;
+
+    //Port handlers can raise interrupts. The VM dispatches them before the next instruction like its own engines do.
+    if (vm.InterruptReady())
+    {
+        StoreLane(lane);
+        const VMStatus status = vm.DispatchInterrupt();
+        if (!status.Ok)
+        {
+            _errors[lane] = status;
+            _budget[lane] = 0;
+        }
+        LoadLane(lane);
+    }
+    return true;
+}
+
+void VmBatch::RunLane(u32 lane, f32 deltaTime)
+{
+    VM& vm = *_vms[lane];
+    StoreLane(lane);
+
+    //Only give the VM enough cycles for one instruction so the lane can rejoin the others after. Lanes that modified their program run the rest of the chunk.
+    u32 budget = (u32)_budget[lane];
+    if (!_modifiedProgram[lane])
+        budget = std::min<u32>(budget, std::max<u32>(vm.Fetch()->Cycles, 1));
+
+    VMStatus status = vm.Run(budget, deltaTime, false);
+    if (!status.Ok)
+    {
+        _errors[lane] = status;
+        _budget[lane] = 0;
+    }
+    else
+    {
+        _budget[lane] -= (VmValue)status.CyclesElapsed;
+        if (_modifiedProgram[lane] && _budget[lane] > 0)
+        {
+            status = vm.Run((u32)_budget[lane], deltaTime, false);
+            if (!status.Ok)
+                _errors[lane] = status;
+
+            _budget[lane] = 0;
+        }
+        else if (vm.Suspended()) //Ran wait or hlt. Sleep here so the lane doesn't keep running.
+        {
+            _budget[lane] -= (VmValue)vm.Sleep((u32)_budget[lane]);
+        }
+    }
+
+    LoadLane(lane);
+}
+
+void VmBatch::LoadLane(u32 lane)
+{
+    const VM& vm = *_vms[lane];
+    for (u32 i = 0; i < VM::NUM_REGISTERS; i++)
+        LaneRegister(i, lane) = vm.Registers[i];
+
+    _pc[lane] = vm.PC;
+    _sp[lane] = vm.SP;
+    _flagZero[lane] = vm.FlagZero ? -1 : 0;
+    _flagSign[lane] = vm.FlagSign ? -1 : 0;
+
+    //Reset PC to the first instruction if it's out of bounds. Same as VM::Fetch().
+    if (_budget[lane] > 0 && (_pc[lane] < (Register)VM::RESERVED_BYTES || _pc[lane] >= (Register)_instructionsEnd))
+        _pc[lane] = VM::RESERVED_BYTES;
+}
+
+void VmBatch::StoreLane(u32 lane)
+{
+    VM& vm = *_vms[lane];
+    for (u32 i = 0; i < VM::NUM_REGISTERS; i++)
+        vm.Registers[i] = LaneRegister(i, lane);
+
+    vm.PC = _pc[lane];
+    vm.SP = _sp[lane];
+    vm.FlagZero = _flagZero[lane] != 0;
+    vm.FlagSign = _flagSign[lane] != 0;
+}
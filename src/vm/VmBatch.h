@@ -0,0 +1,65 @@
+#pragma once
+#include "Typedefs.h"
+#include "VM.h"
+#include <vector>
+
+//Runs many VMs with the same program loaded in lock-step. Meant for headless matches where many copies of one program run at once.
+//The registers, PC, SP, flags, and cycle budget of each VM are copied into structure of arrays form (one lane per VM) so instructions can run on many VMs at once with AVX2/SSE.
+//Each step the lanes at the lowest PC run the instruction there together. Lanes ahead of them wait, which lets lanes that took a different branch rejoin the rest.
+//Instructions that access memory, ports, or can fail run on one lane at a time. Errors are handed to the VM itself.
+//Port handlers see up to date VM memory, but the VM registers, PC, and flags are only updated when Run() returns.
+//The VMs must only be run through the batch while they're in it. Clear() and re-add them after loading a new program.
+//VMs with the profiler or trace enabled run alone on their own VM each chunk, so their profile and trace see every instruction. So do VMs with breakpoints.
+class VmBatch
+{
+public:
+    //Add a VM to the batch. Returns false if it doesn't have the same program loaded as the VMs already in the batch.
+    bool Add(VM* vm);
+    //Remove all VMs from the batch
+    void Clear();
+    size_t Size() const { return _vms.size(); }
+
+    //Run each VM for cycleBudget cycles. Same result as calling vm->Run(cycleBudget, deltaTime, false) on each VM. VMs that hit an error stop early.
+    void Run(u32 cycleBudget, f32 deltaTime);
+    //Errors hit by each VM during the last Run() call. Indexed in the order VMs were added. Entries for VMs that didn't hit an error are Ok.
+    //VMs that stopped at a breakpoint have an Ok entry with Breakpoint set. They don't run again until the next Run() call.
+    const std::vector<VMStatus>& Errors() const { return _errors; }
+
+private:
+    //Run up to MAX_CHUNK_CYCLES cycles. Lane budgets are stored as VmValue so longer runs are split up.
+    void RunChunk(u32 cycleBudget, f32 deltaTime);
+    //Run the instruction at pc on every lane with cycles left that's at pc. Returns the lowest PC of the lanes with cycles left, or NO_PC if they're all done.
+    u32 Step(u32 pc, f32 deltaTime);
+    //Run a memory, division, or port instruction on one lane. Returns false if the lane must run it with RunLane() instead. E.g. if it would cause an error.
+    bool ExecuteLane(const DecodedInstruction& instruction, u32 lane, f32 deltaTime);
+    //Run one instruction on a lane with its VM. Used for errors and anything else that can't run in lock-step.
+    void RunLane(u32 lane, f32 deltaTime);
+    //Copy VM state into its lane
+    void LoadLane(u32 lane);
+    //Copy lane state into its VM
+    void StoreLane(u32 lane);
+    VmValue& LaneRegister(u32 index, u32 lane) { return _registers[index * _numLanes + lane]; }
+
+    static constexpr u32 MAX_CHUNK_CYCLES = 0x7FFF;
+    static constexpr VmValue NO_PC = 0x7FFF; //PC of lanes that are done. Past the end of any instruction block.
+
+    std::vector<VM*> _vms = {};
+    std::vector<VMStatus> _errors = {};
+    std::vector<bool> _modifiedProgram = {}; //Lanes that modified their instructions. They run alone on their VM since their program no longer matches the batch.
+
+    //Program shared by all VMs. Decoded from the first VM added. Superinstructions aren't used since each half may take a different path in each lane.
+    std::vector<DecodedInstruction> _instructions = {};
+    u32 _instructionsEnd = 0; //Address just past the last instruction
+    u32 _programEnd = 0; //Address just past the program variables. The stack can't grow past this.
+    u32 _minMemorySize = 0; //Smallest VM memory size in the batch. Jumps past it must be checked by each VM.
+
+    //Lane state. Each array has _numLanes entries. Lanes past the last VM are padding so the arrays are a multiple of the vector width.
+    u32 _numLanes = 0;
+    std::vector<VmValue> _registers = {}; //Register r of lane i is at r * _numLanes + i
+    std::vector<VmValue> _pc = {};
+    std::vector<VmValue> _sp = {};
+    std::vector<VmValue> _flagZero = {}; //All bits set when true
+    std::vector<VmValue> _flagSign = {}; //All bits set when true
+    std::vector<VmValue> _budget = {}; //Cycles left in the current chunk. Lanes with a budget of 0 are done.
+    std::vector<VmValue> _mask = {}; //Scratch space used to find which lanes in a vector must run on their own
+};
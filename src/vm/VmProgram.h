@@ -7,10 +7,11 @@
 //The beginning of any AT Robots program
 struct ProgramHeader
 {
-    u32 Signature; //ASCII "ATRB"
+    u32 Signature; //ASCII "ATR2". Files written before WordSize was added use "ATRB".
     u32 ProgramSize; //Size of the entire program binary file
     u32 InstructionsSize; //Size of the instruction block
     u32 VariablesSize; //Size of the variable block
+    u32 WordSize; //sizeof(VmValue) in the build that compiled the program. See VM_WORD_32.
 };
 
 //Config vars defined in the program. Can be used to determine robot hardware stats
@@ -33,7 +34,8 @@ struct VmProgram
     const std::vector<VmValue> Variables;
     const std::vector<VmConfig> Config;
 
-    static const u32 EXPECTED_SIGNATURE = ('A' << 0) | ('T' << 8) | ('R' << 16) | ('B' << 24); //ASCII "ATRB"
+    static const u32 EXPECTED_SIGNATURE = ('A' << 0) | ('T' << 8) | ('R' << 16) | ('2' << 24); //ASCII "ATR2"
+    static const u32 OLD_SIGNATURE = ('A' << 0) | ('T' << 8) | ('R' << 16) | ('B' << 24); //ASCII "ATRB". Header without WordSize. Rejected since it has a different layout.
 
     //Write to file
     void Write(std::string_view outputFilePath)
@@ -84,8 +86,12 @@ struct VmProgram
         in.read((char*)&header, sizeof(ProgramHeader));
         
         //Validate header
+        if (header.Signature == VmProgram::OLD_SIGNATURE)
+            return Error(std::string("Error loading VM program from a file. It uses an old program format. Recompile it from source."));
         if (header.Signature != VmProgram::EXPECTED_SIGNATURE)
             return Error("Error loading VM program from a file. Invalid header signature. Expected " + std::to_string(VmProgram::EXPECTED_SIGNATURE) + ", detected " + std::to_string(header.Signature));
+        if (header.WordSize != sizeof(VmValue))
+            return Error("Error loading VM program from a file. It was compiled for " + std::to_string(header.WordSize * 8) + " bit VM words. This build uses " + std::to_string(sizeof(VmValue) * 8) + " bit words.");
 
         //Reserve enough space for each data block
         instructions.resize(header.InstructionsSize / sizeof(Instruction));
@@ -107,7 +113,7 @@ struct VmProgram
             VmConfig& configVal = config.emplace_back();
 
             //Read value
-            in.read((char*)configVal.Value, sizeof(VmValue));
+            in.read((char*)&configVal.Value, sizeof(VmValue));
 
             //Read name as null terminated string
             char c;
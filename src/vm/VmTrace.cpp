@@ -0,0 +1,67 @@
+#include "VmTrace.h"
+#include "Grammar.h"
+#include <fstream>
+
+void VmTrace::Write(std::string_view outputFilePath) const
+{
+    //Open output file. Opened with truncate so all existing data is wiped.
+    std::ofstream out(std::string(outputFilePath), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+
+    //Write header
+    VmTraceHeader header = { VmTrace::EXPECTED_SIGNATURE, sizeof(VmTraceRecord), Records.size(), Written, Cycles };
+    out.write((char*)&header, sizeof(VmTraceHeader));
+
+    //Write the ring buffer as is. Read() restores it the same way.
+    out.write((char*)Records.data(), Records.size() * sizeof(VmTraceRecord));
+}
+
+Result<VmTrace, std::string> VmTrace::Read(std::string_view inputFilePath)
+{
+    //Open file
+    std::ifstream in(std::string(inputFilePath), std::ifstream::in | std::ifstream::binary);
+    if (!in.is_open())
+        return Error("Error loading VM trace. Failed to open \"" + std::string(inputFilePath) + "\"");
+
+    //Read and validate header
+    VmTraceHeader header = {};
+    in.read((char*)&header, sizeof(VmTraceHeader));
+    if (header.Signature != VmTrace::EXPECTED_SIGNATURE)
+        return Error("Error loading VM trace. Invalid header signature. Expected " + std::to_string(VmTrace::EXPECTED_SIGNATURE) + ", detected " + std::to_string(header.Signature));
+    if (header.RecordSize != sizeof(VmTraceRecord))
+        return Error("Error loading VM trace. Expected " + std::to_string(sizeof(VmTraceRecord)) + " byte records, detected " + std::to_string(header.RecordSize));
+
+    //Read records
+    VmTrace trace;
+    trace.Records.resize(header.Capacity);
+    trace.Written = header.Written;
+    trace.Cycles = header.Cycles;
+    in.read((char*)trace.Records.data(), trace.Records.size() * sizeof(VmTraceRecord));
+    if (!in)
+        return Error(std::string("Error loading VM trace. File is truncated."));
+
+    return Success(std::move(trace));
+}
+
+std::string to_string(const VmTraceRecord& record)
+{
+    std::string str = std::to_string((u64)record.Cycle) + " | " + std::to_string((u32)record.PC) + ": " + to_string(record.Code);
+
+    //Register and port values
+    const std::string reg = "r" + std::to_string(record.Code.OpRegister.Reg);
+    if (record.Flags & TracePortRead)
+        str += " | " + reg + " = " + std::to_string(record.Value) + " from port " + std::to_string(record.Code.OpRegisterValue.Value);
+    else if (record.Flags & TraceRegisterWrite)
+        str += " | " + reg + " = " + std::to_string(record.Value);
+    else if (record.Flags & TracePortWrite)
+        str += " | port " + std::to_string((Opcode)record.Code.Op.Opcode == Opcode::OpoVal ? record.Code.OpPortValue.Port : record.Code.OpRegisterValue.Value) + " = " + std::to_string(record.Value);
+
+    //Flags
+    if (record.Flags & (TraceFlagZero | TraceFlagSign))
+        str += " |";
+    if (record.Flags & TraceFlagZero)
+        str += " Z";
+    if (record.Flags & TraceFlagSign)
+        str += " S";
+
+    return str;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "Typedefs.h"
+#include "utility/Result.h"
+#include "Instruction.h"
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Bits of VmTraceRecord::Flags
+enum VmTraceFlags : u8
+{
+    TraceRegisterWrite = 1, //The instruction wrote VmTraceRecord::Value to its first register
+    TracePortRead = 2,      //ipo. Value is the port value it read.
+    TracePortWrite = 4,     //opo. Value is the value written to the port.
+    TraceFlagZero = 8,      //VM::FlagZero after the instruction
+    TraceFlagSign = 16,     //VM::FlagSign after the instruction
+};
+
+//One executed instruction. Fixed size so the trace is a flat array that's written without allocating anything.
+struct VmTraceRecord
+{
+    u64 Cycle : 40; //Cycles elapsed since the trace was enabled when the instruction executed. Includes its own cycles.
+    u64 Flags : 8; //VmTraceFlags
+    u64 PC : 16;
+    Instruction Code; //Raw instruction read from memory at PC. Superinstructions are recorded as the two instructions they're made of.
+    i32 Value; //Register or port value. See VmTraceFlags. Always 32 bit so traces have the same layout for both VM word sizes.
+};
+static_assert(sizeof(VmTraceRecord) == 16, "sizeof(VmTraceRecord) must be 16 bytes");
+
+//Ring buffer of the last instructions executed by a VM. Filled while VM::EnableTrace() is on.
+struct VmTrace
+{
+    //Preallocated by VM::EnableTrace(). Size is a power of 2 so the write position wraps with a mask. Old records are overwritten once it's full.
+    std::vector<VmTraceRecord> Records = {};
+    u64 Written = 0; //Total records written. Records[(Written - 1) % Records.size()] is the newest.
+    u64 Cycles = 0; //Cycles elapsed since the trace was enabled or cleared
+
+    //Number of records held. At most Records.size().
+    size_t Size() const { return (size_t)std::min<u64>(Written, Records.size()); }
+    //Get a record. Index 0 is the oldest one still held.
+    const VmTraceRecord& operator[](size_t index) const { return Records[(Written - Size() + index) % Records.size()]; }
+
+    static const u32 EXPECTED_SIGNATURE = ('V' << 0) | ('M' << 8) | ('T' << 16) | ('R' << 24); //ASCII "VMTR"
+
+    //Write to file. Decode it with the VmTraceDecode tool.
+    void Write(std::string_view outputFilePath) const;
+    //Read from file
+    static Result<VmTrace, std::string> Read(std::string_view inputFilePath);
+};
+
+//Header at the start of trace files written by VmTrace::Write()
+struct VmTraceHeader
+{
+    u32 Signature; //ASCII "VMTR"
+    u32 RecordSize; //sizeof(VmTraceRecord)
+    u64 Capacity; //Number of records in the ring buffer. They follow the header in ring buffer order.
+    u64 Written;
+    u64 Cycles;
+};
+
+//Describe a record. E.g. "12345 | 260: add r1 r2 | r1 = 7 | Z"
+std::string to_string(const VmTraceRecord& record);
@@ -0,0 +1,495 @@
+#include "vm/VM.h"
+#include "vm/Compiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Benchmarks the VM without the game. Runs small kernels that each stress one kind of instruction, then every robot in the robots folder.
+//Each one is run on every engine that was compiled in. Results are printed as JSON.
+//Usage: VmBench [--cycles N] [--repeat N] [--chunk N] [--robots folder] [--filter name] [--output file]
+
+#ifdef ROBOT_FOLDER_PATH
+static const char* DefaultRobotFolderPath = ROBOT_FOLDER_PATH;
+#else
+static const char* DefaultRobotFolderPath = "./robots/";
+#endif
+
+//Program that runs forever so the cycle budget decides how long it runs
+struct Kernel
+{
+    const char* Name;
+    const char* Group; //What the kernel measures. dispatch, ports, or memory
+    const char* Source;
+};
+
+static const Kernel Kernels[] =
+{
+    { "nop", "dispatch", R"(
+!loop
+    nop
+    nop
+    nop
+    nop
+    nop
+    nop
+    nop
+    nop
+    jmp !loop
+)" },
+    { "mov", "dispatch", R"(
+!loop
+    mov r0 r1
+    mov r1 r2
+    mov r2 7
+    mov r3 r0
+    mov r4 -3
+    mov r5 r4
+    mov r6 r5
+    mov r7 100
+    jmp !loop
+)" },
+    { "alu", "dispatch", R"(
+mov r1 3
+mov r2 0x5A5
+!loop
+    add r0 r1
+    sub r3 r0
+    and r3 r2
+    or r4 r3
+    xor r4 r1
+    neg r5
+    add r5 r4
+    xor r6 r5
+    jmp !loop
+)" },
+    { "alu_value", "dispatch", R"(
+!loop
+    add r0 3
+    sub r1 7
+    and r0 0x7FF
+    or r1 0x10
+    xor r2 0x5A5
+    add r2 11
+    and r3 r2
+    xor r3 13
+    jmp !loop
+)" },
+    { "mul_div", "dispatch", R"(
+mov r0 1234
+mov r1 3
+mov r2 7
+!loop
+    mul r0 r1
+    div r0 r2
+    mod r3 r2
+    mul r3 5
+    div r0 3
+    mod r0 1000
+    add r0 77
+    add r3 r0
+    jmp !loop
+)" },
+    { "compare_branch", "dispatch", R"(
+!loop
+    add r0 1
+    and r0 0xFF
+    cmp r0 r1
+    jeq !equal
+    cmp r0 64
+    jls !less
+    cmp r0 128
+    jgr !greater
+    jmp !loop
+!equal
+    add r1 1
+    jmp !loop
+!less
+    cmp r0 32
+    jne !loop
+    jmp !loop
+!greater
+    sub r1 1
+    jmp !loop
+)" },
+    { "port_read", "ports", R"(
+!loop
+    ipo r0 P_RANDOM
+    ipo r1 P_SCANNER
+    ipo r2 P_HEAT
+    ipo r3 P_COMPASS
+    add r0 r1
+    add r2 r3
+    jmp !loop
+)" },
+    { "port_write", "ports", R"(
+!loop
+    opo P_THROTTLE r0
+    opo P_STEERING 3
+    opo P_SHOOT r1
+    opo P_TURRET_OFS 10
+    add r0 1
+    add r1 2
+    jmp !loop
+)" },
+    { "load_store", "memory", R"(
+var a 1
+var b 2
+var c 3
+var d 4
+!loop
+    load r0 a
+    load r1 b
+    add r0 r1
+    store c r0
+    load r2 c
+    store d r2
+    load r3 d
+    store a r3
+    jmp !loop
+)" },
+    { "load_store_pointer", "memory", R"(
+; Unused memory between the variables and the stack. mov only accepts constants so variable addresses can't be used.
+const buffer 30000
+!loop
+    mov r4 buffer
+    mov r5 buffer
+    add r5 8
+    load r0 r4
+    add r4 2
+    load r1 r4
+    add r0 r1
+    store r5 r0
+    add r5 2
+    load r2 r5
+    store r5 r2
+    jmp !loop
+)" },
+    { "stack", "memory", R"(
+!loop
+    push r0
+    push r1
+    push r2
+    push r3
+    pop r3
+    pop r2
+    pop r1
+    pop r0
+    add r0 1
+    jmp !loop
+)" },
+    { "call_ret", "memory", R"(
+!loop
+    call !function
+    call !function
+    add r0 1
+    jmp !loop
+!function
+    add r1 r0
+    ret
+)" },
+};
+
+//Engine a VM runs programs on. Set through VM::UseJit and VM::ThreadedDispatch.
+struct Engine
+{
+    const char* Name;
+    bool UseJit;
+    bool ThreadedDispatch;
+};
+
+static const Engine Engines[] =
+{
+#ifdef VM_JIT
+    { "jit", true, true },
+#endif
+#ifdef VM_THREADED_DISPATCH
+    { "threaded", false, true },
+#endif
+    { "switch", false, false },
+};
+
+//Result of running one program on one engine
+struct BenchResult
+{
+    std::string Name;
+    std::string Group;
+    std::string Engine;
+    u64 Cycles = 0; //Cycles run by each repetition
+    u64 Instructions = 0; //Instructions run by Cycles cycles. Counted on a profiled run. 0 if the profiler was compiled out.
+    f64 MedianSeconds = 0.0;
+    f64 BestSeconds = 0.0;
+    std::string Error; //Set if the program failed to load or run
+};
+
+//Port handler context. Stubs for the robot hardware so only the cost of calling a port handler is measured.
+struct StubHardware
+{
+    VM* Vm = nullptr;
+    u64 Random = 0x9E3779B97F4A7C15; //xorshift state. Same seed for each run so the programs take the same path on each engine.
+};
+
+template<Port port>
+static void StubRead(void* context, f32)
+{
+    StubHardware& hardware = *(StubHardware*)context;
+    hardware.Random ^= hardware.Random << 13;
+    hardware.Random ^= hardware.Random >> 7;
+    hardware.Random ^= hardware.Random << 17;
+    hardware.Vm->GetPort(port) = (VmValue)(hardware.Random % 2000);
+}
+
+template<Port port>
+static void StubWrite(void*, VmValue, f32) {}
+
+template<size_t... ports>
+static PortHandlers MakeStubHandlers(std::index_sequence<ports...>)
+{
+    return PortHandlers{ { &StubRead<(Port)ports>... }, { &StubWrite<(Port)ports>... } };
+}
+static const PortHandlers StubHandlers = MakeStubHandlers(std::make_index_sequence<(size_t)Port::NumPorts>());
+
+struct BenchOptions
+{
+    u64 Cycles = 2000000; //Cycles run by each repetition
+    u32 Repeat = 5;
+    u32 Chunk = 1000; //Cycle budget passed to each VM::Run() call. Port accesses stop it early like they do in the game.
+    std::string RobotFolderPath = DefaultRobotFolderPath;
+    std::string Filter; //Only run programs with this in their name
+    std::string OutputPath; //Print to stdout if empty
+};
+
+//Run cycles cycles the same way Robot::Update() does. Returns false and sets error if the VM fails.
+static bool RunCycles(VM& vm, u64 cycles, u32 chunk, std::string& error)
+{
+    while (cycles > 0)
+    {
+        const VMStatus status = vm.Run((u32)std::min<u64>(cycles, chunk), 0.01f);
+        if (!status.Ok)
+        {
+            error = "Error in VM::Run()! Code: " + to_string(status.Code) + ", Message: " + status.Message();
+            return false;
+        }
+
+        cycles -= status.CyclesElapsed;
+    }
+    return true;
+}
+
+//Create a VM with the stub hardware attached and load program into it
+static std::unique_ptr<VM> CreateVm(const VmProgram& program, const Engine& engine, StubHardware& hardware, std::string& error)
+{
+    auto vm = std::make_unique<VM>();
+    vm->UseJit = engine.UseJit;
+    vm->ThreadedDispatch = engine.ThreadedDispatch;
+    hardware.Vm = vm.get();
+    vm->SetPortHandlers(&StubHandlers, &hardware);
+
+    Result<void, VMError> result = vm->LoadProgram(program);
+    if (result.Error())
+    {
+        error = result.Error().value().Message;
+        return nullptr;
+    }
+    return vm;
+}
+
+static BenchResult Benchmark(const std::string& name, const std::string& group, const VmProgram& program, const Engine& engine, const BenchOptions& options)
+{
+    BenchResult result;
+    result.Name = name;
+    result.Group = group;
+    result.Engine = engine.Name;
+    result.Cycles = options.Cycles;
+
+    //Count instructions on a separate run since profiled VMs always use the instrumented interpreter
+#ifdef VM_PROFILER
+    {
+        StubHardware hardware;
+        std::unique_ptr<VM> vm = CreateVm(program, engine, hardware, result.Error);
+        if (!vm)
+            return result;
+
+        vm->EnableProfiler(true);
+        if (!RunCycles(*vm, options.Cycles, options.Chunk, result.Error))
+            return result;
+
+        for (const VmProfile::InstructionCounters& counters : vm->Profile()->Instructions)
+            result.Instructions += counters.Executions;
+    }
+#endif
+
+    StubHardware hardware;
+    std::unique_ptr<VM> vm = CreateVm(program, engine, hardware, result.Error);
+    if (!vm)
+        return result;
+
+    //Warm up caches and the branch predictor
+    if (!RunCycles(*vm, options.Cycles / 10, options.Chunk, result.Error))
+        return result;
+
+    std::vector<f64> seconds;
+    for (u32 i = 0; i < options.Repeat; i++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (!RunCycles(*vm, options.Cycles, options.Chunk, result.Error))
+            return result;
+
+        const auto end = std::chrono::steady_clock::now();
+        seconds.push_back(std::chrono::duration<f64>(end - start).count());
+    }
+
+    std::sort(seconds.begin(), seconds.end());
+    result.MedianSeconds = seconds[seconds.size() / 2];
+    result.BestSeconds = seconds.front();
+    return result;
+}
+
+//Escape a string for a JSON string literal
+static std::string JsonString(std::string_view str)
+{
+    std::string out = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+
+        if ((u8)c < 0x20)
+            out += ' ';
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+static void WriteJson(FILE* out, const std::vector<BenchResult>& results, const BenchOptions& options)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"word_size\": %zu,\n", sizeof(VmValue));
+    fprintf(out, "  \"cycles\": %llu,\n", (unsigned long long)options.Cycles);
+    fprintf(out, "  \"repeat\": %u,\n", options.Repeat);
+    fprintf(out, "  \"chunk\": %u,\n", options.Chunk);
+    fprintf(out, "  \"results\": [");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& result = results[i];
+        fprintf(out, "%s\n    { \"name\": %s, \"group\": %s, \"engine\": %s", i == 0 ? "" : ",",
+            JsonString(result.Name).c_str(), JsonString(result.Group).c_str(), JsonString(result.Engine).c_str());
+        if (!result.Error.empty())
+        {
+            fprintf(out, ", \"error\": %s }", JsonString(result.Error).c_str());
+            continue;
+        }
+
+        fprintf(out, ", \"cycles\": %llu, \"median_seconds\": %.9f, \"best_seconds\": %.9f, \"cycles_per_second\": %.1f",
+            (unsigned long long)result.Cycles, result.MedianSeconds, result.BestSeconds, (f64)result.Cycles / result.MedianSeconds);
+        //Instruction counts need the profiler
+        if (result.Instructions != 0)
+            fprintf(out, ", \"instructions\": %llu, \"ns_per_instruction\": %.3f",
+                (unsigned long long)result.Instructions, result.MedianSeconds * 1e9 / (f64)result.Instructions);
+        else
+            fprintf(out, ", \"instructions\": null, \"ns_per_instruction\": null");
+
+        fprintf(out, " }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    //Parse arguments
+    BenchOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string_view arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!value)
+        {
+            printf("Missing value for %s\n", argv[i]);
+            return 1;
+        }
+
+        if (arg == "--cycles")
+            options.Cycles = std::max<u64>(std::strtoull(value, nullptr, 10), 1);
+        else if (arg == "--repeat")
+            options.Repeat = std::max<u32>(std::strtoul(value, nullptr, 10), 1);
+        else if (arg == "--chunk")
+            options.Chunk = std::max<u32>(std::strtoul(value, nullptr, 10), 1);
+        else if (arg == "--robots")
+            options.RobotFolderPath = value;
+        else if (arg == "--filter")
+            options.Filter = value;
+        else if (arg == "--output")
+            options.OutputPath = value;
+        else
+        {
+            printf("Unknown argument %s\n", argv[i]);
+            printf("Usage: VmBench [--cycles N] [--repeat N] [--chunk N] [--robots folder] [--filter name] [--output file]\n");
+            return 1;
+        }
+        i++;
+    }
+
+    //Compile programs. Kernels first, then robots sorted by name so the output order is stable.
+    struct BenchProgram
+    {
+        std::string Name;
+        std::string Group;
+        Result<VmProgram, CompilerError> Program;
+    };
+    std::vector<BenchProgram> programs;
+    for (const Kernel& kernel : Kernels)
+        if (std::string_view(kernel.Name).find(options.Filter) != std::string_view::npos)
+            programs.push_back({ kernel.Name, kernel.Group, Compiler().Compile(kernel.Source) });
+
+    std::vector<std::filesystem::path> robotPaths;
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(options.RobotFolderPath, error))
+        if (entry.is_regular_file() && entry.path().extension() == ".sunyat" && entry.path().filename().string().find(options.Filter) != std::string::npos)
+            robotPaths.push_back(entry.path());
+    if (error)
+        fprintf(stderr, "Failed to read robot folder \"%s\". Only running kernels.\n", options.RobotFolderPath.c_str());
+
+    std::sort(robotPaths.begin(), robotPaths.end());
+    for (const std::filesystem::path& path : robotPaths)
+        programs.push_back({ path.filename().string(), "robots", Compiler().CompileFile(path.string()) });
+
+    //Run each program on each engine
+    std::vector<BenchResult> results;
+    for (BenchProgram& program : programs)
+        for (const Engine& engine : Engines)
+        {
+            fprintf(stderr, "%s (%s)\n", program.Name.c_str(), engine.Name);
+            if (program.Program.Error())
+            {
+                BenchResult& result = results.emplace_back();
+                result.Name = program.Name;
+                result.Group = program.Group;
+                result.Engine = engine.Name;
+                result.Error = program.Program.Error().value().Message;
+                continue;
+            }
+
+            results.push_back(Benchmark(program.Name, program.Group, program.Program.Success().value(), engine, options));
+        }
+
+    //Output results
+    FILE* out = options.OutputPath.empty() ? stdout : fopen(options.OutputPath.c_str(), "w");
+    if (!out)
+    {
+        printf("Failed to open output file \"%s\"\n", options.OutputPath.c_str());
+        return 1;
+    }
+
+    WriteJson(out, results, options);
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include "vm/VmTrace.h"
+#include <cstdio>
+#include <cstdlib>
+
+//Decode a binary VM trace written by VmTrace::Write() into one line of text per instruction. Oldest instruction first.
+//Usage: VmTraceDecode traceFile [first] [count]
+//first and count select a range of the records held by the trace. By default all of them are printed.
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: VmTraceDecode traceFile [first] [count]\n");
+        return 1;
+    }
+
+    Result<VmTrace, std::string> result = VmTrace::Read(argv[1]);
+    if (result.Error())
+    {
+        printf("%s\n", result.Error().value().c_str());
+        return 1;
+    }
+
+    const VmTrace trace = result.Success().value();
+    const size_t first = std::min<size_t>(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 0, trace.Size());
+    const size_t count = std::min<size_t>(argc > 3 ? std::strtoull(argv[3], nullptr, 10) : trace.Size(), trace.Size() - first);
+
+    //Summary. Older records were overwritten once the ring buffer was full.
+    printf("%llu cycles, %llu instructions. Showing %zu of the last %zu.\n",
+        (unsigned long long)trace.Cycles, (unsigned long long)trace.Written, count, trace.Size());
+    for (size_t i = first; i < first + count; i++)
+        printf("%s\n", to_string(trace[i]).c_str());
+
+    return 0;
+}